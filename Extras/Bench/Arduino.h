@@ -0,0 +1,46 @@
+// Arduino
+// Copyright 2020 by miq1@gmx.de
+//
+// Minimal host replacement for the Arduino core, just enough for the header-only firmware
+// modules, Stats.cpp and TelnetLogAsync.cpp to be built on Linux for the benchmark.
+// The "cycle counter" counts nanoseconds of the monotonic clock, the "CPU" runs at 1000MHz.
+#ifndef _BENCH_ARDUINO_H
+#define _BENCH_ARDUINO_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <stdio.h>
+#include <time.h>
+
+#define IRAM_ATTR
+#define PROGMEM
+#define PSTR(s) (s)
+inline uint8_t pgm_read_byte(const void *p) { return *(const uint8_t *)p; }
+
+inline uint32_t millis() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint32_t)((uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000);
+}
+
+// Print: only the write interface TelnetLog implements
+class Print {
+public:
+  virtual ~Print() {}
+  virtual size_t write(uint8_t c) = 0;
+  virtual size_t write(const uint8_t *buffer, size_t size) = 0;
+};
+
+struct EspClass {
+  uint32_t getCycleCount() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint32_t)((uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec);
+  }
+  uint32_t getCpuFreqMHz() { return 1000; }
+  uint32_t getFreeHeap() { return 0; }
+};
+extern EspClass ESP;
+
+#endif
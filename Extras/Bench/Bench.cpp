@@ -0,0 +1,386 @@
+// Modbus bridge device V3
+// Copyright 2020 by miq1@gmx.de
+//
+// Bench: host side benchmarks and regression checks for the firmware modules that
+// do not need the ESP8266 - RingBuf, FixedRing, LatencyStat, the register map and image
+// with the FC03 read, TelnetLog and the event word encoding.
+// The firmware sources are used unchanged from ../../src, the ESP libraries are replaced by
+// the shims in this directory. ModbusMessage is the one of the eModbus Linux library.
+//
+// Output is CSV on stdout, one line per result:
+//   bench,<name>,<parameter>,<iterations>,<ns per operation>
+//   check,<name>,<parameter>,<1 for passed, 0 for failed>,
+// The exit code is the number of failed checks.
+#include <stdio.h>
+#include <stdlib.h>
+#include <chrono>
+#include <string>
+#include <vector>
+#include "Arduino.h"
+#include "RingBuf.h"
+#include "FixedRing.h"
+#include "Stats.h"
+#include "RegisterMap.h"
+#include "RegisterImage.h"
+#include "TelnetLogAsync.h"
+
+EspClass ESP;
+WiFiClass WiFi;
+
+// Defeat the optimizer: results are summed up here
+volatile uint32_t sink = 0;
+
+// Minimal time per measurement
+constexpr double MIN_NS(50e6);
+
+unsigned int failed = 0;
+
+// check: put out a check result
+void check(const char *name, const char *param, bool ok) {
+  printf("check,%s,%s,%d,\n", name, param, ok ? 1 : 0);
+  if (!ok) failed++;
+}
+
+// bench: run fn(iterations) with increasing iterations until it took MIN_NS at least.
+// fn returns the number of operations done.
+template <typename F>
+void bench(const char *name, const char *param, F fn) {
+  uint64_t iter = 16;
+  while (true) {
+    auto t0 = std::chrono::steady_clock::now();
+    uint64_t ops = fn(iter);
+    double ns = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - t0).count();
+    if (ns >= MIN_NS || iter >= (1ULL << 32)) {
+      printf("bench,%s,%s,%llu,%.3f\n", name, param, (unsigned long long)ops, ops ? ns / ops : 0.0);
+      return;
+    }
+    iter *= (ns < MIN_NS / 100) ? 16 : 2;
+  }
+}
+
+// ============= RingBuf =============
+template <typename P>
+void benchRingBuf(const char *policy, size_t size) {
+  char param[48];
+  static const unsigned int fills[] = { 25, 50, 90 };
+  for (unsigned int fill : fills) {
+    RingBuf<uint16_t, P> rb(size);
+    size_t level = size * fill / 100;
+    for (size_t i = 0; i < level; ++i) rb.push_back((uint16_t)i);
+    snprintf(param, 48, "%s size=%u fill=%u%%", policy, (unsigned int)size, fill);
+
+    // Single element push and pop at a constant fill level
+    bench("ringbuf_push_pop", param, [&](uint64_t n) {
+      for (uint64_t i = 0; i < n; ++i) {
+        rb.push_back((uint16_t)i);
+        rb.pop(1);
+      }
+      return n;
+    });
+
+    // Block of 32 elements in and out
+    uint16_t block[32];
+    for (uint16_t i = 0; i < 32; ++i) block[i] = i;
+    if (size - level >= 32) {
+      bench("ringbuf_block32", param, [&](uint64_t n) {
+        for (uint64_t i = 0; i < n; ++i) {
+          rb.push_back(block, 32);
+          rb.pop(32);
+        }
+        return n;
+      });
+    }
+
+    // safeCopy of the complete contents, per element copied
+    std::vector<uint16_t> target(size);
+    bench("ringbuf_safecopy", param, [&](uint64_t n) {
+      uint64_t got = 0;
+      for (uint64_t i = 0; i < n; ++i) {
+        got += rb.safeCopy(target.data(), size);
+        sink += target[0];
+      }
+      return got;
+    });
+  }
+}
+
+// checkRingBuf: order, wrap around and safeCopy
+template <typename P>
+void checkRingBuf(const char *policy) {
+  RingBuf<uint16_t, P> rb(10);
+  bool ok = true;
+  // Push and pop around the end several times
+  uint16_t next = 0;
+  uint16_t expect = 0;
+  for (int round = 0; round < 25; ++round) {
+    for (int i = 0; i < 7; ++i) ok &= rb.push_back(next++);
+    for (int i = 0; i < 7; ++i) {
+      ok &= (rb[0] == expect++);
+      rb.pop(1);
+    }
+  }
+  check("ringbuf_order", policy, ok && rb.empty());
+
+  // safeCopy must give the same as operator[]
+  for (uint16_t i = 0; i < 8; ++i) rb.push_back(i * 3);
+  uint16_t copy[10];
+  size_t got = rb.safeCopy(copy, 10);
+  ok = (got == 8);
+  for (size_t i = 0; i < got; ++i) ok &= (copy[i] == rb[i]);
+  check("ringbuf_safecopy", policy, ok);
+
+  // Moving safeCopy empties it
+  got = rb.safeCopy(copy, 10, true);
+  check("ringbuf_safecopy_move", policy, got == 8 && rb.empty());
+}
+
+// ============= FixedRing =============
+struct Ev {
+  uint32_t stamp;
+  uint8_t type;
+};
+
+void benchFixedRing() {
+  FixedRing<Ev, 8> fr;
+  bench("fixedring_push_pop", "N=8", [&](uint64_t n) {
+    for (uint64_t i = 0; i < n; ++i) {
+      fr.push(Ev { (uint32_t)i, 1 });
+      sink += fr.front().stamp;
+      fr.pop();
+    }
+    return n;
+  });
+
+  bool ok = true;
+  for (uint32_t i = 0; i < 8; ++i) ok &= fr.push(Ev { i, 0 });
+  ok &= !fr.push(Ev { 99, 0 }) && fr.full();
+  for (uint32_t i = 0; i < 8; ++i) {
+    ok &= (fr.front().stamp == i);
+    fr.pop();
+  }
+  check("fixedring_full", "N=8", ok && fr.empty());
+}
+
+// ============= LatencyStat =============
+void benchStats() {
+  LatencyStat st;
+  bench("latencystat_add", "", [&](uint64_t n) {
+    for (uint64_t i = 0; i < n; ++i) st.add((uint32_t)(i * 2654435761U) >> (i & 31));
+    return n;
+  });
+
+  st.clear();
+  st.add(0);
+  st.add(1);
+  st.add(2);
+  st.add(3);
+  st.add(1000);
+  st.add(70000000);
+  bool ok = st.count == 6 && st.maxUs == 70000000;
+  ok &= st.bucket[0] == 2 && st.bucket[1] == 2 && st.bucket[9] == 1 && st.bucket[STAT_BUCKETS - 1] == 1;
+  check("latencystat_buckets", "", ok);
+}
+
+// ============= Register map =============
+void benchRegisters() {
+  // FC03 requests are answered by RegisterImage::read(), as in the firmware
+  static RegisterImage image;
+  for (uint16_t i = 1; i <= MAXWORD; ++i) image.set(i, i);
+  char param[32];
+  const uint16_t sizes[] = { 1, REG_INFO_WORDS, REG_MAXREAD };
+  for (uint16_t words : sizes) {
+    ModbusMessage request(1, READ_HOLD_REGISTER);
+    request.add(REG_STATE.addr, words);
+    snprintf(param, 32, "words=%u", words);
+    bench("fc03_read", param, [&](uint64_t n) {
+      for (uint64_t i = 0; i < n; ++i) {
+        ModbusMessage response = image.read(request);
+        sink += response[3];
+      }
+      return n;
+    });
+  }
+
+  // FC03 must give back what was set, in Modbus byte order, and refuse reads beyond MAXWORD
+  image.set(REG_UPTIME.addr, (uint8_t)0x12, (uint8_t)0x34);
+  image.set(REG_ENERGY.addr, 1234.5f);
+  image.set32(REG_STATS.addr, 0xDEADBEEF);
+  bool ok = true;
+  uint16_t regs[MAXWORD];
+  for (uint16_t addr = 1; addr <= MAXWORD; addr += REG_MAXREAD) {
+    uint16_t words = (MAXWORD - addr + 1 < REG_MAXREAD) ? MAXWORD - addr + 1 : REG_MAXREAD;
+    ModbusMessage request(1, READ_HOLD_REGISTER);
+    request.add(addr, words);
+    ModbusMessage response = image.read(request);
+    ok &= response.getError() == SUCCESS && response.size() == 3 + 2 * words && response[2] == 2 * words;
+    uint16_t offs = 3;
+    for (uint16_t i = 0; i < words && ok; ++i) offs = response.get(offs, regs[addr - 1 + i]);
+  }
+  ok = ok && regs[0] == 1 && regs[REG_UPTIME.addr - 1] == 0x1234 && RM_float(regs, REG_ENERGY.addr) == 1234.5f
+    && RM_u32(regs, REG_STATS.addr) == 0xDEADBEEF && regs[MAXWORD - 1] == MAXWORD;
+  check("fc03_read", "", ok);
+  ModbusMessage beyond(1, READ_HOLD_REGISTER);
+  beyond.add(MAXWORD, (uint16_t)2);
+  ModbusMessage tooMany(1, READ_HOLD_REGISTER);
+  tooMany.add((uint16_t)1, (uint16_t)(REG_MAXREAD + 1));
+  check("fc03_range", "", image.read(beyond).getError() == ILLEGAL_DATA_ADDRESS
+    && image.read(tooMany).getError() == ILLEGAL_DATA_ADDRESS);
+
+  // Layout checks: the version must be increased whenever these change. A version not known here
+  // fails, so the checks have to be updated with the map
+  ok = false;
+  if (REG_LAYOUT_VERSION == 3) {
+    ok = REG_TIMERS.addr == 23 && REG_EVENTCOUNT.addr == 55 && REG_AO_AMPS.addr == 96
+      && REG_PENDING.addr == 98 && REG_LAYOUT.addr == 101 && REG_STATS.addr == 102
+      && REG_CHANNELCOUNT.addr == 250 && RM_channel(1) == 251 && MAXWORD == 265;
+  }
+  snprintf(param, 32, "version=%u", REG_LAYOUT_VERSION);
+  check("register_layout", param, ok);
+  // All fields must follow each other without gaps
+  const RegField map[] = { REG_STATE, REG_FLAGS, REG_UPTIME, REG_STATETIME, REG_ONTIME, REG_ENERGY,
+    REG_FACTORS, REG_MEASURES, REG_TIMERS, REG_EVENTCOUNT, REG_EVENTS, REG_AO_AMPS, REG_AO_CYCLES,
+    REG_PENDING, REG_BOOT_RELAY, REG_BOOT_MODBUS, REG_LAYOUT, REG_STATS, REG_TIMINGS, REG_CHANNELCOUNT,
+    REG_CHANNELS };
+  ok = map[0].addr == 1;
+  for (size_t i = 1; i < sizeof(map) / sizeof(map[0]); ++i) ok &= (map[i].addr == map[i - 1].next());
+  check("register_contiguous", "", ok);
+}
+
+// ============= TelnetLog =============
+static const char LOGLINE[] = "12:34:56 D Switch ON, 230.1V 0.512A 117.8W\n";
+
+// connect: a new client for the TelnetLog created last
+AsyncClient *connect(size_t space = 5744, std::string *received = nullptr) {
+  AsyncClient *c = new AsyncClient(space, received);
+  AsyncServer::latest->connect(c);
+  // Get the welcome lines out of the way
+  c->deliver();
+  if (received) received->clear();
+  return c;
+}
+
+void benchTelnet() {
+  char param[48];
+  // A log line written and sent to n clients, each acknowledging all at once
+  for (uint8_t zc = 0; zc < 2; ++zc) {
+    for (uint8_t n = 0; n <= 4; ++n) {
+      TelnetLog tl(23, 4, 3000, zc, 0);
+      tl.begin("Bench");
+      std::vector<AsyncClient *> clients;
+      for (uint8_t i = 0; i < n; ++i) clients.push_back(connect());
+      snprintf(param, 48, "clients=%u %s", n, zc ? "zerocopy" : "copy");
+      bench("telnetlog_write", param, [&](uint64_t iter) {
+        for (uint64_t i = 0; i < iter; ++i) {
+          tl.write((const uint8_t *)LOGLINE, sizeof(LOGLINE) - 1);
+          for (auto c : clients) {
+            c->poll();
+            c->deliver();
+          }
+        }
+        return iter;
+      });
+    }
+  }
+
+  // A stalled client must neither hold up nor cost data for a client keeping up,
+  // and will only see complete lines. In zero-copy mode it is aborted before data it holds
+  // references to is overwritten - the client object is gone then.
+  for (uint8_t zc = 0; zc < 2; ++zc) {
+    std::string all, fastGot, slowGot;
+    TelnetLog tl(23, 2, 3000, zc, 0);
+    tl.begin("Bench");
+    AsyncClient *fast = connect(5744, &fastGot);
+    AsyncClient *slow = connect(2900, &slowGot);
+    char line[64];
+    const char *FORMAT = "line %05d abcdefghijklmnopqrstuvwxyz\n";
+    const size_t LINELEN = snprintf(line, 64, FORMAT, 0);
+    for (int i = 0; i < 2000; i++) {
+      snprintf(line, 64, FORMAT, i);
+      tl.write((const uint8_t *)line, strlen(line));
+      all += line;
+      fast->poll();
+      fast->deliver();
+      if (tl.getActiveClients() < 2) continue;
+      slow->poll();
+      if (i % 500 == 499) slow->deliver();
+    }
+    bool aborted = tl.getActiveClients() < 2;
+    if (!aborted) slow->deliver();
+    snprintf(param, 48, "%s", zc ? "zerocopy" : "copy");
+    check("telnetlog_fast_client", param, fastGot == all);
+    bool ok = tl.getDropped() > 0 && (zc ? aborted : slowGot.find(" bytes lost ---") != std::string::npos);
+    size_t p = 0;
+    while (p < slowGot.size()) {
+      size_t e = slowGot.find('\n', p);
+      if (e == std::string::npos) break;
+      std::string l = slowGot.substr(p, e - p);
+      ok &= l.empty() || l.compare(0, 4, "--- ") == 0 || (l.size() == LINELEN - 1 && l.compare(0, 5, "line ") == 0);
+      p = e + 1;
+    }
+    check("telnetlog_slow_client", param, ok);
+  }
+}
+
+// ============= Event words =============
+void benchEvents() {
+  bench("event_encode", "", [&](uint64_t n) {
+    for (uint64_t i = 0; i < n; ++i) sink += RM_eventWord(i & 0x1F, (i >> 5) & 0x1F, (i >> 10) & 0x3F);
+    return n;
+  });
+  bench("event_decode", "", [&](uint64_t n) {
+    for (uint64_t i = 0; i < n; ++i) {
+      uint16_t w = (uint16_t)i;
+      sink += RM_eventType(w) + RM_eventHi(w) + RM_eventLo(w);
+    }
+    return n;
+  });
+
+  // Round trip for all valid values, overflowing values must not spill into other fields
+  bool ok = true;
+  for (uint8_t t = 0; t < 32; ++t) {
+    for (uint8_t hi = 0; hi < 32; ++hi) {
+      for (uint8_t lo = 0; lo < 64; ++lo) {
+        uint16_t w = RM_eventWord(t, hi, lo);
+        ok &= RM_eventType(w) == t && RM_eventHi(w) == hi && RM_eventLo(w) == lo;
+      }
+    }
+  }
+  check("event_roundtrip", "", ok);
+  check("event_masking", "", RM_eventWord(0, 0xFF, 0xFF) == 0x07FF && RM_eventWord(0xFF, 0, 0) == 0xF800);
+  // Known words: BOOT_DATE (2) on 24.12., TIMER_ON (9) at 18:05
+  check("event_known", "", RM_eventWord(2, 24, 12) == 0x160C && RM_eventWord(9, 18, 5) == 0x4C85);
+
+  // registerEvent() encoding: every minute of a leap year, as time and as date event
+  ok = true;
+  time_t t0 = 1577836800;    // 2020-01-01 00:00:00 UTC
+  for (time_t t = t0; t < t0 + 366 * 86400; t += 60) {
+    struct tm tm;
+    gmtime_r(&t, &tm);
+    uint16_t w = RM_eventAt(9, false, tm);
+    ok &= RM_eventType(w) == 9 && RM_eventHi(w) == tm.tm_hour && RM_eventLo(w) == tm.tm_min;
+    w = RM_eventAt(1, true, tm);
+    ok &= RM_eventType(w) == 1 && RM_eventHi(w) == tm.tm_mday && RM_eventLo(w) == tm.tm_mon + 1;
+  }
+  check("event_at", "", ok);
+}
+
+int main(int argc, char **argv) {
+  printf("kind,name,parameter,iterations,ns_per_op\n");
+
+  checkRingBuf<RB_LOCKED>("locked");
+  checkRingBuf<RB_SPSC>("spsc");
+  static const size_t sizes[] = { 16, 256, 4096 };
+  for (size_t size : sizes) {
+    benchRingBuf<RB_LOCKED>("locked", size);
+    benchRingBuf<RB_SPSC>("spsc", size);
+  }
+  benchFixedRing();
+  benchStats();
+  benchRegisters();
+  benchTelnet();
+  benchEvents();
+
+  fflush(stdout);
+  if (failed) fprintf(stderr, "%u check(s) failed\n", failed);
+  return failed;
+}
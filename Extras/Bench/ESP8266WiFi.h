@@ -0,0 +1,20 @@
+// ESP8266WiFi
+// Copyright 2020 by miq1@gmx.de
+//
+// Host replacement for the ESP8266 WiFi library: TelnetLog only asks for the local IP address.
+#ifndef _BENCH_ESP8266WIFI_H
+#define _BENCH_ESP8266WIFI_H
+
+#include <Arduino.h>
+
+struct IPAddress {
+  uint8_t bytes[4];
+  uint8_t operator[](int i) const { return bytes[i]; }
+};
+
+struct WiFiClass {
+  IPAddress localIP() { return IPAddress { { 127, 0, 0, 1 } }; }
+};
+extern WiFiClass WiFi;
+
+#endif
@@ -0,0 +1,110 @@
+// ESPAsyncTCP
+// Copyright 2020 by miq1@gmx.de
+//
+// Host replacement for ESPAsyncTCP. There is no network: an AsyncClient collects what is added,
+// deliver() plays the peer receiving and acknowledging it, poll() the lwIP poll timer.
+// Data added by reference is read at delivery only, like lwIP would do when sending late.
+// AsyncServer::connect() hands a new client to the server as if it had connected.
+// abort() reports the disconnect right away, as ESPAsyncTCP does.
+#ifndef _BENCH_ESPASYNCTCP_H
+#define _BENCH_ESPASYNCTCP_H
+
+#include <Arduino.h>
+#include <string>
+#include <vector>
+
+#define ASYNC_WRITE_FLAG_COPY 0x01
+
+class AsyncClient {
+public:
+  typedef void (*AcConnectHandler)(void *, AsyncClient *);
+  typedef void (*AcAckHandler)(void *, AsyncClient *, size_t, uint32_t);
+  typedef void (*AcDataHandler)(void *, AsyncClient *, void *, size_t);
+
+  // space: send buffer size. received: if not nullptr, all data delivered is appended there
+  explicit AsyncClient(size_t space = 5744, std::string *received = nullptr)
+    : AC_free(space), AC_received(received) {}
+
+  bool connected() { return AC_connected; }
+  bool canSend() { return AC_free > 0; }
+  size_t space() { return AC_free; }
+  size_t add(const char *data, size_t size, uint8_t apiflags = ASYNC_WRITE_FLAG_COPY) {
+    if (size > AC_free) size = AC_free;
+    AC_free -= size;
+    Segment s { data, size, std::string() };
+    // Copies are taken now - by ESPAsyncTCP as well
+    if (apiflags & ASYNC_WRITE_FLAG_COPY) {
+      s.copy.assign(data, size);
+      s.data = nullptr;
+    }
+    AC_segments.push_back(s);
+    return size;
+  }
+  bool send() { return true; }
+  void close(bool = false) {}
+  void stop() {}
+  int8_t abort() {
+    // The data not delivered is gone, references included
+    AC_segments.clear();
+    AC_connected = false;
+    if (AC_discCb) AC_discCb(AC_discArg, this);
+    return -13;
+  }
+
+  void onData(AcDataHandler, void *) {}
+  void onPoll(AcConnectHandler cb, void *arg) { AC_pollCb = cb; AC_pollArg = arg; }
+  void onAck(AcAckHandler cb, void *arg) { AC_ackCb = cb; AC_ackArg = arg; }
+  void onDisconnect(AcConnectHandler cb, void *arg) { AC_discCb = cb; AC_discArg = arg; }
+
+  // poll: call the poll handler
+  void poll() { if (AC_connected && AC_pollCb) AC_pollCb(AC_pollArg, this); }
+  // deliver: the peer gets all data added and acknowledges it
+  void deliver() {
+    size_t len = 0;
+    for (auto& s : AC_segments) {
+      if (AC_received) {
+        if (s.data) AC_received->append(s.data, s.size);
+        else AC_received->append(s.copy);
+      }
+      len += s.size;
+    }
+    AC_segments.clear();
+    AC_free += len;
+    if (len && AC_ackCb) AC_ackCb(AC_ackArg, this, len, 0);
+  }
+
+protected:
+  struct Segment {
+    const char *data;         // Data by reference, nullptr for a copy
+    size_t size;
+    std::string copy;
+  };
+  std::vector<Segment> AC_segments;         // Data added, not yet delivered
+  size_t AC_free;
+  std::string *AC_received;
+  AcConnectHandler AC_pollCb = nullptr;
+  void *AC_pollArg = nullptr;
+  AcAckHandler AC_ackCb = nullptr;
+  void *AC_ackArg = nullptr;
+  AcConnectHandler AC_discCb = nullptr;
+  void *AC_discArg = nullptr;
+  bool AC_connected = true;
+};
+
+class AsyncServer {
+public:
+  explicit AsyncServer(uint16_t) { latest = this; }
+  void onClient(AsyncClient::AcConnectHandler cb, void *arg) { AS_cb = cb; AS_arg = arg; }
+  void begin() {}
+  void end() {}
+  void setNoDelay(bool) {}
+  // connect: a new client has connected
+  void connect(AsyncClient *c) { if (AS_cb) AS_cb(AS_arg, c); }
+  // The server created last, for the benchmark to connect clients to
+  static inline AsyncServer *latest = nullptr;
+protected:
+  AsyncClient::AcConnectHandler AS_cb = nullptr;
+  void *AS_arg = nullptr;
+};
+
+#endif
@@ -3,11 +3,28 @@
 #include <iostream>
 #include <iomanip>
 #include <regex>
+#include <ctime>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <fstream>
+#include <sstream>
+#include <vector>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <cerrno>
+#include <strings.h>
 #include "Logging.h"
 #include "ModbusClientTCP.h"
 #include "parseTarget.h"
+#include "../src/RegisterMap.h"
 
 using std::cout;
+using std::cerr;
 using std::endl;
 using std::printf;
 using std::hex;
@@ -53,23 +70,64 @@ struct SDtimers {
   uint8_t onOff;
   uint8_t hour;
   uint8_t minute;
-} timerData[16];
+} timerData[NUM_TIMERS];
+
+// Event types as known to the firmware
+enum S_EVENT : uint8_t  { 
+  NO_EVENT=0, DATE_CHANGE,
+  BOOT_DATE, BOOT_TIME, 
+  DEFAULT_ON,
+  BUTTON_ON, BUTTON_OFF,
+  MODBUS_ON, MODBUS_OFF,
+  TIMER_ON, TIMER_OFF,
+  FAUXMO_ON, FAUXMO_OFF,
+  WIFI_DISCONN, WIFI_CONN, WIFI_LOST,
+  AUTOOFF,
+  UNKNOWN
+};
+const char *eventname[] = { 
+  "no event", "date change", "boot date", "boot time", "default on",
+  "button on", "button off", 
+  "Modbus on", "Modbus off", 
+  "timer on", "timer off", 
+  "Fauxmo on", "Fauxmo off", 
+  "WiFi disconnected", "WiFi connected", "WiFi lost",
+  "Low power off",
+  "Unknown event"
+};
+
+// printEvent: print an event record as delivered by USER_DEFINED_45 and _46
+void printEvent(uint32_t seq, uint32_t epoch, uint8_t ev) {
+  char buf[128];
+  time_t t = epoch;
+  char tbuf[32];
+  strftime(tbuf, 32, "%Y-%m-%d %H:%M:%S", localtime(&t));
+  snprintf(buf, 128, "%6u %s %2d %s", seq, tbuf, ev, eventname[ev >= (uint8_t)UNKNOWN ? (uint8_t)UNKNOWN : ev]);
+  cout << buf << endl;
+}
 
 // Commands understood
 const char *cmds[] = { "INFO", "ON", "OFF", "DEFAULT", "EVERY", "RESET", 
-  "ADJUST", "TIMER", "EVENTS", "AUTOOFF", "_X_END" };
-enum CMDS : uint8_t { INFO = 0, SW_ON, SW_OFF, DEFLT, EVRY, RST_CNT, FCTR, TIMR, EVNTS, ATOF, X_END };
+  "ADJUST", "TIMER", "EVENTS", "AUTOOFF", "HISTORY", "STATS", "LISTEN", "SNAPSHOT", "_X_END" };
+enum CMDS : uint8_t { INFO = 0, SW_ON, SW_OFF, DEFLT, EVRY, RST_CNT, FCTR, TIMR, EVNTS, ATOF, HSTRY, STATS, LSTN, SNAP, X_END };
+
+// Output formats for EVERY
+enum OUT_FORMAT : uint8_t { FMT_TEXT = 0, FMT_CSV, FMT_BIN };
+// Messages go to stderr, if stdout is taken by machine-readable output
+bool machineOut = false;
 
 void handleError(Error error, uint32_t token) 
 {
   // ModbusError wraps the error code and provides a readable error message for it
   ModbusError me(error);
-  cout << "Error response: " << (int)me << " - " << (const char *)me << " at " << token << endl;
+  (machineOut ? cerr : cout) << "Error response: " << (int)me << " - " << (const char *)me << " at " << token << endl;
 }
 
 void usage(const char *msg) {
   cout << msg << endl;
   cout << "Usage: Smartdose host[:port[:serverID]]] [cmd [cmd_parms]]" << endl;
+  cout << "       Smartdose host,host,...|@file [INFO [<parallel>]|EVERY <seconds> [<parallel>]|TIMER LOAD <file> [<parallel>]]" << endl;
+  cout << "       Smartdose group[:port] LISTEN" << endl;
   cout << "  cmd: ";
   for (uint8_t c = 0; c < X_END; c++) {
     if (c) cout << " | ";
@@ -77,15 +135,21 @@ void usage(const char *msg) {
   }
   cout << endl;
   cout << "  DEFAULT ON|OFF" << endl;
-  cout << "  EVERY <seconds>" << endl;
+  cout << "  EVERY <seconds> [CSV|BIN]" << endl;
   cout << "  ADJUST [V|A|W [<measured value>]]" << endl;
   cout << "  AUTOOFF <milliamps> <cycles>" << endl;
+  cout << "  EVENTS [TAIL [<seconds>]]" << endl;
+  cout << "  HISTORY [SAMPLES|MINUTES|HOURS]" << endl;
+  cout << "  STATS" << endl;
+  cout << "  SNAPSHOT [ACK <seq> <boot ID>]" << endl;
   cout << "  TIMER [<n> [<arg> [<arg> [...]]]]" << endl;
+  cout << "  TIMER LOAD <file>" << endl;
   cout << "    n: 1..16" << endl;
-  cout << "    arg: ACTIVE|INACTIVE|ON|OFF|DAILY|WORKDAYS|WEEKEND|<day>|<hh24>:<mm>|CLEAR" << endl;
+  cout << "    arg: ACTIVE|INACTIVE|ON|OFF|DAILY|WORKDAYS|WEEKEND|<day>|<hh24>:<mm>|CH<c>|CLEAR" << endl;
   cout << "    day: SUN|MON|TUE|WED|THU|FRI|SAT" << endl;
   cout << "    hh24: 0..23" << endl;
   cout << "    mm: 0..59" << endl;
+  cout << "    c: 1..4, channel to switch (default 1)" << endl;
 }
 
 void printTimer(uint8_t tnum, SDtimers& t) {
@@ -94,10 +158,16 @@ void printTimer(uint8_t tnum, SDtimers& t) {
   snprintf(buf, 128, "Timer %2d: %3s %3s %02d:%02d", 
     (unsigned int)tnum,
     t.activeDays & 0x80 ? "ACT" : " ",
-    t.onOff & 0x01 ? "ON" : "OFF",
+    t.onOff & TIMER_ONMASK ? "ON" : "OFF",
     t.hour,
     t.minute
   );
+  // Channels other than the first are shown explicitly
+  if (RM_timerChannel(t.onOff)) {
+    char chbuf[8];
+    snprintf(chbuf, 8, " CH%u", (unsigned int)RM_timerChannel(t.onOff) + 1);
+    strncat(buf, chbuf, 127);
+  }
   if (t.activeDays & 0x01) { strncat(buf, " SUN", 127); }
   if (t.activeDays & 0x02) { strncat(buf, " MON", 127); }
   if (t.activeDays & 0x04) { strncat(buf, " TUE", 127); }
@@ -108,7 +178,714 @@ void printTimer(uint8_t tnum, SDtimers& t) {
   cout << buf << endl;
 }
 
+// timerArg: apply one TIMER argument to a timer. Returns nullptr if fine, else an error message
+const char *timerArg(const char *arg, SDtimers& t) {
+// ON?
+  if (strncasecmp(arg, "ON", 2) == 0) {
+    t.onOff |= TIMER_ONMASK;
+// OFF?
+  } else if (strncasecmp(arg, "OFF", 3) == 0) {
+    t.onOff &= ~TIMER_ONMASK;
+// CHannel?
+  } else if (strncasecmp(arg, "CH", 2) == 0) {
+    int ch = atoi(arg + 2);
+    if (ch < 1 || ch > MAX_CHANNELS) {
+      return "Channel must be 1..4!";
+    }
+    t.onOff = (t.onOff & ~TIMER_CHANNELMASK) | ((ch - 1) << TIMER_CHANNELSHIFT);
+// ACTIVE?
+  } else if (strncasecmp(arg, "ACTIVE", 6) == 0) {
+    t.activeDays |= 0x80;
+// INACTIVE?
+  } else if (strncasecmp(arg, "INACTIVE", 8) == 0) {
+    t.activeDays &= 0x7F;
+// SUNday?
+  } else if (strncasecmp(arg, "SUN", 3) == 0) {
+    t.activeDays |= 0x01;
+// MONday?
+  } else if (strncasecmp(arg, "MON", 3) == 0) {
+    t.activeDays |= 0x02;
+// TUEsday?
+  } else if (strncasecmp(arg, "TUE", 3) == 0) {
+    t.activeDays |= 0x04;
+// WEDnesday?
+  } else if (strncasecmp(arg, "WED", 3) == 0) {
+    t.activeDays |= 0x08;
+// THUrsday?
+  } else if (strncasecmp(arg, "THU", 3) == 0) {
+    t.activeDays |= 0x10;
+// FRIday?
+  } else if (strncasecmp(arg, "FRI", 3) == 0) {
+    t.activeDays |= 0x20;
+// SATurday?
+  } else if (strncasecmp(arg, "SAT", 3) == 0) {
+    t.activeDays |= 0x40;
+// WORKday?
+  } else if (strncasecmp(arg, "WORK", 4) == 0) {
+    t.activeDays |= 0x3E;
+// WEEKEND?
+  } else if (strncasecmp(arg, "WEEKEND", 7) == 0) {
+    t.activeDays |= 0x41;
+// DAILY?
+  } else if (strncasecmp(arg, "DAILY", 5) == 0) {
+    t.activeDays |= 0x7F;
+// CLEAR?
+  } else if (strncasecmp(arg, "CLEAR", 5) == 0) {
+    t.activeDays = 0;
+    t.onOff = 0;
+    t.hour = 0;
+    t.minute = 0;
+// HH24:MM?
+  } else if (*arg >= '0' && *arg <= '9') {
+    const char *cp = arg;
+    uint16_t hh = 0;
+    uint16_t mm = 0;
+//  Get hours value first
+    while (*cp>= '0' && *cp <= '9') {
+      hh *= 10;
+      hh += (*cp - '0');
+      cp++;
+    }
+//  Valid hour?
+    if (hh < 24) {
+//    Yes, check separator
+      if (*cp == ':') {
+//      Is OK, get minutes value
+        cp++;
+        while (*cp>= '0' && *cp <= '9') {
+          mm *= 10;
+          mm += (*cp - '0');
+          cp++;
+        }
+//      Valid minute?
+        if (mm < 60) {
+//        Yes, use time
+          t.hour = hh;
+          t.minute = mm;
+        } else {
+//        No, minute is invalid
+          return "Minute must be 0..59!";
+        }
+      } else {
+//      No, separator not found
+        return "Time must be given as HH:MM!";
+      }
+    } else {
+//    No, hour is invalid
+      return "Hour must be 0..23!";
+    }
+// Unknown parameter.
+  } else {
+    static char msg[128];
+    snprintf(msg, 128, "Invalid TIMER parameter '%s'!", arg);
+    return msg;
+  }
+  return nullptr;
+}
+
+// readSchedule: read a complete timer schedule from a file.
+// Each line has a timer number and TIMER arguments; '#' starts a comment.
+// Every timer starts cleared, so timers not mentioned will be cleared on the device.
+// Returns nullptr if fine, else an error message
+const char *readSchedule(const char *fname, SDtimers sched[NUM_TIMERS]) {
+  static char msg[160];
+  std::ifstream in(fname);
+  if (!in) {
+    snprintf(msg, 160, "Cannot read schedule file '%s'!", fname);
+    return msg;
+  }
+  bool seen[NUM_TIMERS] = { false };
+  memset(sched, 0, NUM_TIMERS * sizeof(SDtimers));
+  string line;
+  unsigned int lineNo = 0;
+  while (std::getline(in, line)) {
+    lineNo++;
+    size_t cpos = line.find('#');
+    if (cpos != string::npos) line.erase(cpos);
+    std::istringstream words(line);
+    string word;
+    if (!(words >> word)) continue;
+    int tim = atoi(word.c_str());
+    if (tim < 1 || tim > NUM_TIMERS) {
+      snprintf(msg, 160, "%s:%u: timer number must be 1..%u!", fname, lineNo, (unsigned int)NUM_TIMERS);
+      return msg;
+    }
+    tim--;
+    if (seen[tim]) {
+      snprintf(msg, 160, "%s:%u: timer %d is given twice!", fname, lineNo, tim + 1);
+      return msg;
+    }
+    seen[tim] = true;
+    while (words >> word) {
+      const char *err = timerArg(word.c_str(), sched[tim]);
+      if (err) {
+        snprintf(msg, 160, "%s:%u: %s", fname, lineNo, err);
+        return msg;
+      }
+    }
+  }
+  return nullptr;
+}
+
+// loadTimers: bring the timers of a device to the schedule given.
+// The timers are read first, only the range from the first to the last changed timer is written, in one FC10 request.
+// A line describing the outcome is put into result. Returns true if the device has the schedule now.
+bool loadTimers(ModbusClientTCP& mb, uint8_t server, const SDtimers sched[NUM_TIMERS], string& result) {
+  char buf[128];
+  auto fail = [&](Error err, const char *what) {
+    ModbusError me(err);
+    snprintf(buf, 128, "%s failed: %02X - %s", what, (unsigned int)(int)me, (const char *)me);
+    result = buf;
+    return false;
+  };
+
+  // Timers supported?
+  ModbusMessage response = mb.syncRequest(30, server, READ_HOLD_REGISTER, REG_FLAGS.addr, (uint16_t)1);
+  if (response.getError() != SUCCESS) return fail(response.getError(), "Reading flags");
+  uint16_t flags = 0;
+  response.get(3, flags);
+  if (!(flags & 0x0800)) {
+    result = "device has no timer function!";
+    return false;
+  }
+
+  // Get the current timers
+  response = mb.syncRequest(31, server, READ_HOLD_REGISTER, REG_TIMERS.addr, REG_TIMERS.words());
+  if (response.getError() != SUCCESS) return fail(response.getError(), "Reading timers");
+  SDtimers cur[NUM_TIMERS];
+  uint16_t offs = 3;
+  for (uint8_t i = 0; i < NUM_TIMERS; i++) {
+    offs = response.get(offs, cur[i].activeDays, cur[i].onOff, cur[i].hour, cur[i].minute);
+  }
+
+  // Find the range of changed timers
+  int first = -1;
+  int last = -1;
+  unsigned int changed = 0;
+  for (int i = 0; i < NUM_TIMERS; i++) {
+    if (memcmp(&cur[i], &sched[i], sizeof(SDtimers))) {
+      if (first < 0) first = i;
+      last = i;
+      changed++;
+    }
+  }
+  if (first < 0) {
+    result = "timers unchanged";
+    return true;
+  }
+
+  // Write the range in one go
+  uint16_t addr = REG_TIMERS.at(first * 2);
+  uint16_t words = (last - first + 1) * 2;
+  ModbusMessage request;
+  request.add(server, WRITE_MULT_REGISTERS, addr, words, (uint8_t)(words * 2));
+  for (int i = first; i <= last; i++) {
+    request.add(sched[i].activeDays, sched[i].onOff, sched[i].hour, sched[i].minute);
+  }
+  response = mb.syncRequest(request, (uint32_t)32);
+  if (response.getError() != SUCCESS) return fail(response.getError(), "Writing timers");
+  snprintf(buf, 128, "%u timer%s changed, %d..%d written", changed, changed == 1 ? "" : "s", first + 1, last + 1);
+  result = buf;
+  return true;
+}
+
+// listenFrames: receive and print the measurement frames devices send to a multicast group
+int listenFrames(const char *target) {
+  char buf[160];
+  char group[64];
+  uint16_t port = 4711;
+
+  // Get group address and optional port
+  strncpy(group, target, 63);
+  group[63] = 0;
+  char *cp = strchr(group, ':');
+  if (cp) {
+    *cp++ = 0;
+    port = atoi(cp);
+  }
+  struct ip_mreq mreq;
+  memset(&mreq, 0, sizeof(mreq));
+  if (inet_pton(AF_INET, group, &mreq.imr_multiaddr) != 1 || !port) {
+    usage("LISTEN needs a multicast group address!");
+    return -1;
+  }
+  mreq.imr_interface.s_addr = htonl(INADDR_ANY);
+
+  // Set up the socket and join the group
+  int sock = socket(AF_INET, SOCK_DGRAM, 0);
+  if (sock < 0) {
+    perror("socket");
+    return -1;
+  }
+  int yes = 1;
+  setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
+  struct sockaddr_in addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_ANY);
+  addr.sin_port = htons(port);
+  if (bind(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0 
+   || setsockopt(sock, IPPROTO_IP, IP_ADD_MEMBERSHIP, &mreq, sizeof(mreq)) < 0) {
+    perror("LISTEN");
+    close(sock);
+    return -1;
+  }
+  cout << "Listening on " << group << ":" << port << endl;
+
+  uint32_t lines = 0;
+  while (1) {
+    uint8_t frame[512];
+    struct sockaddr_in from;
+    socklen_t fromLen = sizeof(from);
+    ssize_t len = recvfrom(sock, frame, sizeof(frame), 0, (struct sockaddr *)&from, &fromLen);
+    if (len < 0) {
+      perror("recvfrom");
+      break;
+    }
+    // Check the header. Version 1 frames carry at least registers 1..22, version 2 adds the boot ID
+    if (len < 16 || frame[0] != 'S' || frame[1] != 'D' || frame[2] < 1 || frame[2] > 2) continue;
+    uint16_t hdr = (frame[2] == 1) ? 16 : 20;
+    uint16_t regs = frame[3];
+    if (regs < REG_MEASURES.next() - 1 || len < hdr + regs * 2 + 1) continue;
+    auto get16 = [&](uint16_t offs) { return (uint16_t)((frame[offs] << 8) | frame[offs + 1]); };
+    auto get32 = [&](uint16_t offs) { return ((uint32_t)get16(offs) << 16) | get16(offs + 2); };
+    // Register n is at hdr + 2 * (n - 1)
+    auto reg = [&](uint16_t n) { return get16(hdr + 2 * (n - 1)); };
+    auto regF = [&](uint16_t n) {
+      uint32_t w = get32(hdr + 2 * (n - 1));
+      float f;
+      memcpy(&f, &w, sizeof(f));
+      return f;
+    };
+    char name[64];
+    uint16_t nOffs = hdr + regs * 2;
+    uint8_t nLen = frame[nOffs];
+    if (nLen > 63) nLen = 63;
+    if (nOffs + 1 + nLen > len) nLen = len - nOffs - 1;
+    memcpy(name, frame + nOffs + 1, nLen);
+    name[nLen] = 0;
+
+    if (lines % 24 == 0) {
+      cout << "Time      Device           Address          State      ON time          V         A         W          Wh  Event" << endl;
+    }
+    lines++;
+    char tbuf[16];
+    time_t t = time(NULL);
+    strftime(tbuf, 16, "%H:%M:%S", localtime(&t));
+    char ipbuf[INET_ADDRSTRLEN];
+    inet_ntop(AF_INET, &from.sin_addr, ipbuf, sizeof(ipbuf));
+    uint16_t ms = reg(REG_ONTIME.addr + 1);
+    snprintf(buf, 160, "%-9s %-16s %-15s %3s (%3u) %6u:%02u:%02u %8.1f %9.3f %9.1f %11.3f %6u",
+      tbuf, name, ipbuf, 
+      reg(REG_STATE.addr) ? "ON" : "OFF", (unsigned int)reg(REG_STATE.addr),
+      (unsigned int)reg(REG_ONTIME.addr), (unsigned int)(ms >> 8), (unsigned int)(ms & 0xFF),
+      regF(REG_MEASURES.at(0)), regF(REG_MEASURES.at(1)), regF(REG_MEASURES.at(2)), regF(REG_ENERGY.addr),
+      (unsigned int)get32(12));
+    cout << buf << endl;
+  }
+  close(sock);
+  return 0;
+}
+
+// ============= Sample timing =============
+// Deadline keeps a cadence of interval seconds on the monotonic clock, aligned to wall clock
+// multiples of the interval. Time spent for requests will not add up to a drift.
+struct Deadline {
+  struct timespec next;
+  unsigned int interval;
+
+  // start: set the first deadline to the next wall clock multiple of iv seconds
+  void start(unsigned int iv) {
+    interval = iv;
+    struct timespec real;
+    clock_gettime(CLOCK_REALTIME, &real);
+    clock_gettime(CLOCK_MONOTONIC, &next);
+    // Nanoseconds to the next multiple
+    uint64_t rNs = (uint64_t)real.tv_sec * 1000000000ULL + real.tv_nsec;
+    uint64_t ivNs = (uint64_t)interval * 1000000000ULL;
+    uint64_t toGo = ivNs - rNs % ivNs;
+    add(toGo);
+  }
+
+  // wait: sleep until the deadline, then set the next one.
+  // If we were late for more than an interval, deadlines missed are skipped.
+  void wait() {
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL) == EINTR) {}
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    do {
+      add((uint64_t)interval * 1000000000ULL);
+    } while (next.tv_sec < now.tv_sec || (next.tv_sec == now.tv_sec && next.tv_nsec <= now.tv_nsec));
+  }
+
+protected:
+  void add(uint64_t ns) {
+    ns += next.tv_nsec;
+    next.tv_sec += ns / 1000000000ULL;
+    next.tv_nsec = ns % 1000000000ULL;
+  }
+};
+
+// Binary sample record for EVERY ... BIN, host byte order
+struct __attribute__((packed)) SampleRecord {
+  uint64_t timeMs;           // Time of the sample, ms since the epoch
+  uint8_t version;           // Record version, 1
+  uint8_t state;             // Switch state, 0=OFF, else dim value
+  uint16_t flags;            // Flag register
+  uint32_t upTime;           // seconds
+  uint32_t stateTime;        // seconds
+  uint32_t onTime;           // seconds
+  float energy;              // Wh
+  float watts;
+  float volts;
+  float amps;
+};
+
+// ============= Fleet mode =============
+// Fleet mode will poll many devices at once. Each target has its own client, the requests are
+// sent asynchronously to all of them, limited by the number of requests in flight allowed.
+struct FleetTarget {
+  string name;               // Target descriptor as given
+  IPAddress ip;
+  uint16_t port;
+  uint8_t server;
+  Client cl;
+  ModbusClientTCP *mb;
+  uint16_t regs[126];        // regs[n - 1] is register n
+  uint16_t span;             // Number of registers needed, 0: not known yet
+  uint16_t aoAddr;           // Address of the auto power off registers
+  enum FT_STATE : uint8_t { FT_IDLE = 0, FT_WAIT, FT_ANSWER, FT_DONE } state;
+  bool valid;                // Data of this cycle complete
+  uint8_t step;              // 0: register block, 1: auto power off registers
+  bool legacy;               // Older firmware, the short read plan is used while the layout is unknown
+  ModbusMessage response;    // Response received
+  Error err;                 // Error received
+  FleetTarget() : port(502), server(1), mb(nullptr), span(0), aoAddr(0), state(FT_IDLE), valid(false), step(0), legacy(false), err(SUCCESS) {}
+};
+
+std::mutex fleetLock;
+std::condition_variable fleetDone;
+
+// fleetTargets: collect the target descriptors from a comma separated list or a file (@file)
+bool fleetTargets(const char *arg, std::vector<string>& list) {
+  if (*arg == '@') {
+    std::ifstream in(arg + 1);
+    if (!in) return false;
+    string line;
+    while (std::getline(in, line)) {
+      // Skip comments and white space
+      size_t e = line.find('#');
+      if (e != string::npos) line.erase(e);
+      size_t b = line.find_first_not_of(" \t\r");
+      if (b == string::npos) continue;
+      e = line.find_last_not_of(" \t\r");
+      list.push_back(line.substr(b, e - b + 1));
+    }
+  } else {
+    string s(arg);
+    size_t b = 0;
+    while (b <= s.size()) {
+      size_t e = s.find(',', b);
+      if (e == string::npos) e = s.size();
+      if (e > b) list.push_back(s.substr(b, e - b));
+      b = e + 1;
+    }
+  }
+  return !list.empty();
+}
+
+// fleetRequest: issue the next request for a target
+void fleetRequest(FleetTarget& t, uint32_t token) {
+  uint16_t addr = REG_STATE.addr;
+  uint16_t words = t.span ? t.span : (t.legacy ? REG_LEGACY_WORDS : REG_INFO_WORDS);
+  if (t.step) {
+    addr = t.aoAddr;
+    words = 2;
+  }
+  t.state = FleetTarget::FT_WAIT;
+  Error e = t.mb->addRequest((token << 1) | t.step, t.server, READ_HOLD_REGISTER, addr, words);
+  if (e != SUCCESS) {
+    t.err = e;
+    t.state = FleetTarget::FT_ANSWER;
+  }
+}
+
+// fleetAnswer: take over a response. Returns true if another request is needed for the target
+bool fleetAnswer(FleetTarget& t) {
+  if (t.err != SUCCESS) {
+    // First read refused by older firmware with less registers? Then try its short plan right away
+    if (!t.step && !t.span && !t.legacy && t.err == ILLEGAL_DATA_ADDRESS) {
+      t.legacy = true;
+      t.err = SUCCESS;
+      return true;
+    }
+    // Auto off registers failed? Then find out the layout again next cycle, like with a single device
+    if (t.step) {
+      t.span = 0;
+      t.legacy = false;
+    }
+    return false;
+  }
+  uint16_t offs = 3;
+  if (t.step == 0) {
+    uint16_t words = t.span ? t.span : (t.legacy ? REG_LEGACY_WORDS : REG_INFO_WORDS);
+    for (uint16_t i = 0; i < words; ++i) {
+      offs = t.response.get(offs, t.regs[i]);
+    }
+    // Layout yet unknown?
+    if (!t.span) {
+      // Yes. Use the plan, if the device has our layout
+      t.span = words;
+      t.aoAddr = REG_AO_AMPS.addr;
+      if (!RM_layoutMatches(t.regs, words)) {
+        // No. Older firmware: the auto off registers are behind the event slots
+        t.aoAddr = REG_EVENTS.addr + t.regs[REG_EVENTCOUNT.addr - 1];
+        if (t.aoAddr + 1 > REG_MAXREAD) {
+          t.err = ILLEGAL_DATA_ADDRESS;
+          t.span = 0;
+          return false;
+        }
+        // Not covered by the first read?
+        if ((t.regs[REG_FLAGS.addr - 1] & 0x8000) && t.aoAddr + 1 > t.span) {
+          t.step = 1;
+          return true;
+        }
+      }
+    }
+  } else {
+    offs = t.response.get(offs, t.regs[t.aoAddr - 1], t.regs[t.aoAddr]);
+    t.span = t.aoAddr + 1;
+    t.step = 0;
+  }
+  t.valid = true;
+  return false;
+}
+
+// fleetPrint: put out one line per target
+void fleetPrint(std::vector<FleetTarget *>& fleet) {
+  char buf[160];
+  snprintf(buf, 160, "%-24s %-9s %13s %13s %10s %10s %10s %10s", 
+    "Device", "State", "Run time", "ON time", "kWh", "W", "V", "A");
+  cout << buf << endl;
+  for (auto tp : fleet) {
+    FleetTarget& t = *tp;
+    if (!t.valid) {
+      ModbusError me(t.err);
+      snprintf(buf, 160, "%-24s Error %02X - %s", t.name.c_str(), (unsigned int)(int)me, (const char *)me);
+    } else {
+      int len = snprintf(buf, 160, "%-24s %-3s (%3u) %6u:%02u:%02u %6u:%02u:%02u",
+        t.name.c_str(),
+        t.regs[0] ? "ON" : "OFF", (unsigned int)t.regs[0],
+        (unsigned int)t.regs[2], (unsigned int)(t.regs[3] >> 8), (unsigned int)(t.regs[3] & 0xFF),
+        (unsigned int)t.regs[6], (unsigned int)(t.regs[7] >> 8), (unsigned int)(t.regs[7] & 0xFF));
+      if (t.regs[REG_FLAGS.addr - 1] & 0x8000) {
+        snprintf(buf + len, 160 - len, " %10.2f %10.2f %10.2f %10.2f",
+          RM_float(t.regs, REG_ENERGY.addr) / 1000.0, RM_float(t.regs, REG_MEASURES.at(2)),
+          RM_float(t.regs, REG_MEASURES.at(0)), RM_float(t.regs, REG_MEASURES.at(1)));
+      }
+    }
+    cout << buf << endl;
+  }
+}
+
+// fleetTimers: load a timer schedule to all targets, with up to parallel devices at a time
+int fleetTimers(std::vector<string>& names, const char *fname, unsigned int parallel) {
+  SDtimers sched[NUM_TIMERS];
+  const char *msg = readSchedule(fname, sched);
+  if (msg) {
+    usage(msg);
+    return -1;
+  }
+  std::vector<string> results(names.size());
+  std::vector<bool> ok(names.size(), false);
+  std::atomic<uint32_t> next(0);
+  auto worker = [&]() {
+    uint32_t i;
+    while ((i = next++) < names.size()) {
+      IPAddress ip = NIL_ADDR;
+      uint16_t port = 502;
+      uint8_t server = 1;
+      if (parseTarget(names[i].c_str(), ip, port, server)) {
+        results[i] = "target descriptor invalid";
+        continue;
+      }
+      Client cl;
+      cl.setNoDelay(true);
+      ModbusClientTCP mb(cl);
+      mb.setTimeout(2000, 200);
+      mb.begin();
+      mb.setTarget(ip, port);
+      bool done = loadTimers(mb, server, sched, results[i]);
+      std::lock_guard<std::mutex> lg(fleetLock);
+      ok[i] = done;
+    }
+  };
+  std::vector<std::thread> workers;
+  for (unsigned int w = 0; w < parallel && w < names.size(); ++w) {
+    workers.emplace_back(worker);
+  }
+  for (auto& w : workers) w.join();
+
+  int rc = 0;
+  for (uint32_t i = 0; i < names.size(); ++i) {
+    cout << std::left << std::setw(24) << names[i] << " " << results[i] << endl;
+    if (!ok[i]) rc = -2;
+  }
+  return rc;
+}
+
+// fleetMode: poll all targets once (INFO) or every n seconds (EVERY)
+// Usage: Smartdose host,host,...|@file [INFO [<parallel>]|EVERY <seconds> [<parallel>]]
+int fleetMode(int argc, char **argv, uint8_t cmd) {
+  std::vector<string> names;
+  std::vector<FleetTarget *> fleet;
+  unsigned int interval = 0;
+  unsigned int parallel = 16;
+  int argn = 3;
+
+  if (!fleetTargets(argv[1], names)) {
+    usage("Target list invalid or empty!");
+    return -1;
+  }
+  if (cmd == EVRY) {
+    if (argc > argn) interval = atoi(argv[argn++]);
+    if (interval == 0) {
+      usage("EVERY needs an interval > 0s");
+      return -1;
+    }
+  } else if (cmd == TIMR) {
+    if (argc < 5 || strncasecmp(argv[3], "LOAD", 4)) {
+      usage("Only TIMER LOAD <file> is supported for a target list!");
+      return -1;
+    }
+    argn = 5;
+  } else if (cmd != INFO) {
+    usage("Only INFO, EVERY and TIMER LOAD are supported for a target list!");
+    return -1;
+  }
+  if (argc > argn) parallel = atoi(argv[argn]);
+  if (parallel == 0) {
+    usage("Number of parallel requests must be > 0");
+    return -1;
+  }
+  if (cmd == TIMR) return fleetTimers(names, argv[4], parallel);
+
+  // Set up a client for each target
+  for (uint32_t i = 0; i < names.size(); ++i) {
+    FleetTarget *t = new FleetTarget;
+    t->name = names[i];
+    t->ip = NIL_ADDR;
+    if (parseTarget(names[i].c_str(), t->ip, t->port, t->server)) {
+      cout << "Target descriptor invalid: " << names[i] << endl;
+      delete t;
+      continue;
+    }
+    t->cl.setNoDelay(true);
+    t->mb = new ModbusClientTCP(t->cl);
+    t->mb->setTimeout(2000, 200);
+    t->mb->onDataHandler([&fleet](ModbusMessage response, uint32_t token) {
+      std::lock_guard<std::mutex> lg(fleetLock);
+      FleetTarget& t = *fleet[token >> 1];
+      t.response = response;
+      t.err = SUCCESS;
+      t.state = FleetTarget::FT_ANSWER;
+      fleetDone.notify_one();
+    });
+    t->mb->onErrorHandler([&fleet](Error error, uint32_t token) {
+      std::lock_guard<std::mutex> lg(fleetLock);
+      FleetTarget& t = *fleet[token >> 1];
+      t.err = error;
+      t.state = FleetTarget::FT_ANSWER;
+      fleetDone.notify_one();
+    });
+    t->mb->begin();
+    t->mb->setTarget(t->ip, t->port);
+    fleet.push_back(t);
+  }
+  if (fleet.empty()) return -1;
+
+  Deadline dl;
+  if (interval) dl.start(interval);
+  do {
+    auto t0 = std::chrono::steady_clock::now();
+    {
+      std::unique_lock<std::mutex> lk(fleetLock);
+      for (auto t : fleet) {
+        t->state = FleetTarget::FT_IDLE;
+        t->valid = false;
+        t->err = SUCCESS;
+        t->step = 0;
+      }
+      uint32_t next = 0;       // Next target to be started
+      uint32_t inFlight = 0;
+      uint32_t done = 0;
+      while (done < fleet.size()) {
+        // Start as many targets as allowed
+        while (next < fleet.size() && inFlight < parallel) {
+          fleetRequest(*fleet[next], next);
+          next++;
+          inFlight++;
+        }
+        // Wait for answers
+        fleetDone.wait(lk, [&fleet]() {
+          for (auto t : fleet) if (t->state == FleetTarget::FT_ANSWER) return true;
+          return false;
+        });
+        for (uint32_t i = 0; i < fleet.size(); ++i) {
+          FleetTarget& t = *fleet[i];
+          if (t.state != FleetTarget::FT_ANSWER) continue;
+          if (fleetAnswer(t)) {
+            // Another request needed - the target keeps its place in flight
+            fleetRequest(t, i);
+          } else {
+            t.state = FleetTarget::FT_DONE;
+            inFlight--;
+            done++;
+          }
+        }
+      }
+    }
+    auto ms = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - t0).count();
+    char tbuf[32];
+    time_t now = time(NULL);
+    strftime(tbuf, 32, "%Y-%m-%d %H:%M:%S", localtime(&now));
+    uint32_t answered = 0;
+    for (auto t : fleet) if (t->valid) answered++;
+    cout << "--- " << tbuf << ": " << answered << " of " << fleet.size() << " devices answered in " << ms << "ms ---" << endl;
+    fleetPrint(fleet);
+    if (interval) dl.wait();
+  } while (interval);
+
+  for (auto t : fleet) {
+    delete t->mb;
+    delete t;
+  }
+  return 0;
+}
+
 // ============= main =============
+// getLayout: read the event slot count and the layout register of a device.
+// current is set to true, if the device has the layout of RegisterMap.h
+Error getLayout(ModbusClientTCP& mb, uint8_t server, uint32_t token, uint16_t& events, bool& current) {
+  current = false;
+  ModbusMessage response = mb.syncRequest(token, server, READ_HOLD_REGISTER, REG_EVENTCOUNT.addr, (uint16_t)1);
+  Error err = response.getError();
+  if (err == SUCCESS) {
+    response.get(3, events);
+    // Older firmware may have less registers than REG_LAYOUT.addr and will refuse the read
+    response = mb.syncRequest(token, server, READ_HOLD_REGISTER, REG_LAYOUT.addr, (uint16_t)1);
+    err = response.getError();
+    if (err == SUCCESS) {
+      uint16_t layout = 0;
+      response.get(3, layout);
+      current = (layout == REG_LAYOUT_ID);
+    } else if (err == ILLEGAL_DATA_ADDRESS) {
+      err = SUCCESS;
+    }
+  }
+  return err;
+}
+
 int main(int argc, char **argv) {
   // Target host parameters
   IPAddress targetIP = NIL_ADDR;
@@ -128,13 +905,6 @@ int main(int argc, char **argv) {
     return -1;
   }
 
-  if (int rc = parseTarget(argv[1], targetIP, targetPort, targetServer)) {
-    usage("Target descriptor invalid!");
-    return rc;
-  }
-
-  cout << "Using " << string(targetIP) << ":" << targetPort << ":" << (unsigned int)targetServer << endl;
-
   // Next shall be a command word. Omission is like INFO
   uint8_t cmd = X_END;
   if (argc > 2) {
@@ -151,6 +921,37 @@ int main(int argc, char **argv) {
   } else {
     cmd = INFO;
   }
+
+  // LISTEN takes a multicast group instead of a device
+  if (cmd == LSTN) {
+    return listenFrames(argv[1]);
+  }
+
+  // A list of targets will be polled in fleet mode
+  if (argv[1][0] == '@' || strchr(argv[1], ',')) {
+    return fleetMode(argc, argv, cmd);
+  }
+
+  if (int rc = parseTarget(argv[1], targetIP, targetPort, targetServer)) {
+    usage("Target descriptor invalid!");
+    return rc;
+  }
+
+  // EVERY may have an output format argument
+  OUT_FORMAT fmt = FMT_TEXT;
+  if (cmd == EVRY && argc > 4) {
+    if (!strcasecmp(argv[4], "CSV")) fmt = FMT_CSV;
+    else if (!strcasecmp(argv[4], "BIN")) fmt = FMT_BIN;
+    else {
+      usage("EVERY output format must be CSV or BIN");
+      return -1;
+    }
+    // Keep stdout clean for the data and have it written in blocks
+    machineOut = true;
+    setvbuf(stdout, NULL, _IOFBF, 65536);
+  }
+
+  (machineOut ? cerr : cout) << "Using " << string(targetIP) << ":" << targetPort << ":" << (unsigned int)targetServer << endl;
     
   // Define a Modbus client using the TCP client
   ModbusClientTCP MBclient(cl);
@@ -181,31 +982,118 @@ int main(int argc, char **argv) {
           return -1;
         }
       }
+      Deadline dl;
+      if (interval) dl.start(interval);
+
+      // Register layout: devices with the layout of RegisterMap.h are served by one request
+      // of REG_INFO_WORDS registers. Older firmware with less registers refuses that, it is read
+      // with REG_LEGACY_WORDS instead. The auto power off registers are found behind the event slots
+      // then. The layout found is kept for the next loops.
+      uint16_t regs[126];        // regs[n - 1] is register n
+      uint16_t aoAddr = 0;       // Address of the auto power off registers
+      uint16_t span = 0;         // Number of registers needed, 0: not known yet
+      auto regF = [&](uint16_t n) { return RM_float(regs, n); };
 
       do {
-        // Issue a request
-        uint16_t addr = 1;
-        uint16_t words = 8;
+        // Read all registers needed in one request
+        uint16_t addr = REG_STATE.addr;
+        uint16_t words = span ? span : REG_INFO_WORDS;
         uint16_t offs = 3;
+        bool valid = false;
+        struct timespec sampleTime;
+        clock_gettime(CLOCK_REALTIME, &sampleTime);
 
         ModbusMessage response = MBclient.syncRequest(1, targetServer, READ_HOLD_REGISTER, addr, words);
         Error err = response.getError();
+        // Layout yet unknown and refused by older firmware? Try the short plan
+        if (err == ILLEGAL_DATA_ADDRESS && !span) {
+          words = REG_LEGACY_WORDS;
+          response = MBclient.syncRequest(1, targetServer, READ_HOLD_REGISTER, addr, words);
+          err = response.getError();
+        }
         if (err!=SUCCESS) {
           handleError(err, 1);
         } else {
-          offs = 3;
-          offs = response.get(offs, basicData.onState);
-          offs = response.get(offs, basicData.flags);
-          offs = response.get(offs, basicData.uptime.hours);
-          offs = response.get(offs, basicData.uptime.minutes);
-          offs = response.get(offs, basicData.uptime.seconds);
-          offs = response.get(offs, basicData.statetime.hours);
-          offs = response.get(offs, basicData.statetime.minutes);
-          offs = response.get(offs, basicData.statetime.seconds);
-          offs = response.get(offs, basicData.ontime.hours);
-          offs = response.get(offs, basicData.ontime.minutes);
-          offs = response.get(offs, basicData.ontime.seconds);
+          for (uint16_t i = 0; i < words; ++i) {
+            offs = response.get(offs, regs[i]);
+          }
+          valid = true;
+          // Layout yet unknown?
+          if (!span) {
+            // Yes. Is it ours?
+            span = words;
+            aoAddr = REG_AO_AMPS.addr;
+            if (!RM_layoutMatches(regs, words)) {
+              // No. Add event registers to get to the auto off data
+              aoAddr = REG_EVENTS.addr + regs[REG_EVENTCOUNT.addr - 1];
+            }
+            // Power meter device and auto off data not read yet?
+            if ((regs[REG_FLAGS.addr - 1] & 0x8000) && aoAddr + 1 > span) {
+              // Yes. Read those
+              addr = aoAddr;
+              words = 2;
+              offs = 3;
+              if (addr + 1 > REG_MAXREAD) {
+                (machineOut ? cerr : cout) << "Unsupported register layout (" << regs[REG_EVENTCOUNT.addr - 1] << " event slots)" << endl;
+                return -2;
+              }
+              response = MBclient.syncRequest(21, targetServer, READ_HOLD_REGISTER, addr, words);
+              err = response.getError();
+              if (err!=SUCCESS) {
+                handleError(err, 21);
+                valid = false;
+                span = 0;
+              } else {
+                offs = response.get(offs, regs[addr - 1], regs[addr]);
+                aoAddr = addr;
+                span = aoAddr + 1;
+              }
+            }
+          }
+        }
 
+        if (valid && fmt != FMT_TEXT) {
+          // Machine-readable output. Values are raw, times in seconds
+          SampleRecord r;
+          memset(&r, 0, sizeof(r));
+          r.timeMs = (uint64_t)sampleTime.tv_sec * 1000 + sampleTime.tv_nsec / 1000000;
+          r.version = 1;
+          r.state = regs[REG_STATE.addr - 1] & 0xFF;
+          r.flags = regs[REG_FLAGS.addr - 1];
+          r.upTime = RM_seconds(regs, REG_UPTIME.addr);
+          r.stateTime = RM_seconds(regs, REG_STATETIME.addr);
+          r.onTime = RM_seconds(regs, REG_ONTIME.addr);
+          if (r.flags & 0x8000) {
+            r.energy = regF(REG_ENERGY.addr);
+            r.volts = regF(REG_MEASURES.at(0));
+            r.amps = regF(REG_MEASURES.at(1));
+            r.watts = regF(REG_MEASURES.at(2));
+          }
+          if (fmt == FMT_BIN) {
+            fwrite(&r, sizeof(r), 1, stdout);
+          } else {
+            if (loopCnt == 0) {
+              printf("time,uptime_s,state,statetime_s,ontime_s,kWh,W,V,A\n");
+            }
+            printf("%llu.%03u,%u,%u,%u,%u,%.4f,%.2f,%.2f,%.3f\n",
+              (unsigned long long)(r.timeMs / 1000), (unsigned int)(r.timeMs % 1000),
+              r.upTime, (unsigned int)r.state, r.stateTime, r.onTime,
+              r.energy / 1000.0, r.watts, r.volts, r.amps);
+          }
+          // One write per sample
+          fflush(stdout);
+        } else if (valid) {
+          basicData.onState = regs[REG_STATE.addr - 1];
+          basicData.flags = regs[REG_FLAGS.addr - 1];
+          basicData.uptime.hours = regs[REG_UPTIME.addr - 1];
+          basicData.uptime.minutes = regs[REG_UPTIME.addr] >> 8;
+          basicData.uptime.seconds = regs[REG_UPTIME.addr] & 0xFF;
+          basicData.statetime.hours = regs[REG_STATETIME.addr - 1];
+          basicData.statetime.minutes = regs[REG_STATETIME.addr] >> 8;
+          basicData.statetime.seconds = regs[REG_STATETIME.addr] & 0xFF;
+          basicData.ontime.hours = regs[REG_ONTIME.addr - 1];
+          basicData.ontime.minutes = regs[REG_ONTIME.addr] >> 8;
+          basicData.ontime.seconds = regs[REG_ONTIME.addr] & 0xFF;
           // Print out results
           if (loopCnt == 0) {
             if (basicData.flags & 0x8000) cout << "Power meter| ";
@@ -254,71 +1142,39 @@ int main(int argc, char **argv) {
               (unsigned int)basicData.statetime.seconds);
             cout << buf;
           }
-        }
 
-        if (basicData.flags & 0x8000) {
-          addr = 9; 
-          words = 14;
-          offs = 3;
-          response = MBclient.syncRequest(2, targetServer, READ_HOLD_REGISTER, addr, words);
-          err = response.getError();
-          if (err!=SUCCESS) {
-            handleError(err, 2);
-          } else {
-            offs = response.get(offs, advancedData.accW);
-            offs = response.get(offs, advancedData.factorV);
-            offs = response.get(offs, advancedData.factorA);
-            offs = response.get(offs, advancedData.factorW);
-            offs = response.get(offs, advancedData.volts);
-            offs = response.get(offs, advancedData.amps);
-            offs = response.get(offs, advancedData.watts);
-//          Read number of event slots - auto power off values are behind
-            uint16_t addr = 55;
-            uint16_t words = 1;
-            uint16_t offs = 3;
-            response = MBclient.syncRequest(20, targetServer, READ_HOLD_REGISTER, addr, words);
-            err = response.getError();
-            if (err!=SUCCESS) {
-              handleError(err, 20);
-            } else {
-              // Add event registers to addr to get to the auto off data
-              uint16_t events = 0;
-              offs = response.get(offs, events);
-              addr += events + 1;
-              words = 2;
-              offs = 3;
-              response = MBclient.syncRequest(21, targetServer, READ_HOLD_REGISTER, addr, words);
-              err = response.getError();
-              if (err!=SUCCESS) {
-                handleError(err, 21);
-              } else {
-                // now read auto power off values
-                offs = response.get(offs, advancedData.aoAmps, advancedData.aoCycles);
+          if (basicData.flags & 0x8000) {
+            advancedData.accW = regF(REG_ENERGY.addr);
+            advancedData.factorV = regF(REG_FACTORS.at(0));
+            advancedData.factorA = regF(REG_FACTORS.at(1));
+            advancedData.factorW = regF(REG_FACTORS.at(2));
+            advancedData.volts = regF(REG_MEASURES.at(0));
+            advancedData.amps = regF(REG_MEASURES.at(1));
+            advancedData.watts = regF(REG_MEASURES.at(2));
+            advancedData.aoAmps = regs[aoAddr - 1];
+            advancedData.aoCycles = regs[aoAddr];
 
-
-                if (loopCnt == 0) {
-                  snprintf(buf, 128, "accumulated   %10.2f kWh", advancedData.accW / 1000.0);
-                  cout << buf << endl;
-                  snprintf(buf, 128, "Power         %10.2f W", advancedData.watts);
-                  cout << buf << endl;
-                  snprintf(buf, 128, "Voltage       %10.2f V", advancedData.volts);
-                  cout << buf << endl;
-                  snprintf(buf, 128, "Current       %10.2f A", advancedData.amps);
-                  cout << buf << endl;
-                  snprintf(buf, 128, "Auto power OFF %5.2f A for %u turns", advancedData.aoAmps/1000.0, advancedData.aoCycles);
-                } else {
-                  snprintf(buf, 128, "%10.2f  %10.2f  %10.2f  %10.2f",
-                    advancedData.accW / 1000.0,
-                    advancedData.watts,
-                    advancedData.volts,
-                    advancedData.amps);
-                }
-                cout << buf << endl;
-              }
+            if (loopCnt == 0) {
+              snprintf(buf, 128, "accumulated   %10.2f kWh", advancedData.accW / 1000.0);
+              cout << buf << endl;
+              snprintf(buf, 128, "Power         %10.2f W", advancedData.watts);
+              cout << buf << endl;
+              snprintf(buf, 128, "Voltage       %10.2f V", advancedData.volts);
+              cout << buf << endl;
+              snprintf(buf, 128, "Current       %10.2f A", advancedData.amps);
+              cout << buf << endl;
+              snprintf(buf, 128, "Auto power OFF %5.2f A for %u turns", advancedData.aoAmps/1000.0, advancedData.aoCycles);
+            } else {
+              snprintf(buf, 128, "%10.2f  %10.2f  %10.2f  %10.2f",
+                advancedData.accW / 1000.0,
+                advancedData.watts,
+                advancedData.volts,
+                advancedData.amps);
             }
+            cout << buf << endl;
           }
         }
-        sleep(interval);
+        if (interval) dl.wait();
         loopCnt++;
       } while (interval);
     }
@@ -327,7 +1183,7 @@ int main(int argc, char **argv) {
   case SW_ON:
     {
       // Write 255 to addr 1
-      uint16_t addr = 1;
+      uint16_t addr = REG_STATE.addr;
 
       ModbusMessage response = MBclient.syncRequest(4, targetServer, WRITE_HOLD_REGISTER, addr, 255);
       Error err = response.getError();
@@ -340,7 +1196,7 @@ int main(int argc, char **argv) {
   case SW_OFF:
     {
       // Write 0 to addr 1
-      uint16_t addr = 1;
+      uint16_t addr = REG_STATE.addr;
 
       ModbusMessage response = MBclient.syncRequest(5, targetServer, WRITE_HOLD_REGISTER, addr, 0);
       Error err = response.getError();
@@ -367,7 +1223,7 @@ int main(int argc, char **argv) {
       }
       
       // Read flag register
-      uint16_t addr = 2;
+      uint16_t addr = REG_FLAGS.addr;
       uint16_t words = 1;
       uint16_t offs = 3;
 
@@ -406,7 +1262,7 @@ int main(int argc, char **argv) {
   case RST_CNT:
     {
       // Read flag register
-      uint16_t addr = 2;
+      uint16_t addr = REG_FLAGS.addr;
       uint16_t words = 1;
       uint16_t offs = 3;
 
@@ -421,7 +1277,7 @@ int main(int argc, char **argv) {
           return -1;
         }
 
-        addr = 9;
+        addr = REG_ENERGY.addr;
         response = MBclient.syncRequest(9, targetServer, WRITE_HOLD_REGISTER, addr, 0);
         err = response.getError();
         if (err!=SUCCESS) {
@@ -435,7 +1291,7 @@ int main(int argc, char **argv) {
   case FCTR:
     {
       // Read flag register
-      uint16_t addr = 2;
+      uint16_t addr = REG_FLAGS.addr;
       uint16_t words = 1;
       uint16_t offs = 3;
 
@@ -450,8 +1306,8 @@ int main(int argc, char **argv) {
           return -1;
         }
 
-        addr = 9; 
-        words = 14;
+        addr = REG_ENERGY.addr;
+        words = REG_MEASURES.next() - REG_ENERGY.addr;
         offs = 3;
         response = MBclient.syncRequest(11, targetServer, READ_HOLD_REGISTER, addr, words);
         err = response.getError();
@@ -528,8 +1384,25 @@ int main(int argc, char **argv) {
 // --------- Set timer parameters -----------------
   case TIMR:
     {
+//    Load a complete schedule?
+      if (argc > 3 && strncasecmp(argv[3], "LOAD", 4) == 0) {
+        if (argc < 5) {
+          usage("TIMER LOAD needs a schedule file!");
+          return -1;
+        }
+        SDtimers sched[NUM_TIMERS];
+        const char *msg = readSchedule(argv[4], sched);
+        if (msg) {
+          usage(msg);
+          return -1;
+        }
+        string result;
+        bool ok = loadTimers(MBclient, targetServer, sched, result);
+        cout << result << endl;
+        return ok ? 0 : -2;
+      }
       // Issue a request for the flag word
-      uint16_t addr = 2;
+      uint16_t addr = REG_FLAGS.addr;
       uint16_t words = 1;
       uint16_t offs = 3;
 
@@ -549,14 +1422,14 @@ int main(int argc, char **argv) {
         if (argc > 3) {
 //        Get timer number
           tim = atoi(argv[3]);
-          if (tim < 1 || tim > 16) {
+          if (tim < 1 || tim > NUM_TIMERS) {
             usage("TIMER number must be 1..16!");
             return -1;
           }
 //        We have one. Now we need to read the timer data
           tim--;
           subcmd = 1;  // info for now.
-          addr = 23 + tim * 2;
+          addr = REG_TIMERS.at(tim * 2);
           words = 2;
           offs = 3;
           response = MBclient.syncRequest(15, targetServer, READ_HOLD_REGISTER, addr, words);
@@ -574,106 +1447,15 @@ int main(int argc, char **argv) {
           if (argc > 4) {
 //          Yes. Check all remaining
             while (argc > nextArg) {
-//            ON?
-              if (strncasecmp(argv[nextArg], "ON", 2) == 0) {
-                timerData[0].onOff |= 0x01;
-//            OFF?
-              } else if (strncasecmp(argv[nextArg], "OFF", 3) == 0) {
-                timerData[0].onOff &= 0xFE;
-//            ACTIVE?
-              } else if (strncasecmp(argv[nextArg], "ACTIVE", 6) == 0) {
-                timerData[0].activeDays |= 0x80;
-//            INACTIVE?
-              } else if (strncasecmp(argv[nextArg], "INACTIVE", 8) == 0) {
-                timerData[0].activeDays &= 0x7F;
-//            SUNday?
-              } else if (strncasecmp(argv[nextArg], "SUN", 3) == 0) {
-                timerData[0].activeDays |= 0x01;
-//            MONday?
-              } else if (strncasecmp(argv[nextArg], "MON", 3) == 0) {
-                timerData[0].activeDays |= 0x02;
-//            TUEsday?
-              } else if (strncasecmp(argv[nextArg], "TUE", 3) == 0) {
-                timerData[0].activeDays |= 0x04;
-//            WEDnesday?
-              } else if (strncasecmp(argv[nextArg], "WED", 3) == 0) {
-                timerData[0].activeDays |= 0x08;
-//            THUrsday?
-              } else if (strncasecmp(argv[nextArg], "THU", 3) == 0) {
-                timerData[0].activeDays |= 0x10;
-//            FRIday?
-              } else if (strncasecmp(argv[nextArg], "FRI", 3) == 0) {
-                timerData[0].activeDays |= 0x20;
-//            SATurday?
-              } else if (strncasecmp(argv[nextArg], "SAT", 3) == 0) {
-                timerData[0].activeDays |= 0x40;
-//            WORKday?
-              } else if (strncasecmp(argv[nextArg], "WORK", 4) == 0) {
-                timerData[0].activeDays |= 0x3E;
-//            WEEKEND?
-              } else if (strncasecmp(argv[nextArg], "WEEKEND", 7) == 0) {
-                timerData[0].activeDays |= 0x41;
-//            DAILY?
-              } else if (strncasecmp(argv[nextArg], "DAILY", 5) == 0) {
-                timerData[0].activeDays |= 0x7F;
-//            CLEAR?
-              } else if (strncasecmp(argv[nextArg], "CLEAR", 5) == 0) {
-                timerData[0].activeDays = 0;
-                timerData[0].onOff = 0;
-                timerData[0].hour = 0;
-                timerData[0].minute = 0;
-//            HH24:MM?
-              } else if (*argv[nextArg] >= '0' && *argv[nextArg] <= '9') {
-                char *cp = argv[nextArg];
-                uint16_t hh = 0;
-                uint16_t mm = 0;
-//              Get hours value first
-                while (*cp>= '0' && *cp <= '9') {
-                  hh *= 10;
-                  hh += (*cp - '0');
-                  cp++;
-                }
-//              Valid hour?
-                if (hh < 24) {
-//                Yes, check separator
-                  if (*cp == ':') {
-//                  Is OK, get minutes value
-                    cp++;
-                    while (*cp>= '0' && *cp <= '9') {
-                      mm *= 10;
-                      mm += (*cp - '0');
-                      cp++;
-                    }
-//                  Valid minute?
-                    if (mm < 60) {
-//                    Yes, use time
-                      timerData[0].hour = hh;
-                      timerData[0].minute = mm;
-                    } else {
-//                    No, minute is invalid
-                      usage("Minute must be 0..59!");
-                      return -1;
-                    }
-                  } else {
-//                  No, separator not found
-                    usage("Time must be given as HH:MM!");
-                    return -1;
-                  }
-                } else {
-//                No, minute is invalid
-                  usage("Hour must be 0..23!");
-                  return -1;
-                }
-//            Unknown parameter.
-              } else {
-                snprintf(buf, 128, "Invalid TIMER parameter '%s'!", argv[nextArg]);
-                usage(buf);
+              const char *msg = timerArg(argv[nextArg], timerData[0]);
+              if (msg) {
+                usage(msg);
                 return -1;
               }
               nextArg++;
             }
 //          All fine here, now use the collected data
-            addr = 23 + tim * 2;
+            addr = REG_TIMERS.at(tim * 2);
             words = 2;
 //          Write data
             ModbusMessage request;
@@ -708,22 +1490,22 @@ int main(int argc, char **argv) {
           printTimer(tim + 1, timerData[0]);
         } else {
 //        Output only
-          addr = 23; 
-          words = 32;
+          addr = REG_TIMERS.addr;
+          words = REG_TIMERS.words();
           offs = 3;
           response = MBclient.syncRequest(3, targetServer, READ_HOLD_REGISTER, addr, words);
           err = response.getError();
           if (err!=SUCCESS) {
             handleError(err, 3);
           } else {
-            for (uint8_t i = 0; i < 16; i++) {
+            for (uint8_t i = 0; i < NUM_TIMERS; i++) {
               offs = response.get(offs, timerData[i].activeDays);
               offs = response.get(offs, timerData[i].onOff);
               offs = response.get(offs, timerData[i].hour);
               offs = response.get(offs, timerData[i].minute);
             }
            
-            for (uint8_t i = 0; i < 16; i++) {
+            for (uint8_t i = 0; i < NUM_TIMERS; i++) {
               printTimer(i + 1, timerData[i]);
             }
           }
@@ -737,75 +1519,131 @@ int main(int argc, char **argv) {
 // --------- Read event storage -----------------
   case EVNTS:
     {
-//    Read number of event slots
-      uint16_t addr = 55;
-      uint16_t words = 1;
-      uint16_t offs = 3;
-      ModbusMessage response = MBclient.syncRequest(18, targetServer, READ_HOLD_REGISTER, addr, words);
-      Error err = response.getError();
-      if (err!=SUCCESS) {
-        handleError(err, 18);
-      } else {
-        uint16_t events = 0;
-        offs = response.get(offs, events);
-//      Has it some?
-        if (events) {
-//        Yes. Read them.
-          addr = 56;
-          offs = 3;
-          response = MBclient.syncRequest(19, targetServer, READ_HOLD_REGISTER, addr, events);
-          err = response.getError();
-          if (err!=SUCCESS) {
-            handleError(err, 19);
+//    TAIL given?
+      unsigned int interval = 0;
+      if (argc > 3) {
+        if (strncasecmp(argv[3], "TAIL", 4) == 0) {
+          interval = 5;
+          if (argc > 4) {
+            interval = atoi(argv[4]);
+          }
+          if (interval == 0) {
+            usage("EVENTS TAIL needs an interval > 0s");
+            return -1;
+          }
+        } else {
+          usage("EVENTS: unknown argument!");
+          return -1;
+        }
+      }
+
+//    Read the event log incrementally. Sequence numbers start at 1 with every boot of the device
+      uint32_t since = 0;
+      uint32_t boot = 0;
+      bool legacy = false;
+      bool more = false;
+      do {
+        ModbusMessage evMsg(targetServer, USER_DEFINED_45);
+        evMsg.add(since, (uint8_t)255);
+        ModbusMessage response = MBclient.syncRequest(evMsg, (uint32_t)26);
+        Error err = response.getError();
+        if (err!=SUCCESS) {
+//        Older firmware does not have the event log
+          if (err == ILLEGAL_FUNCTION && since == 0) {
+            legacy = true;
           } else {
-            cout << events << " event slots found." << endl;
-//          We got some. Print those that have a meaning
-            uint16_t word = 0;
-            uint8_t ev = 0;
-            uint8_t hi = 0;
-            uint8_t lo = 0;
-//          Define the event types
-            enum S_EVENT : uint8_t  { 
-              NO_EVENT=0, DATE_CHANGE,
-              BOOT_DATE, BOOT_TIME, 
-              DEFAULT_ON,
-              BUTTON_ON, BUTTON_OFF,
-              MODBUS_ON, MODBUS_OFF,
-              TIMER_ON, TIMER_OFF,
-              FAUXMO_ON, FAUXMO_OFF,
-              WIFI_DISCONN, WIFI_CONN, WIFI_LOST,
-              AUTOOFF,
-              UNKNOWN
-            };
-            const char *eventname[] = { 
-              "no event", "date change", "boot date", "boot time", "default on",
-              "button on", "button off", 
-              "Modbus on", "Modbus off", 
-              "timer on", "timer off", 
-              "Fauxmo on", "Fauxmo off", 
-              "WiFi disconnected", "WiFi connected", "WiFi lost",
-              "Low power off",
-              "Unknown event"
-            };
-//          Loop over result data
-            for (uint16_t i = 0; i < events; i++) {
-              offs = response.get(offs, word);
-              ev = (word >> 11) & 0x1F;
-              hi = (word >> 6) & 0x1F;
-              lo = word & 0x3F;
-              if (ev != NO_EVENT) {
-                if (ev == DATE_CHANGE || ev == BOOT_DATE) {
-                  snprintf(buf, 128, "%2d %-15s %02d.%02d.", ev, eventname[ev], hi, lo);
-                } else {
-                  snprintf(buf, 128, "%2d %-20s %02d:%02d", ev, eventname[ev >= (uint8_t)UNKNOWN ? (uint8_t)UNKNOWN : ev], hi, lo);  // nolint
+            handleError(err, 26);
+          }
+          break;
+        }
+        uint32_t latest = 0;
+        uint32_t bootId = 0;
+        uint8_t count = 0;
+        uint16_t offs = 2;
+        offs = response.get(offs, bootId);
+        offs = response.get(offs, latest);
+        offs = response.get(offs, count);
+//      Has the device been restarted in between?
+        if (since && (bootId != boot || latest < since)) {
+//        Yes. Start over with the new sequence numbers
+          cout << "(device restarted, reading the event log again)" << endl;
+          since = 0;
+          boot = bootId;
+          more = true;
+          continue;
+        }
+        boot = bootId;
+        for (uint8_t i = 0; i < count; i++) {
+          uint32_t seq = 0;
+          uint32_t epoch = 0;
+          uint8_t ev = 0;
+          offs = response.get(offs, seq);
+          offs = response.get(offs, epoch);
+          offs = response.get(offs, ev);
+//        Were events lost in between?
+          if (since && seq != since + 1) {
+            cout << "(" << seq - since - 1 << " events lost)" << endl;
+          }
+          since = seq;
+          printEvent(seq, epoch, ev);
+        }
+//      Get the next batch at once, if there are more
+        more = (count && since < latest);
+        if (!more && interval) {
+          cout << std::flush;
+          sleep(interval);
+        }
+      } while (more || interval);
+
+//    Old firmware: read the event registers
+      if (legacy) {
+//      Read number of event slots
+        uint16_t addr = REG_EVENTCOUNT.addr;
+        uint16_t words = 1;
+        uint16_t offs = 3;
+        ModbusMessage response = MBclient.syncRequest(18, targetServer, READ_HOLD_REGISTER, addr, words);
+        Error err = response.getError();
+        if (err!=SUCCESS) {
+          handleError(err, 18);
+        } else {
+          uint16_t events = 0;
+          offs = response.get(offs, events);
+//        Has it some?
+          if (events) {
+//          Yes. Read them.
+            addr = REG_EVENTS.addr;
+            offs = 3;
+            response = MBclient.syncRequest(19, targetServer, READ_HOLD_REGISTER, addr, events);
+            err = response.getError();
+            if (err!=SUCCESS) {
+              handleError(err, 19);
+            } else {
+              cout << events << " event slots found." << endl;
+//            We got some. Print those that have a meaning
+              uint16_t word = 0;
+              uint8_t ev = 0;
+              uint8_t hi = 0;
+              uint8_t lo = 0;
+//            Loop over result data
+              for (uint16_t i = 0; i < events; i++) {
+                offs = response.get(offs, word);
+                ev = RM_eventType(word);
+                hi = RM_eventHi(word);
+                lo = RM_eventLo(word);
+                if (ev != NO_EVENT) {
+                  if (ev == DATE_CHANGE || ev == BOOT_DATE) {
+                    snprintf(buf, 128, "%2d %-15s %02d.%02d.", ev, eventname[ev], hi, lo);
+                  } else {
+                    snprintf(buf, 128, "%2d %-20s %02d:%02d", ev, eventname[ev >= (uint8_t)UNKNOWN ? (uint8_t)UNKNOWN : ev], hi, lo);  // nolint
+                  }
+                  cout << buf << endl;
                 }
-                cout << buf << endl;
               }
             }
+          } else {
+            cout << "Device has no events." << endl;
+            return 0;
           }
-        } else {
-          cout << "Device has no events." << endl;
-          return 0;
         }
       }
     }
@@ -821,20 +1659,16 @@ int main(int argc, char **argv) {
         mA = atoi(argv[3]);
         cyc = atoi(argv[4]);
         if (mA >= 0 && mA <= 65535 && cyc >= 0 && cyc <= 65535) {
-//        Read number of event slots - auto power off values are behind
-          uint16_t addr = 55;
-          uint16_t words = 1;
-          uint16_t offs = 3;
-          ModbusMessage response = MBclient.syncRequest(22, targetServer, READ_HOLD_REGISTER, addr, words);
-          Error err = response.getError();
+//        Check the layout - with older firmware the auto power off values are behind the event slots
+          uint16_t evCount = 0;
+          bool current = false;
+          Error err = getLayout(MBclient, targetServer, 22, evCount, current);
           if (err!=SUCCESS) {
             handleError(err, 22);
           } else {
-            uint16_t evOffs = 0;
-            response.get(offs, evOffs);
-            addr += evOffs + 1;
+            uint16_t addr = current ? REG_AO_AMPS.addr : REG_EVENTS.addr + evCount;
             // All fine. Write data in two requests
-            response = MBclient.syncRequest(23, targetServer, WRITE_HOLD_REGISTER, addr, (uint16_t)mA);
+            ModbusMessage response = MBclient.syncRequest(23, targetServer, WRITE_HOLD_REGISTER, addr, (uint16_t)mA);
             err = response.getError();
             if (err!=SUCCESS) {
               handleError(err, 23);
@@ -857,6 +1691,244 @@ int main(int argc, char **argv) {
       }
     }
     break;
+// --------- State, meter data and new events in one request -----------------
+  case SNAP:
+    {
+//    ACK given? It names the latest event received with the snapshot before
+      uint8_t flags = 0;
+      uint32_t ackSeq = 0;
+      uint32_t ackBoot = 0;
+      if (argc > 3) {
+        if (strncasecmp(argv[3], "ACK", 3) == 0 && argc > 5) {
+          flags = SNAP_ACK;
+          ackSeq = strtoul(argv[4], nullptr, 10);
+          ackBoot = strtoul(argv[5], nullptr, 16);
+        } else {
+          usage("SNAPSHOT: ACK needs the <seq> and <boot ID> given with the last snapshot!");
+          return -1;
+        }
+      }
+      ModbusMessage snapMsg(targetServer, USER_DEFINED_46);
+      snapMsg.add(flags);
+      if (flags & SNAP_ACK) {
+        snapMsg.add(ackBoot, ackSeq);
+      }
+      ModbusMessage response = MBclient.syncRequest(snapMsg, (uint32_t)33);
+      Error err = response.getError();
+      if (err!=SUCCESS) {
+//      Older firmware does not have the snapshot
+        if (err == ILLEGAL_FUNCTION) {
+          cout << "SNAPSHOT is not supported by the device firmware." << endl;
+        } else {
+          handleError(err, 33);
+        }
+        break;
+      }
+      uint16_t layout = 0;
+      uint16_t offs = 2;
+      offs = response.get(offs, layout);
+      if (layout != REG_LAYOUT_ID) {
+        cout << "Unsupported register layout " << hex << layout << dec << endl;
+        return -2;
+      }
+//    Put the registers where they belong
+      uint16_t regs[REG_AO_CYCLES.next()];
+      memset(regs, 0, sizeof(regs));
+      for (uint16_t i = 0; i < SNAP_WORDS; ++i) {
+        offs = response.get(offs, regs[REG_STATE.addr - 1 + i]);
+      }
+      offs = response.get(offs, regs[REG_AO_AMPS.addr - 1], regs[REG_AO_CYCLES.addr - 1]);
+
+      uint32_t t = RM_seconds(regs, REG_STATETIME.addr);
+      snprintf(buf, 128, "%-3s (%3d) for %4u:%02u:%02u", 
+        (regs[REG_STATE.addr - 1] ? "ON" : "OFF"),
+        (unsigned int)regs[REG_STATE.addr - 1],
+        t / 3600, (t / 60) % 60, t % 60);
+      cout << buf << endl;
+      t = RM_seconds(regs, REG_ONTIME.addr);
+      snprintf(buf, 128, "ON time       %4u:%02u:%02u", t / 3600, (t / 60) % 60, t % 60);
+      cout << buf << endl;
+//    Power meter device?
+      if (regs[REG_FLAGS.addr - 1] & 0x8000) {
+//      Yes. Print the measures as well
+        snprintf(buf, 128, "%10.4f kWh %10.2f W %10.2f V %10.3f A",
+          RM_float(regs, REG_ENERGY.addr) / 1000.0,
+          RM_float(regs, REG_MEASURES.at(2)),
+          RM_float(regs, REG_MEASURES.at(0)),
+          RM_float(regs, REG_MEASURES.at(1)));
+        cout << buf << endl;
+        if (regs[REG_AO_AMPS.addr - 1] && regs[REG_AO_CYCLES.addr - 1]) {
+          cout << "Auto power off below " << regs[REG_AO_AMPS.addr - 1] << "mA for " << regs[REG_AO_CYCLES.addr - 1] << " cycles" << endl;
+        }
+      }
+
+//    Now the events not delivered before
+      uint32_t bootId = 0;
+      uint32_t latest = 0;
+      uint32_t seq = 0;
+      uint8_t count = 0;
+      offs = response.get(offs, bootId);
+      offs = response.get(offs, latest);
+      offs = response.get(offs, count);
+      for (uint8_t i = 0; i < count; i++) {
+        uint32_t epoch = 0;
+        uint8_t ev = 0;
+        offs = response.get(offs, seq);
+        offs = response.get(offs, epoch);
+        offs = response.get(offs, ev);
+        printEvent(seq, epoch, ev);
+      }
+      if (count && seq < latest) {
+        cout << "(" << latest - seq << " more events waiting)" << endl;
+      }
+//    Tell how to acknowledge the events shown. The device marks them only with the next request
+      if (count) {
+        snprintf(buf, 128, "(acknowledge with SNAPSHOT ACK %u %08X)", (unsigned int)seq, (unsigned int)bootId);
+        cout << buf << endl;
+      }
+    }
+    break;
+// --------- Read measurement history -----------------
+  case HSTRY:
+    {
+      const char *types[] = { "SAMPLES", "MINUTES", "HOURS" };
+      uint8_t type = 1;
+      if (argc > 3) {
+        for (type = 0; type < 3; ++type) {
+          if (strncasecmp(argv[3], types[type], strlen(types[type])) == 0) break;
+        }
+        if (type == 3) {
+          usage("HISTORY: unknown type!");
+          return -1;
+        }
+      }
+      uint16_t skip = 0;
+      uint16_t avail = 1;
+//    Collect the records in as many requests as needed
+      while (skip < avail) {
+        ModbusMessage histMsg(targetServer, USER_DEFINED_44);
+        histMsg.add(type, skip, (uint8_t)255);
+        ModbusMessage response = MBclient.syncRequest(histMsg, (uint32_t)25);
+        Error err = response.getError();
+        if (err!=SUCCESS) {
+          // No records at all is not an error
+          if (err == ILLEGAL_DATA_ADDRESS && skip == 0) {
+            cout << "No history data yet." << endl;
+          } else {
+            handleError(err, 25);
+          }
+          break;
+        }
+        uint8_t rType = 0;
+        uint32_t latest = 0;
+        uint16_t period = 0;
+        uint8_t count = 0;
+        uint16_t offs = 2;
+        offs = response.get(offs, rType);
+        offs = response.get(offs, avail);
+        offs = response.get(offs, latest);
+        offs = response.get(offs, period);
+        offs = response.get(offs, count);
+        if (count == 0) break;
+        if (skip == 0) {
+          if (type == 0) {
+            cout << "Time                        V         A         W" << endl;
+          } else {
+            cout << "Time                    min W     avg W     max W        Wh" << endl;
+          }
+        }
+        for (uint8_t i = 0; i < count; ++i) {
+          time_t t = latest - (time_t)(skip + i) * period;
+          char tbuf[32];
+          strftime(tbuf, 32, "%Y-%m-%d %H:%M:%S", localtime(&t));
+          uint16_t w1 = 0;
+          uint16_t w2 = 0;
+          uint16_t w3 = 0;
+          offs = response.get(offs, w1);
+          offs = response.get(offs, w2);
+          offs = response.get(offs, w3);
+          if (type == 0) {
+            snprintf(buf, 128, "%s  %8.1f  %8.3f  %8.1f", tbuf, w1 / 10.0, w2 / 1000.0, w3 / 10.0);
+          } else {
+            uint32_t mWh = 0;
+            offs = response.get(offs, mWh);
+            snprintf(buf, 128, "%s  %8.1f  %8.1f  %8.1f  %8.3f", tbuf, w1 / 10.0, w2 / 10.0, w3 / 10.0, mWh / 1000.0);
+          }
+          cout << buf << endl;
+        }
+        skip += count;
+      }
+    }
+    break;
+// --------- Read runtime statistics -----------------
+  case STATS:
+    {
+      const char *names[REG_STAT_BLOCKS] = { "loop", "FC03", "FC06", "FC10", "FC43", "meter", "telnet" };
+      const uint16_t NUM_STATS = REG_STAT_BLOCKS;
+      const uint16_t BUCKETS = REG_STAT_BUCKETS;
+      uint16_t stw[REG_STATS.words() + REG_TIMINGS.words()];
+//    Check the layout - with older firmware the statistics are behind the event slots, auto off, pending and boot registers
+      uint16_t evCount = 0;
+      bool current = false;
+      uint16_t words = 0;
+      uint16_t offs = 3;
+      Error err = getLayout(MBclient, targetServer, 26, evCount, current);
+      if (err!=SUCCESS) {
+        handleError(err, 26);
+        break;
+      }
+      uint16_t addr = current ? REG_STATS.addr : REG_EVENTS.addr + evCount + 5;
+      ModbusMessage response;
+//    Get all in as few requests as possible
+      uint16_t got = 0;
+      uint16_t total = sizeof(stw) / sizeof(uint16_t);
+      while (got < total) {
+        words = total - got;
+        if (words > 120) words = 120;
+        response = MBclient.syncRequest(27, targetServer, READ_HOLD_REGISTER, (uint16_t)(addr + got), words);
+        err = response.getError();
+        if (err!=SUCCESS) {
+          handleError(err, 27);
+          break;
+        }
+        offs = 3;
+        for (uint16_t i = 0; i < words; ++i) {
+          offs = response.get(offs, stw[got + i]);
+        }
+        got += words;
+      }
+      if (got < total) break;
+      auto dword = [&](uint16_t i) { return ((uint32_t)stw[i] << 16) | stw[i + 1]; };
+      cout << "Min. free heap      " << dword(0) << endl;
+      cout << "Min. max heap block " << dword(2) << endl;
+      cout << "Telnet bytes lost   " << dword(4) << endl;
+      cout << "Modbus errors       " << dword(6) << endl;
+//    Histogram header: upper bucket limits in us
+      snprintf(buf, 128, "%-7s %10s %9s", "us", "count", "max");
+      cout << buf;
+      for (uint16_t j = 0; j < BUCKETS; ++j) {
+        if (j < BUCKETS - 1) {
+          uint32_t lim = 2UL << j;
+          if (lim >= 1024) snprintf(buf, 128, " <%4uk", (unsigned int)(lim / 1024));
+          else             snprintf(buf, 128, " <%5u", (unsigned int)lim);
+        } else {
+          snprintf(buf, 128, "  more");
+        }
+        cout << buf;
+      }
+      cout << endl;
+      for (uint16_t i = 0; i < NUM_STATS; ++i) {
+        uint16_t b = 8 + i * STAT_WORDS;
+        snprintf(buf, 128, "%-7s %10u %9u", names[i], (unsigned int)dword(b), (unsigned int)dword(b + 2));
+        cout << buf;
+        for (uint16_t j = 0; j < BUCKETS; ++j) {
+          snprintf(buf, 128, " %6u", (unsigned int)stw[b + 4 + j]);
+          cout << buf;
+        }
+        cout << endl;
+      }
+    }
+    break;
   default:
     usage("MAYNOTHAPPEN error?!?");
     return -2;
@@ -38,10 +38,15 @@ void Blinker::stop() {
 
 // update: check if the blinking pattern needs to be advanced a step
 void Blinker::update() {
+  update(millis());
+}
+
+// update: same, with the current millis() time given
+void Blinker::update(uint32_t now) {
   // Do we have a valid interval?
   if (B_interval) {
     // Yes. Has it passed?
-    if (millis() - B_lastTick > B_interval) {
+    if (now - B_lastTick > B_interval) {
       // Yes. get the current state of the LED pin
       bool state = digitalRead(B_port);
       // Does the pattern require an ON?
@@ -60,7 +65,7 @@ void Blinker::update() {
         B_counter = 0;
         B_pWork = B_pattern;
       }
-      B_lastTick = millis();
+      B_lastTick = now;
     }
   }
 }
@@ -36,6 +36,8 @@ public:
 
   // update: check if the blinking pattern needs to be advanced a step
   void update();
+  // update: same, with the current millis() time given
+  void update(uint32_t now);
 
 protected:
   uint8_t  B_counter;      // Number of bit currently processed
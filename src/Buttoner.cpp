@@ -6,7 +6,7 @@
 Buttoner::Buttoner(int port, bool onState, bool pullUp, uint32_t queueSize) :
   BE_port(port),
   BE_onState(onState),
-  BE_queueSize(queueSize),
+  BE_queueSize((queueSize && queueSize < BE_maxQueue) ? queueSize : BE_maxQueue),
   BE_doubleClickTime(BE_defaultDCT),
   BE_pressTime(BE_defaultPT),
   BE_state(BS_IDLE),
@@ -33,7 +33,7 @@ ButtonEvent Buttoner::peekEvent() {
 }
 
 void Buttoner::clearEvents() {
-  queue<ButtonEvent>().swap(BE_eventList);
+  BE_eventList.clear();
 }
 
 void Buttoner::setTiming(uint32_t doubleClickTime, uint32_t pressTime) {
@@ -42,11 +42,15 @@ void Buttoner::setTiming(uint32_t doubleClickTime, uint32_t pressTime) {
 }
 
 int Buttoner::update() {
+  return update(millis());
+}
+
+int Buttoner::update(uint32_t now) {
   // We do not sample in less than 5ms intervals
-  if (millis() - BE_stateTimer < 5) {
+  if (now - BE_stateTimer < 5) {
     return -1;
   }
-  BE_stateTimer = millis();
+  BE_stateTimer = now;
 
   // Get debounced button state
   // The 0xFC00 (first six bits set) results in 16-6=10 samples being considered 
@@ -61,7 +65,7 @@ int Buttoner::update() {
     // Button pressed?
     if (buttonState) {
       // Yes. Wind up timer and proceed to next state
-      BE_timer = millis();
+      BE_timer = now;
       BE_state = BS_CLICKED1;
     }
     break;
@@ -69,9 +73,9 @@ int Buttoner::update() {
     // Button still held down?
     if (buttonState) {
       // Yes. Did the holding time pass?
-      if (millis() - BE_timer > BE_pressTime) {
+      if (now - BE_timer > BE_pressTime) {
         // Yes. Report a PRESS event
-        if (!BE_queueSize || BE_eventList.size() < BE_queueSize)  BE_eventList.push(BE_PRESS);
+        if (BE_eventList.size() < BE_queueSize)  BE_eventList.push(BE_PRESS);
         // Go into cooldown phase to have the button released again
         BE_state = BS_COOLDOWN;
       }
@@ -82,16 +86,16 @@ int Buttoner::update() {
     break;
   case BS_RELEASED1: // Button was released after the first click
     // Did the time for double clicks pass without another click?
-    if (millis() - BE_timer > BE_doubleClickTime) {
+    if (now - BE_timer > BE_doubleClickTime) {
       // Yes. report a single click then. No cooldown required!
-      if (!BE_queueSize || BE_eventList.size() < BE_queueSize)  BE_eventList.push(BE_CLICK);
+      if (BE_eventList.size() < BE_queueSize)  BE_eventList.push(BE_CLICK);
       BE_state = BS_IDLE;
     } else {
       // No, still waiting for second click.
       // Was the button clicked again?
       if (buttonState) {
         // Yes. Report double click and proceed to cooldown
-        if (!BE_queueSize || BE_eventList.size() < BE_queueSize)  BE_eventList.push(BE_DOUBLECLICK);
+        if (BE_eventList.size() < BE_queueSize)  BE_eventList.push(BE_DOUBLECLICK);
         BE_state = BS_COOLDOWN;
       }
     }
@@ -8,13 +8,14 @@
 #ifndef _BUTTONER_H
 #define _BUTTONER_H
 #include <Arduino.h>
-#include <queue>
-
-using std::queue;
+#include "FixedRing.h"
 
 // Reported events
 enum ButtonEvent : uint8_t { BE_NONE = 0, BE_CLICK, BE_DOUBLECLICK, BE_PRESS };
 
+// Maximum number of events held in queue
+const uint32_t BE_maxQueue(8);
+
 // Timing values
 const uint32_t BE_defaultDCT(250);   // maximum time between clicks of a double click
 const uint32_t BE_defaultPT(400);    // holding time to determine a held button
@@ -25,13 +26,15 @@ public:
   // - port: GPIO number (mandatory)
   // - onState: logic level of the GPIO when the button is pressed
   // - pullUp: set to true to have the GPIO configured as INPUT_PULLUP
-  // - queueSize: number of events to keep (0=unlimited)
+  // - queueSize: number of events to keep (0 or more than BE_maxQueue: BE_maxQueue)
   explicit Buttoner(int port, bool onState = HIGH, bool pullUp = false, uint32_t queueSize = 4);
 
   // update: polling function to read the button state and generate events. This function
   // needs to be called frequently!
   // Returns the number of events currently held in queue
   int update();
+  // update: same, with the current millis() time given
+  int update(uint32_t now);
 
   // getEvent: pull first event from queue, deleting it from the queue
   ButtonEvent getEvent();
@@ -63,7 +66,7 @@ protected:
   uint32_t BE_timer;               // Timer watching the clicking times
   uint16_t BE_keyState;            // Shift register to hold sampled button states
   uint32_t BE_stateTimer;          // Timer to maintain polling interval
-  queue<ButtonEvent> BE_eventList; // Queue of events
+  FixedRing<ButtonEvent, BE_maxQueue> BE_eventList; // Queue of events
 };
 
 #endif
@@ -0,0 +1,55 @@
+// Copyright (c) 2021 miq1 @ gmx . de
+
+#ifndef _FIXEDRING_H
+#define _FIXEDRING_H
+
+#include <Arduino.h>
+
+// FixedRing implements a circular queue with a capacity fixed at compile time.
+// The storage is part of the object, so nothing is allocated on the heap - ever.
+// A full ring will refuse new elements until older ones are consumed.
+// No locking is done - use it from one task only.
+template <typename T, size_t N>
+class FixedRing {
+  static_assert(N > 0, "FixedRing: capacity must be at least 1");
+public:
+  // Constructor: empty ring
+  FixedRing() : FR_begin(0), FR_count(0) {}
+
+  // push: add an element at the end. Returns false if the ring is full
+  bool push(const T& value) {
+    if (FR_count >= N) return false;
+    FR_data[(FR_begin + FR_count) % N] = value;
+    FR_count++;
+    return true;
+  }
+
+  // pop: remove the first element. Returns false if the ring is empty
+  bool pop() {
+    if (!FR_count) return false;
+    FR_begin = (FR_begin + 1) % N;
+    FR_count--;
+    return true;
+  }
+
+  // front: get the first element. Must not be called on an empty ring!
+  inline const T& front() const { return FR_data[FR_begin]; }
+
+  // operator[]: get the element at index i, 0 being the first
+  inline const T& operator[](size_t i) const { return FR_data[(FR_begin + i) % N]; }
+
+  // clear: remove all elements
+  inline void clear() { FR_begin = 0; FR_count = 0; }
+
+  inline size_t size() const { return FR_count; }
+  inline bool empty() const { return FR_count == 0; }
+  inline bool full() const { return FR_count >= N; }
+  static constexpr size_t capacity() { return N; }
+
+protected:
+  T FR_data[N];                // Element storage
+  size_t FR_begin;             // Index of the first element
+  size_t FR_count;             // Number of elements held
+};
+
+#endif
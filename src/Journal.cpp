@@ -0,0 +1,100 @@
+// Modbus bridge device V3
+// Copyright 2020 by miq1@gmx.de
+
+#include "Journal.h"
+
+// Constructor: set up the flash area
+Journal::Journal(uint32_t start, uint32_t sectors) :
+  J_start(start),
+  J_sectors(sectors),
+  J_next(0),
+  J_seq(0) { }
+
+// readRecord: read a slot from flash. Returns false if the slot is blank
+bool Journal::readRecord(uint32_t slot, Record& r) {
+  if (!ESP.flashRead(address(slot), (uint32_t *)&r, sizeof(Record))) return false;
+  return r.seq != BLANK;
+}
+
+// checksum: rotate and xor all words of a record except the checksum itself
+uint32_t Journal::checksum(const Record& r) {
+  const uint32_t *w = (const uint32_t *)&r.data;
+  uint32_t c = r.seq ^ 0x4711AFFE;
+  for (uint8_t i = 0; i < sizeof(JournalData) / sizeof(uint32_t); ++i) {
+    c = ((c << 5) | (c >> 27)) ^ w[i];
+  }
+  return c;
+}
+
+// begin: find the latest record
+bool Journal::begin(JournalData& data) {
+  Record r;
+  uint32_t current = J_sectors;   // Sector with the highest leading sequence number
+  uint32_t highest = 0;
+
+  J_next = 0;
+  J_seq = 0;
+  if (!isActive()) return false;
+
+  // Find the current sector by its first record
+  for (uint32_t s = 0; s < J_sectors; ++s) {
+    if (readRecord(s * JOURNAL_PER_SECTOR, r) && r.seq >= highest) {
+      highest = r.seq;
+      current = s;
+    }
+  }
+  // Empty journal?
+  if (current == J_sectors) return false;
+
+  // Yes. Binary search for the last used slot in it. Slots are filled from the start,
+  // so all used slots come before the blank ones.
+  uint32_t first = current * JOURNAL_PER_SECTOR;
+  uint32_t lo = 0;                        // Known to be used
+  uint32_t hi = JOURNAL_PER_SECTOR - 1;
+  while (lo < hi) {
+    uint32_t mid = (lo + hi + 1) / 2;
+    if (readRecord(first + mid, r)) {
+      lo = mid;
+    } else {
+      hi = mid - 1;
+    }
+  }
+  // Next write goes behind the last used slot
+  uint32_t total = J_sectors * JOURNAL_PER_SECTOR;
+  J_next = (first + lo + 1) % total;
+
+  // Go back to the latest valid record. Stop after a sector's worth of slots
+  uint32_t slot = first + lo;
+  for (uint32_t i = 0; i < JOURNAL_PER_SECTOR; ++i) {
+    if (readRecord(slot, r) && r.check == checksum(r)) {
+      J_seq = r.seq;
+      data = r.data;
+      return true;
+    }
+    slot = (slot + total - 1) % total;
+  }
+  // All damaged - keep counting from what we saw
+  J_seq = highest;
+  return false;
+}
+
+// append: add a record to the journal
+bool Journal::append(const JournalData& data) {
+  if (!isActive()) return false;
+
+  // Entering a new sector?
+  if ((J_next % JOURNAL_PER_SECTOR) == 0) {
+    // Yes. Erase it first
+    if (!ESP.flashEraseSector(address(J_next) / FLASH_SECTOR_SIZE)) return false;
+  }
+  
+  Record r;
+  r.seq = J_seq + 1;
+  r.data = data;
+  r.check = checksum(r);
+  bool result = ESP.flashWrite(address(J_next), (uint32_t *)&r, sizeof(Record));
+  // Slot is used up, even if the write failed
+  J_next = (J_next + 1) % (J_sectors * JOURNAL_PER_SECTOR);
+  if (result) J_seq = r.seq;
+  return result;
+}
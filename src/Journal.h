@@ -0,0 +1,72 @@
+// Journal
+// Copyright 2020 by miq1@gmx.de
+//
+// Journal keeps counters persistent in a reserved flash area with bounded wear.
+// Records are appended one after the other; a sector is erased only when the journal
+// moves on into it. With N sectors each one will be erased once per N * JOURNAL_PER_SECTOR
+// records written.
+// On begin() the latest valid record is located: the sector with the highest leading
+// sequence number is the current one, inside of that the end of the used area is found
+// by a binary search. Records damaged by a power loss while writing are skipped.
+// NOTE: the flash area must be sector aligned and must not be used for anything else!
+// 
+#ifndef _JOURNAL_H
+#define _JOURNAL_H
+#include <Arduino.h>
+#if defined(ESP32)
+#include <esp_spi_flash.h>
+#define FLASH_SECTOR_SIZE SPI_FLASH_SEC_SIZE
+#else
+#include <flash_hal.h>
+#endif
+
+// Payload held in a journal record
+struct JournalData {
+  uint64_t energy;                 // Accumulated energy in mWh
+  uint32_t onTime;                 // Time in ON state in seconds
+  uint32_t reserved;               // Unused, pads to 8 bytes multiple
+  JournalData() : energy(0), onTime(0), reserved(0) {}
+};
+
+class Journal {
+public:
+  // Constructor: arguments are
+  // - start: flash address of the first sector to use
+  // - sectors: number of sectors. At least 2 are required, else the journal is inactive
+  Journal(uint32_t start, uint32_t sectors);
+
+  // begin: find the latest record. Returns true and its data, if one was found
+  bool begin(JournalData& data);
+
+  // append: add a record to the journal. Returns false if the flash could not be written
+  bool append(const JournalData& data);
+
+  // isActive: return true if the journal has a usable flash area
+  inline bool isActive() { return J_sectors >= 2; }
+
+  // getSequence: get the sequence number of the latest record (0: none yet)
+  inline uint32_t getSequence() { return J_seq; }
+
+protected:
+  // Record as written to flash. An erased slot reads as all 0xFF.
+  struct Record {
+    uint32_t seq;                  // Sequence number, counting up from 1
+    uint32_t check;                // Checksum over seq and data
+    JournalData data;              // Payload
+  };
+  static const uint32_t JOURNAL_PER_SECTOR = FLASH_SECTOR_SIZE / sizeof(Record);
+  static const uint32_t BLANK = 0xFFFFFFFF;
+
+  uint32_t J_start;                // Flash address of the journal area
+  uint32_t J_sectors;              // Number of sectors used
+  uint32_t J_next;                 // Next slot to be written
+  uint32_t J_seq;                  // Sequence number of the latest record
+
+  // address: get the flash address of a slot
+  inline uint32_t address(uint32_t slot) {
+    return J_start + (slot / JOURNAL_PER_SECTOR) * FLASH_SECTOR_SIZE + (slot % JOURNAL_PER_SECTOR) * sizeof(Record);
+  }
+  bool readRecord(uint32_t slot, Record& r);
+  uint32_t checksum(const Record& r);
+};
+#endif
@@ -0,0 +1,46 @@
+// Modbus bridge device V3
+// Copyright 2020 by miq1@gmx.de
+
+#include "Persister.h"
+
+// Constructor: takes time in ms without changes before data is committed
+Persister::Persister(uint32_t quietTime) :
+  P_quietTime(quietTime),
+  P_lastChange(0),
+  P_pending(0) { }
+
+// write: write a single byte to the EEPROM copy
+void Persister::write(int address, uint8_t value) {
+  if (EEPROM.read(address) != value) {
+    EEPROM.write(address, value);
+    markDirty();
+  }
+}
+
+// markDirty: register a change done directly in the EEPROM copy
+void Persister::markDirty() {
+  // Count up, but do not overflow
+  if (P_pending < 0xFFFF) P_pending++;
+  // Any change will restart the quiet period
+  P_lastChange = millis();
+}
+
+// update: check if the quiet period is over and commit.
+bool Persister::update() {
+  // Anything to do and quiet long enough?
+  if (P_pending && (millis() - P_lastChange) >= P_quietTime) {
+    // Yes. Commit it.
+    return flush();
+  }
+  return false;
+}
+
+// flush: commit pending changes now.
+bool Persister::flush() {
+  if (P_pending) {
+    EEPROM.commit();
+    P_pending = 0;
+    return true;
+  }
+  return false;
+}
@@ -0,0 +1,56 @@
+// Persister
+// Copyright 2020 by miq1@gmx.de
+
+// Persister is a write-back layer over the EEPROM emulation.
+// EEPROM.commit() erases and rewrites the complete flash sector, so doing it for every
+// single change is slow and wears out the flash. Persister instead collects changes in the
+// EEPROM RAM copy and commits them only after no other change came in for a quiet period.
+// Unchanged values are not counted, so writing the same data again will not commit.
+// flush() will commit at once - call it before restarts, updates etc.
+// NOTE: update() must be called regularly for the deferred commits to happen!
+
+#ifndef _PERSISTER_H
+#define _PERSISTER_H
+
+#include <Arduino.h>
+#include <EEPROM.h>
+
+#define PERSIST_QUIET 5000
+
+// Persister: helper class to coalesce EEPROM writes
+class Persister {
+public:
+  // Constructor: takes time in ms without changes before data is committed
+  explicit Persister(uint32_t quietTime = PERSIST_QUIET);
+
+  // put: write a value to the EEPROM copy. Only changed data will make it dirty
+  template <typename T> void put(int address, const T& value) {
+    T old;
+    EEPROM.get(address, old);
+    if (memcmp(&old, &value, sizeof(T))) {
+      EEPROM.put(address, value);
+      markDirty();
+    }
+  }
+
+  // write: write a single byte to the EEPROM copy
+  void write(int address, uint8_t value);
+
+  // markDirty: register a change done directly in the EEPROM copy
+  void markDirty();
+
+  // update: check if the quiet period is over and commit. Returns true if data was committed
+  bool update();
+
+  // flush: commit pending changes now. Returns true if data was committed
+  bool flush();
+
+  // pending: number of changes waiting to be committed (0: clean)
+  inline uint16_t pending() { return P_pending; }
+
+protected:
+  uint32_t P_quietTime;    // Time in ms without changes before a commit
+  uint32_t P_lastChange;   // Time of the latest change
+  uint16_t P_pending;      // Number of changes since last commit
+};
+#endif
@@ -0,0 +1,43 @@
+// RegisterImage
+// Copyright 2020 by miq1@gmx.de
+
+#include "RegisterImage.h"
+
+void RegisterImage::set(uint16_t addr, uint16_t value) {
+  uint8_t *p = (uint8_t *)(RI_words + addr - 1);
+  p[0] = (value >> 8) & 0xFF;
+  p[1] = value & 0xFF;
+}
+
+void RegisterImage::set(uint16_t addr, float value) {
+  uint32_t w;
+  memcpy(&w, &value, sizeof(w));
+  set32(addr, w);
+}
+
+void RegisterImage::set32(uint16_t addr, uint32_t value) {
+  set(addr, (uint16_t)(value >> 16));
+  set(addr + 1, (uint16_t)(value & 0xFFFF));
+}
+
+ModbusMessage RegisterImage::read(ModbusMessage& request) const {
+  ModbusMessage response;          // returned response message
+  uint16_t address = 0;
+  uint16_t words = 0;
+
+  // Get start address and length for read
+  request.get(2, address);
+  request.get(4, words);
+
+  // Valid?
+  if (valid(address, words)) {
+    // Yes, both okay.
+    // set up response and copy the requested range
+    response.add(request.getServerID(), request.getFunctionCode(), (uint8_t)(words * 2));
+    response.add(data(address), (uint16_t)(words * 2));
+  } else {
+    // No, memory violation. Return error
+    response.setError(request.getServerID(), request.getFunctionCode(), ILLEGAL_DATA_ADDRESS);
+  }
+  return response;
+}
@@ -0,0 +1,42 @@
+// RegisterImage
+// Copyright 2020 by miq1@gmx.de
+//
+// RegisterImage holds all registers of RegisterMap.h as big-endian words, ready to be sent.
+// The firmware refreshes it on every change, so a FC03 read request is answered by a plain copy.
+// Nothing in here depends on the ESP, so the benchmark in Extras/Bench uses the same code.
+
+#ifndef _REGISTERIMAGE_H
+#define _REGISTERIMAGE_H
+
+#include <stdint.h>
+#include <string.h>
+#include "ModbusMessage.h"
+#include "RegisterMap.h"
+
+class RegisterImage {
+public:
+  RegisterImage() { memset(RI_words, 0, sizeof(RI_words)); }
+
+  // set: store a 16 bit value, a pair of bytes or a float (two registers) at register addr
+  void set(uint16_t addr, uint16_t value);
+  inline void set(uint16_t addr, uint8_t hi, uint8_t lo) { set(addr, (uint16_t)((hi << 8) | lo)); }
+  void set(uint16_t addr, float value);
+
+  // set32: store a uint32_t in registers addr and addr + 1
+  void set32(uint16_t addr, uint32_t value);
+
+  // data: the bytes from register addr on
+  inline const uint8_t *data(uint16_t addr) const { return (const uint8_t *)(RI_words + addr - 1); }
+
+  // valid: true if registers addr..addr + words - 1 exist and may be read in one request
+  static inline bool valid(uint16_t addr, uint16_t words) {
+    return addr && words && (addr + words - 1) <= MAXWORD && words <= REG_MAXREAD;
+  }
+
+  // read: the FC03 response to a read request
+  ModbusMessage read(ModbusMessage& request) const;
+
+protected:
+  uint16_t RI_words[MAXWORD];   // RI_words[0] is register 1
+};
+#endif
@@ -0,0 +1,150 @@
+// RegisterMap
+// Copyright 2020 by miq1@gmx.de
+//
+// The Modbus register layout of the Smartdose firmware.
+// This header is used by the firmware as well as by the Linux client (Extras/Smartdose.cpp), so both
+// derive all addresses and read plans at compile time from the same definitions.
+// Addresses are Modbus register numbers, starting at 1. 32 bit values take two registers, high word first.
+// Any change here must increase REG_LAYOUT_VERSION!
+#ifndef _REGISTERMAP_H
+#define _REGISTERMAP_H
+
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+// Version of the register layout
+constexpr uint8_t REG_LAYOUT_VERSION(3);
+// Contents of the layout register: marker byte 0x5D and version
+constexpr uint16_t REG_LAYOUT_ID((0x5D << 8) | REG_LAYOUT_VERSION);
+// Address of the layout register. It is fixed and does not depend on any of the sizes below,
+// so a client built with a different map will still find it
+constexpr uint16_t REG_LAYOUT_ADDR(101);
+
+// Sizes the layout depends on
+constexpr uint8_t NUM_TIMERS(16);                // Number of timers
+constexpr uint8_t MAXEVENT(40);                  // Number of event slots
+constexpr uint8_t REG_STAT_BLOCKS(7);            // Number of execution time statistics
+constexpr uint8_t REG_STAT_BUCKETS(16);          // Histogram buckets per statistic
+constexpr uint8_t MAX_CHANNELS(4);               // Number of switched channels the map has room for
+// Words per execution time block: count, max, histogram
+constexpr uint16_t STAT_WORDS(2 + 2 + REG_STAT_BUCKETS);
+// Words per channel block: state, state time, ON time
+constexpr uint16_t CHANNEL_WORDS(1 + 2 + 2);
+
+// Types of register contents
+enum REG_TYPE : uint8_t {
+  RT_U16 = 0,    // plain 16 bit value
+  RT_BYTES,      // two bytes, high and low
+  RT_HMS,        // 2 words: hours, minutes:seconds
+  RT_FLOAT,      // 2 words: IEEE754 float
+  RT_U32,        // 2 words: uint32_t
+};
+
+// RegField: one entry of the map. count elements of one type, starting at addr
+struct RegField {
+  uint16_t addr;
+  uint16_t count;
+  REG_TYPE type;
+  // width: registers taken by one element
+  constexpr uint16_t width() const { return (type == RT_U16 || type == RT_BYTES) ? 1 : 2; }
+  // words: registers taken by the complete field
+  constexpr uint16_t words() const { return count * width(); }
+  // at: address of element i
+  constexpr uint16_t at(uint16_t i) const { return addr + i * width(); }
+  // next: first address behind the field
+  constexpr uint16_t next() const { return addr + words(); }
+};
+
+// The map. Each field starts right behind its predecessor
+constexpr RegField REG_STATE       { 1,                       1, RT_U16 };     // Switch state/dim value
+constexpr RegField REG_FLAGS       { REG_STATE.next(),        1, RT_U16 };     // Flag word
+constexpr RegField REG_UPTIME      { REG_FLAGS.next(),        1, RT_HMS };     // Uptime
+constexpr RegField REG_STATETIME   { REG_UPTIME.next(),       1, RT_HMS };     // Time in current state
+constexpr RegField REG_ONTIME      { REG_STATETIME.next(),    1, RT_HMS };     // ON time
+constexpr RegField REG_ENERGY      { REG_ONTIME.next(),       1, RT_FLOAT };   // Accumulated Wh
+constexpr RegField REG_FACTORS     { REG_ENERGY.next(),       3, RT_FLOAT };   // V, A, W correction factors
+constexpr RegField REG_MEASURES    { REG_FACTORS.next(),      3, RT_FLOAT };   // V, A, W measured
+constexpr RegField REG_TIMERS      { REG_MEASURES.next(),     NUM_TIMERS * 2, RT_BYTES }; // days:onOff, hour:minute per timer
+constexpr RegField REG_EVENTCOUNT  { REG_TIMERS.next(),       1, RT_U16 };     // Number of event slots
+constexpr RegField REG_EVENTS      { REG_EVENTCOUNT.next(),   MAXEVENT, RT_U16 }; // Event slots
+constexpr RegField REG_AO_AMPS     { REG_EVENTS.next(),       1, RT_U16 };     // Auto off mA value
+constexpr RegField REG_AO_CYCLES   { REG_AO_AMPS.next(),      1, RT_U16 };     // Auto off cycles
+constexpr RegField REG_PENDING     { REG_AO_CYCLES.next(),    1, RT_U16 };     // Number of EEPROM changes not yet committed
+constexpr RegField REG_BOOT_RELAY  { REG_PENDING.next(),      1, RT_U16 };     // ms from start to relay ON by default
+constexpr RegField REG_BOOT_MODBUS { REG_BOOT_RELAY.next(),   1, RT_U16 };     // ms from start to the first Modbus request answered
+constexpr RegField REG_LAYOUT      { REG_LAYOUT_ADDR,         1, RT_U16 };     // REG_LAYOUT_ID, fixed address
+constexpr RegField REG_STATS       { REG_LAYOUT.next(),       4, RT_U32 };     // min free heap, min max block, telnet bytes lost, Modbus errors
+constexpr RegField REG_TIMINGS     { REG_STATS.next(),        REG_STAT_BLOCKS * STAT_WORDS, RT_U16 }; // count, max us, histogram per block
+constexpr RegField REG_CHANNELCOUNT { REG_TIMINGS.next(),      1, RT_U16 };     // Number of channels of the device
+constexpr RegField REG_CHANNELS    { REG_CHANNELCOUNT.next(), (MAX_CHANNELS - 1) * CHANNEL_WORDS, RT_U16 }; // Channels 2..MAX_CHANNELS
+
+// Highest addressable register
+constexpr uint16_t MAXWORD(REG_CHANNELS.next() - 1);
+static_assert(REG_BOOT_MODBUS.next() <= REG_LAYOUT_ADDR, "RegisterMap: timers and events do not fit in front of the layout register");
+
+// RM_channel: address of the block of channel ch (1..MAX_CHANNELS - 1).
+// Channel 0 is using REG_STATE, REG_STATETIME and REG_ONTIME; its block would start at REG_CHANNELCOUNT.
+// The state time is at +1, the ON time at +3 (both RT_HMS).
+constexpr uint16_t RM_channel(uint8_t ch) { return REG_CHANNELS.addr + (ch - 1) * CHANNEL_WORDS; }
+
+// Timer onOff byte: bit 0 switches ON (1) or OFF (0), bits 4 and 5 are the channel the timer is bound to
+constexpr uint8_t TIMER_ONMASK(0x01);
+constexpr uint8_t TIMER_CHANNELMASK(0x30);
+constexpr uint8_t TIMER_CHANNELSHIFT(4);
+inline uint8_t RM_timerChannel(uint8_t onOff) { return (onOff & TIMER_CHANNELMASK) >> TIMER_CHANNELSHIFT; }
+static_assert(MAX_CHANNELS <= (TIMER_CHANNELMASK >> TIMER_CHANNELSHIFT) + 1, "RegisterMap: timers can not address all channels");
+
+// Read plans
+// One request covering all data for INFO/EVERY, including the layout register for a check
+constexpr uint16_t REG_INFO_WORDS(REG_LAYOUT.addr);
+// Older firmware without the layout register has less registers and refuses the INFO read.
+// Its short plan reads up to the event count, the auto off registers are behind the event slots.
+constexpr uint16_t REG_LEGACY_WORDS(REG_EVENTCOUNT.addr);
+// Largest number of registers in one read request
+constexpr uint16_t REG_MAXREAD(125);
+static_assert(REG_INFO_WORDS <= REG_MAXREAD, "RegisterMap: INFO data does not fit into one request");
+
+// Snapshot, function code 0x46: layout ID, registers REG_STATE..REG_MEASURES, REG_AO_AMPS and REG_AO_CYCLES,
+// boot ID, latest event sequence number, count byte and up to SNAP_MAXEVENTS undelivered event records like with 0x45
+constexpr uint16_t SNAP_WORDS(REG_MEASURES.next() - REG_STATE.addr);
+constexpr uint8_t SNAP_ACK(0x01);                // Request flag: boot ID and sequence number of the events received follow
+constexpr uint8_t SNAP_RECORD(9);                // Bytes per event record: sequence number, epoch time, type
+constexpr uint8_t SNAP_MAXEVENTS((254 - (2 + 2 + 2 * SNAP_WORDS + 2 * (REG_AO_AMPS.words() + REG_AO_CYCLES.words()) + 4 + 4 + 1)) / SNAP_RECORD);
+
+// Decoding helpers for a client. regs[n - 1] holds register n, in host byte order
+inline uint32_t RM_u32(const uint16_t *regs, uint16_t addr) {
+  return ((uint32_t)regs[addr - 1] << 16) | regs[addr];
+}
+
+inline float RM_float(const uint16_t *regs, uint16_t addr) {
+  uint32_t w = RM_u32(regs, addr);
+  float f;
+  memcpy(&f, &w, sizeof(f));
+  return f;
+}
+
+// RM_seconds: RT_HMS value as seconds
+inline uint32_t RM_seconds(const uint16_t *regs, uint16_t addr) {
+  return regs[addr - 1] * 3600 + (regs[addr] >> 8) * 60 + (regs[addr] & 0xFF);
+}
+
+// Event slot words: bits 11..15 event type, bits 6..10 hours or day of month, bits 0..5 minutes or month
+inline uint16_t RM_eventWord(uint8_t type, uint8_t hi, uint8_t lo) {
+  return ((type & 0x1F) << 11) | ((hi & 0x1F) << 6) | (lo & 0x3F);
+}
+inline uint8_t RM_eventType(uint16_t w) { return (w >> 11) & 0x1F; }
+inline uint8_t RM_eventHi(uint16_t w) { return (w >> 6) & 0x1F; }
+inline uint8_t RM_eventLo(uint16_t w) { return w & 0x3F; }
+// RM_eventAt: event word for a type at local time t. dated: the word carries day and month instead
+// of hours and minutes, as with the boot date and date change events
+inline uint16_t RM_eventAt(uint8_t type, bool dated, const struct tm& t) {
+  return dated ? RM_eventWord(type, t.tm_mday, t.tm_mon + 1) : RM_eventWord(type, t.tm_hour, t.tm_min);
+}
+
+// RM_layoutMatches: true if the words registers read from REG_STATE on came from a device with this layout
+inline bool RM_layoutMatches(const uint16_t *regs, uint16_t words) {
+  return words >= REG_LAYOUT.addr && regs[REG_LAYOUT.addr - 1] == REG_LAYOUT_ID;
+}
+
+#endif
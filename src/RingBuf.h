@@ -20,12 +20,25 @@ using std::lock_guard;
 
 #include <Arduino.h>
 #include <iterator>
+#include <atomic>
 
-// RingBuf implements a circular buffer of chosen size.
+// Synchronisation policies for RingBuf
+// RB_LOCKED: default, all operations are allowed from any task. Uses a mutex on ESP32.
+// RB_SPSC: lock-free for exactly one producer (push_back) and one consumer (everything else).
+//          The producer may be an interrupt function or a task on another core.
+struct RB_LOCKED {};
+struct RB_SPSC {};
+
+template <typename T, typename P = RB_LOCKED> class RingBuf;
+
+
+// RingBuf (RB_LOCKED) implements a circular buffer of chosen size.
+// The elements are held in a wrap-around storage, so push_back() and pop() are O(1) - no
+// data is moved inside the buffer. The used area may consist of two contiguous segments,
+// see spans().
 // No exceptions thrown at all. Memory allocation failures will result in a const
 // buffer pointing to the static "nilBuf"!
-// template <typename T>
-template <typename T>
+template <typename T, typename P>
 class RingBuf {
 public:
 // Fallback static minimal buffer if memory allocation failed etc.
@@ -58,8 +71,15 @@ public:
   size_t size();
 
   // data: get start address of the elements in buffer
+  // WARNING! Only the elements of the first span are contiguous - use spans() to get all.
   const T *data();
 
+  // spans: get the used area as two contiguous segments.
+  // first/firstLen: the oldest elements, up to the end of the storage
+  // second/secondLen: the elements wrapped around to the start of the storage (secondLen may be 0)
+  // Returns the total number of elements.
+  size_t spans(const T *&first, size_t& firstLen, const T *&second, size_t& secondLen);
+
   // empty: returns true if no elements are in the buffer
   bool empty();
 
@@ -107,34 +127,35 @@ public:
     using pointer           = T*;
     using reference         = T&;
 
-    explicit Iterator(pointer ptr) : m_ptr(ptr) {}
+    Iterator(RingBuf *rb, size_t index) : m_rb(rb), m_index(index) {}
 
-    reference operator*() const { return *m_ptr; }
-    pointer operator->() { return m_ptr; }
-    Iterator& operator++() { m_ptr++; return *this; }  
+    reference operator*() const { return *m_rb->slot(m_index); }
+    pointer operator->() { return m_rb->slot(m_index); }
+    Iterator& operator++() { m_index++; return *this; }  
     Iterator operator++(int) { Iterator tmp = *this; ++(*this); return tmp; }
-    friend bool operator== (const Iterator& a, const Iterator& b) { return a.m_ptr == b.m_ptr; };
-    friend bool operator!= (const Iterator& a, const Iterator& b) { return a.m_ptr != b.m_ptr; };  
+    friend bool operator== (const Iterator& a, const Iterator& b) { return a.m_rb == b.m_rb && a.m_index == b.m_index; };
+    friend bool operator!= (const Iterator& a, const Iterator& b) { return !(a == b); };  
 
     private:
-      pointer m_ptr;
+      RingBuf *m_rb;
+      size_t m_index;      // Logical index, 0 is the oldest element
   };
 
   // Provide begin() and end()
-  Iterator begin() { return Iterator(RB_begin); }
-  Iterator end()   { return Iterator(RB_end); }
+  Iterator begin() { return Iterator(this, 0); }
+  Iterator end()   { return Iterator(this, RB_count); }
 
-  // bufferAdr: return the start address of the underlying, double-sized data buffer.
+  // bufferAdr: return the start address of the underlying data buffer.
   // bufferSize: return the real length of the underlying data buffer.
   // Note that this is only sensible in a debug context!
   inline const uint8_t *bufferAdr() { return (uint8_t *)RB_buffer; }
   inline const size_t bufferSize() { return RB_len * RB_elementSize; }
 
 protected:
-  T *RB_buffer;           // The data buffer proper (twice the requested size)
-  T *RB_begin;            // Pointer to the first element currently used
-  T *RB_end;              // Pointer behind the last element currently used
-  size_t RB_len;                // Real length of buffer (twice the requested size)
+  T *RB_buffer;           // The data buffer proper
+  size_t RB_head;               // Storage index of the first element currently used
+  size_t RB_count;              // Number of elements currently used
+  size_t RB_len;                // Real length of buffer
   size_t RB_usable;             // Requested length of the buffer
   bool RB_preserve;             // Flag to hold or discard the oldest elements if elements are added
   size_t RB_elementSize;        // Size of a single buffer element
@@ -142,62 +163,72 @@ protected:
   std::mutex m;              // Mutex to protect pop, clear and push_back operations
 #endif
   void setFail();            // Internal function to set the object to nilBuf
-  void moveFront(size_t numElements); // Move buffer far left internally
+  // slot: storage address of the element with logical index
+  inline T *slot(size_t index) {
+    index += RB_head;
+    if (index >= RB_len) index -= RB_len;
+    return RB_buffer + index;
+  }
+  void dropFront(size_t numElements); // Forget about the oldest elements (used internally only)
+  void copyIn(const T *data, size_t size); // Append elements to used area (used internally only)
 };
 
-template <typename T>
-const T  RingBuf<T>::nilBuf[2] = { 0, 0 };
+template <typename T, typename P>
+const T  RingBuf<T, P>::nilBuf[2] = { };
 
 // setFail: in case of memory allocation problems, use static nilBuf 
-template <typename T>
-void RingBuf<T>::setFail() {
-  RB_buffer = (T *)RingBuf<T>::nilBuf;
-  RB_len = 2 * RB_elementSize;
+template <typename T, typename P>
+void RingBuf<T, P>::setFail() {
+  RB_buffer = (T *)RingBuf<T, P>::nilBuf;
+  RB_len = 2;
   RB_usable = 0;
-  RB_begin = RB_end = RB_buffer;
+  RB_head = RB_count = 0;
 }
 
 // valid: return if buffer is a real one
-template <typename T>
-bool RingBuf<T>::valid() {
-  return (RB_buffer && (RB_buffer != RingBuf<T>::nilBuf));
+template <typename T, typename P>
+bool RingBuf<T, P>::valid() {
+  return (RB_buffer && (RB_buffer != RingBuf<T, P>::nilBuf));
 }
 
 // operator bool: same as valid()
-template <typename T>
-RingBuf<T>::operator bool() {
+template <typename T, typename P>
+RingBuf<T, P>::operator bool() {
   return valid();
 }
 
-// Constructor: allocate a buffer twice the requested size
-template <typename T>
-RingBuf<T>::RingBuf(size_t size, bool p) noexcept :
+// Constructor: allocate a buffer of the requested size
+template <typename T, typename P>
+RingBuf<T, P>::RingBuf(size_t size, bool p) noexcept :
+  RB_head(0),
+  RB_count(0),
   RB_len(size),
   RB_usable(size),
   RB_preserve(p),
   RB_elementSize(sizeof(T)) {
   // Allocate memory
-  RB_buffer = new T[RB_len];
+  RB_buffer = size ? new T[RB_len] : nullptr;
   // Failed?
   if (!RB_buffer) setFail();
   else clear();
 }
 
 // Destructor: free allocated memory, if any
-template <typename T>
-RingBuf<T>::~RingBuf() {
+template <typename T, typename P>
+RingBuf<T, P>::~RingBuf() {
   // Do we have a valid buffer?
   if (valid()) {
     // Yes, free it
-    delete RB_buffer;
+    delete[] RB_buffer;
   }
 }
 
 // Copy constructor: take over everything
-template <typename T>
-RingBuf<T>::RingBuf(const RingBuf &r) noexcept {
+template <typename T, typename P>
+RingBuf<T, P>::RingBuf(const RingBuf &r) noexcept {
+  RB_elementSize = sizeof(T);
   // Is the assigned RingBuf valid?
-  if (r.RB_buffer && (r.RB_buffer != RingBuf<T>::nilBuf)) {
+  if (r.RB_buffer && (r.RB_buffer != RingBuf<T, P>::nilBuf)) {
     // Yes. Try to allocate a copy
     RB_buffer = new T[r.RB_len];
     // Succeeded?
@@ -205,11 +236,10 @@ RingBuf<T>::RingBuf(const RingBuf &r) noexcept {
       // Yes. copy over data
       RB_len = r.RB_len;
       memcpy(RB_buffer, r.RB_buffer, RB_len * r.RB_elementSize);
-      RB_begin = RB_buffer + (r.RB_begin - r.RB_buffer);
-      RB_end = RB_buffer + (r.RB_end - r.RB_buffer);
+      RB_head = r.RB_head;
+      RB_count = r.RB_count;
       RB_preserve = r.RB_preserve;
       RB_usable = r.RB_usable;
-      RB_elementSize = r.RB_elementSize;
     } else {
       setFail();
     }
@@ -219,146 +249,180 @@ RingBuf<T>::RingBuf(const RingBuf &r) noexcept {
 }
 
 // Move constructor
-template <typename T>
-RingBuf<T>::RingBuf(RingBuf &&r) {
+template <typename T, typename P>
+RingBuf<T, P>::RingBuf(RingBuf &&r) {
+  RB_elementSize = sizeof(T);
   // Is the assigned RingBuf valid?
-  if (r.RB_buffer && (r.RB_buffer != RingBuf<T>::nilBuf)) {
+  if (r.RB_buffer && (r.RB_buffer != RingBuf<T, P>::nilBuf)) {
     // Yes. Take over the data
     RB_buffer = r.RB_buffer;
     RB_len = r.RB_len;
-    RB_begin = RB_buffer + (r.RB_begin - r.RB_buffer);
-    RB_end = RB_buffer + (r.RB_end - r.RB_buffer);
+    RB_head = r.RB_head;
+    RB_count = r.RB_count;
     RB_preserve = r.RB_preserve;
     RB_usable = r.RB_usable;
-    RB_elementSize = r.RB_elementSize;
-    r.RB_buffer = nullptr;
+    r.setFail();
   } else {
     setFail();
   }
 }
 
 // Assignment
-template <typename T>
-RingBuf<T>& RingBuf<T>::operator=(const RingBuf<T> &r) {
-  if (valid()) {
+template <typename T, typename P>
+RingBuf<T, P>& RingBuf<T, P>::operator=(const RingBuf<T, P> &r) {
+  if (valid() && this != &r) {
     // Is the source a real RingBuf?
-    if (r.RB_buffer && (r.RB_buffer != RingBuf<T>::nilBuf)) {
-      // Yes. Copy over the data
+    if (r.RB_buffer && (r.RB_buffer != RingBuf<T, P>::nilBuf)) {
+      // Yes. Copy over the data, segment by segment
       clear();
-      push_back(r.RB_begin, r.RB_end - r.RB_begin);
+      size_t firstLen = r.RB_len - r.RB_head;
+      if (firstLen > r.RB_count) firstLen = r.RB_count;
+      push_back(r.RB_buffer + r.RB_head, firstLen);
+      if (r.RB_count > firstLen) push_back(r.RB_buffer, r.RB_count - firstLen);
     }
   }
   return *this;
 }
 
 // Move assignment
-template <typename T>
-RingBuf<T>& RingBuf<T>::operator=(RingBuf<T> &&r) {
-  if (valid()) {
+template <typename T, typename P>
+RingBuf<T, P>& RingBuf<T, P>::operator=(RingBuf<T, P> &&r) {
+  if (valid() && this != &r) {
     // Is the source a real RingBuf?
-    if (r.RB_buffer && (r.RB_buffer != RingBuf<T>::nilBuf)) {
+    if (r.RB_buffer && (r.RB_buffer != RingBuf<T, P>::nilBuf)) {
       // Yes. Copy over the data
-      clear();
-      push_back(r.RB_begin, r.RB_end - r.RB_begin);
-      r.RB_buffer = nullptr;
+      *this = static_cast<const RingBuf<T, P>&>(r);
+      delete[] r.RB_buffer;
+      r.setFail();
     }
   }
   return *this;
 }
 
 // size: number of elements used in the buffer
-template <typename T>
-size_t RingBuf<T>::size() {
-  return RB_end - RB_begin;
+template <typename T, typename P>
+size_t RingBuf<T, P>::size() {
+  return RB_count;
 }
 
 // data: get start of used data area
-template <typename T>
-const T *RingBuf<T>::data() {
-  return RB_begin;
+template <typename T, typename P>
+const T *RingBuf<T, P>::data() {
+  return RB_buffer + RB_head;
+}
+
+// spans: get the used area as (up to) two contiguous segments
+template <typename T, typename P>
+size_t RingBuf<T, P>::spans(const T *&first, size_t& firstLen, const T *&second, size_t& secondLen) {
+  LOCK_GUARD(cLock, m);
+  first = RB_buffer + RB_head;
+  second = RB_buffer;
+  firstLen = RB_len - RB_head;
+  // Does the used area wrap around?
+  if (firstLen >= RB_count) {
+    // No, all is in the first segment
+    firstLen = RB_count;
+    secondLen = 0;
+  } else {
+    // Yes. The remainder is at the start of the storage
+    secondLen = RB_count - firstLen;
+  }
+  return RB_count;
 }
 
 // empty: is any data in buffer?
-template <typename T>
-bool RingBuf<T>::empty() {
+template <typename T, typename P>
+bool RingBuf<T, P>::empty() {
   return ((size() == 0) || !valid());
 }
 
 // capacity: return remaining usable size
-template <typename T>
-size_t RingBuf<T>::capacity() {
+template <typename T, typename P>
+size_t RingBuf<T, P>::capacity() {
   if (!valid()) return 0;
   return RB_usable - size();
 }
 
 // clear: forget about contents
-template <typename T>
-bool RingBuf<T>::clear() {
+template <typename T, typename P>
+bool RingBuf<T, P>::clear() {
   if (!valid()) return false;
   LOCK_GUARD(cLock, m);
-  RB_begin = RB_end = RB_buffer;
+  RB_head = RB_count = 0;
   return true;
 }
 
 // pop: remove elements from the beginning of the buffer
-template <typename T>
-size_t RingBuf<T>::pop(size_t numElements) {
+template <typename T, typename P>
+size_t RingBuf<T, P>::pop(size_t numElements) {
   if (!valid()) return 0;
-  // Do we have data in the buffer?
-  if (size()) {
-    // Yes. Is the requested number of elements larger than the used buffer?
-    if (numElements >= size()) {
-      // Yes. clear the buffer
-      size_t n = size();
-      clear();
-      return n;
-    } else {
-      LOCK_GUARD(cLock, m);
-      // No, the buffer needs to be emptied partly only
-      moveFront(numElements);
-    }
-    return numElements;
+  LOCK_GUARD(cLock, m);
+  // Is the requested number of elements larger than the used buffer?
+  if (numElements > RB_count) numElements = RB_count;
+  dropFront(numElements);
+  return numElements;
+}
+
+// dropFront: advance head over a given number of elements.
+// (used internally only)
+template <typename T, typename P>
+void RingBuf<T, P>::dropFront(size_t numElements) {
+  RB_count -= numElements;
+  // Buffer empty now?
+  if (RB_count == 0) {
+    // Yes. Start over at the storage begin to keep data contiguous as long as possible
+    RB_head = 0;
+  } else {
+    RB_head += numElements;
+    if (RB_head >= RB_len) RB_head -= RB_len;
   }
-  return 0;
 }
 
-// moveFront: shift left buffer contents by a given number of elements.
+// copyIn: append elements behind the used area. Caller has to make sure they fit!
 // (used internally only)
-template <typename T>
-void RingBuf<T>::moveFront(size_t numElements) {
-  RB_begin += numElements;
-  memmove(RB_buffer, RB_begin, (RB_end - RB_begin) * RB_elementSize);
-  RB_begin = RB_buffer;
-  RB_end -= numElements;
+template <typename T, typename P>
+void RingBuf<T, P>::copyIn(const T *data, size_t size) {
+  // Storage index of the first free slot
+  size_t tail = RB_head + RB_count;
+  if (tail >= RB_len) tail -= RB_len;
+  // Number of slots up to the end of the storage
+  size_t part = RB_len - tail;
+  if (part > size) part = size;
+  memcpy(RB_buffer + tail, data, part * RB_elementSize);
+  // Anything left to be wrapped around?
+  if (size > part) {
+    memcpy(RB_buffer, data + part, (size - part) * RB_elementSize);
+  }
+  RB_count += size;
 }
 
 // push_back(single element): add one element to the buffer, potentially discarding previous ones
-template <typename T>
-bool RingBuf<T>::push_back(const T c) {
+template <typename T, typename P>
+bool RingBuf<T, P>::push_back(const T c) {
   if (!valid()) return false;
   {
     LOCK_GUARD(cLock, m);
     // No more space?
-    if (capacity() == 0) {
+    if (RB_count >= RB_usable) {
       // No, we need to drop something
       // Are we to keep the oldest data?
       if (RB_preserve) {
         // Yes. The new element will be dropped to leave the buffer untouched
         return false;
       }
-      // We need to drop the oldest element begin is pointing to
-      moveFront(1);
+      // We need to drop the oldest element head is pointing to
+      dropFront(1);
     }
     // Now add the element
-    *RB_end = c;
-    RB_end++;
+    *slot(RB_count) = c;
+    RB_count++;
   }
   return true;
 }
 
 // push_back(element buffer): add a batch of elements to the buffer
-template <typename T>
-bool RingBuf<T>::push_back(const T *data, size_t size) {
+template <typename T, typename P>
+bool RingBuf<T, P>::push_back(const T *data, size_t size) {
   if (!valid()) return false;
   // Do not process nullptr or zero lengths
   if (!data || size == 0) return false;
@@ -367,7 +431,7 @@ bool RingBuf<T>::push_back(const T *data, size_t size) {
   {
     LOCK_GUARD(cLock, m);
     // Is the size to be added fitting the capacity?
-    if (size > capacity()) {
+    if (size > RB_usable - RB_count) {
       // No. We need to make room first
       // Are we allowed to do that?
       if (RB_preserve) {
@@ -380,24 +444,23 @@ bool RingBuf<T>::push_back(const T *data, size_t size) {
         size = RB_usable;
       }
       // Make room for the data
-      moveFront(size - capacity());
+      dropFront(size - (RB_usable - RB_count));
     }
     // Now copy it in
-    memcpy(RB_end, data, size * RB_elementSize);
-    RB_end += size;
+    copyIn(data, size);
   }
   return true;
 }
 
 // operator[]: return the element the index is pointing to. If index is
 // outside the currently used area, return 0
-template <typename T>
-const T RingBuf<T>::operator[](size_t index) {
-  if (!valid()) return 0;
-  if (index >= 0 && index < size()) {
-    return *(RB_begin + index);
+template <typename T, typename P>
+const T RingBuf<T, P>::operator[](size_t index) {
+  if (!valid()) return T();
+  if (index < size()) {
+    return *slot(index);
   }
-  return 0;
+  return T();
 }
 
 // safeCopy: get a stable data copy from currently used buffer
@@ -405,25 +468,243 @@ const T RingBuf<T>::operator[](size_t index) {
 // len: number of elements requested
 // move: if true, copied elements will be pop()-ped
 // returns number of elements actually transferred
-template <typename T>
-size_t RingBuf<T>::safeCopy(T *target, size_t tLen, bool move) {
+template <typename T, typename P>
+size_t RingBuf<T, P>::safeCopy(T *target, size_t tLen, bool move) {
   if (!valid()) return 0;
   if (!target) return 0;
   {
     LOCK_GUARD(cLock, m);
-    if (tLen > size()) tLen = size();
-    memcpy(target, RB_begin, tLen * RB_elementSize);
+    if (tLen > RB_count) tLen = RB_count;
+    // Copy the first segment
+    size_t part = RB_len - RB_head;
+    if (part > tLen) part = tLen;
+    memcpy(target, RB_buffer + RB_head, part * RB_elementSize);
+    // Then the wrapped around rest, if any
+    if (tLen > part) {
+      memcpy(target + part, RB_buffer, (tLen - part) * RB_elementSize);
+    }
+    if (move) dropFront(tLen);
   }
-  if (move) pop(tLen);
   return tLen;
 }
 
 // Equality: sizes and contents must be identical
-template <typename T>
-bool RingBuf<T>::operator==(RingBuf<T> &r) {
+template <typename T, typename P>
+bool RingBuf<T, P>::operator==(RingBuf<T, P> &r) {
   if (!valid() || !r.valid()) return false;
   if (size() != r.size()) return false;
-  if (memcmp(RB_begin, r.RB_begin, size() * RB_elementSize)) return false;
+  for (size_t i = 0; i < size(); ++i) {
+    if (memcmp(slot(i), r.slot(i), RB_elementSize)) return false;
+  }
   return true;
 }
+
+// RingBuf (RB_SPSC) is the lock-free variant for a single producer and a single consumer.
+// The producer only calls push_back() and capacity(), all other functions belong to the consumer.
+// head and tail indexes are atomics with acquire/release ordering, so no locks or critical
+// sections are needed - push_back() may be called from IRAM_ATTR interrupt functions.
+// As the producer never touches head, a full buffer will always reject new elements
+// ("preserve" behaviour of RB_LOCKED).
+template <typename T>
+class RingBuf<T, RB_SPSC> {
+public:
+  // Constructor
+  // size: required size in T elements
+  explicit RingBuf(size_t size = 256) noexcept;
+
+  // Destructor: takes care of cleaning up the buffer
+  ~RingBuf();
+
+  // No copies - two objects would share the same producer and consumer
+  RingBuf(const RingBuf &r) = delete;
+  RingBuf& operator=(const RingBuf &r) = delete;
+
+  // valid: returns true if a buffer was allocated and is usable
+  bool valid() { return RB_buffer != nullptr; }
+  operator bool() { return valid(); }
+
+  // ---- Producer side ----
+  // push_back: add a single element or a buffer of elements to the end of the buffer.
+  // Returns false if there is not enough room - nothing is added then.
+  bool push_back(const T c);
+  bool push_back(const T *data, size_t size);
+
+  // capacity: return number of unused elements in buffer
+  size_t capacity();
+
+  // ---- Consumer side ----
+  // size: get number of elements currently in buffer
+  size_t size();
+
+  // empty: returns true if no elements are in the buffer
+  bool empty() { return size() == 0; }
+
+  // clear: empty the buffer
+  bool clear();
+
+  // pop: remove the leading numElements elements from the buffer
+  size_t pop(size_t numElements);
+
+  // operator[]: return the element the index is pointing to. If index is
+  // outside the currently used area, return 0
+  const T operator[](size_t index);
+
+  // safeCopy: get a stable data copy from currently used buffer
+  // target: buffer to copy data into
+  // len: number of elements requested
+  // move: if true, copied elements will be pop()-ped
+  // returns number of elements actually transferred
+  size_t safeCopy(T *target, size_t tLen, bool move = false);
+
+  // spans: get the used area as two contiguous segments, see RingBuf<T, RB_LOCKED>::spans()
+  size_t spans(const T *&first, size_t& firstLen, const T *&second, size_t& secondLen);
+
+protected:
+  T *RB_buffer;                  // The data buffer proper (one element more than requested)
+  size_t RB_len;                 // Real length of buffer
+  std::atomic<size_t> RB_head;   // Storage index of the first element used (written by consumer)
+  std::atomic<size_t> RB_tail;   // Storage index of the first free slot (written by producer)
+  // used: number of elements between head and tail
+  inline size_t used(size_t head, size_t tail) { return (tail >= head) ? tail - head : tail + RB_len - head; }
+};
+
+// Constructor: one more slot is needed to tell a full from an empty buffer
+template <typename T>
+RingBuf<T, RB_SPSC>::RingBuf(size_t size) noexcept :
+  RB_buffer(nullptr),
+  RB_len(0),
+  RB_head(0),
+  RB_tail(0) {
+  if (size) {
+    RB_buffer = new T[size + 1];
+    if (RB_buffer) RB_len = size + 1;
+  }
+}
+
+// Destructor: free allocated memory, if any
+template <typename T>
+RingBuf<T, RB_SPSC>::~RingBuf() {
+  if (RB_buffer) delete[] RB_buffer;
+}
+
+// push_back(single element): add one element if there is room
+template <typename T>
+bool IRAM_ATTR RingBuf<T, RB_SPSC>::push_back(const T c) {
+  if (!RB_buffer) return false;
+  size_t tail = RB_tail.load(std::memory_order_relaxed);
+  size_t next = tail + 1;
+  if (next == RB_len) next = 0;
+  // Full?
+  if (next == RB_head.load(std::memory_order_acquire)) return false;
+  RB_buffer[tail] = c;
+  // Publish the element to the consumer
+  RB_tail.store(next, std::memory_order_release);
+  return true;
+}
+
+// push_back(element buffer): add a batch of elements if all will fit
+template <typename T>
+bool RingBuf<T, RB_SPSC>::push_back(const T *data, size_t size) {
+  if (!RB_buffer || !data || size == 0) return false;
+  size_t tail = RB_tail.load(std::memory_order_relaxed);
+  size_t head = RB_head.load(std::memory_order_acquire);
+  if (size > RB_len - 1 - used(head, tail)) return false;
+  // Copy up to the end of the storage, then wrap around
+  size_t part = RB_len - tail;
+  if (part > size) part = size;
+  memcpy(RB_buffer + tail, data, part * sizeof(T));
+  if (size > part) {
+    memcpy(RB_buffer, data + part, (size - part) * sizeof(T));
+  }
+  tail += size;
+  if (tail >= RB_len) tail -= RB_len;
+  RB_tail.store(tail, std::memory_order_release);
+  return true;
+}
+
+// capacity: return remaining usable size
+template <typename T>
+size_t RingBuf<T, RB_SPSC>::capacity() {
+  if (!RB_buffer) return 0;
+  return RB_len - 1 - used(RB_head.load(std::memory_order_acquire), RB_tail.load(std::memory_order_relaxed));
+}
+
+// size: number of elements used in the buffer
+template <typename T>
+size_t RingBuf<T, RB_SPSC>::size() {
+  if (!RB_buffer) return 0;
+  return used(RB_head.load(std::memory_order_relaxed), RB_tail.load(std::memory_order_acquire));
+}
+
+// clear: drop everything the producer has published so far
+template <typename T>
+bool RingBuf<T, RB_SPSC>::clear() {
+  if (!RB_buffer) return false;
+  RB_head.store(RB_tail.load(std::memory_order_acquire), std::memory_order_release);
+  return true;
+}
+
+// pop: remove elements from the beginning of the buffer
+template <typename T>
+size_t RingBuf<T, RB_SPSC>::pop(size_t numElements) {
+  if (!RB_buffer) return 0;
+  size_t head = RB_head.load(std::memory_order_relaxed);
+  size_t n = used(head, RB_tail.load(std::memory_order_acquire));
+  if (numElements > n) numElements = n;
+  head += numElements;
+  if (head >= RB_len) head -= RB_len;
+  // Hand the slots back to the producer
+  RB_head.store(head, std::memory_order_release);
+  return numElements;
+}
+
+// operator[]: return the element the index is pointing to.
+template <typename T>
+const T RingBuf<T, RB_SPSC>::operator[](size_t index) {
+  size_t head = RB_head.load(std::memory_order_relaxed);
+  if (index < size()) {
+    index += head;
+    if (index >= RB_len) index -= RB_len;
+    return RB_buffer[index];
+  }
+  return T();
+}
+
+// safeCopy: get a stable data copy from currently used buffer
+template <typename T>
+size_t RingBuf<T, RB_SPSC>::safeCopy(T *target, size_t tLen, bool move) {
+  const T *first;
+  const T *second;
+  size_t firstLen;
+  size_t secondLen;
+  if (!target) return 0;
+  size_t n = spans(first, firstLen, second, secondLen);
+  if (tLen > n) tLen = n;
+  if (firstLen > tLen) firstLen = tLen;
+  memcpy(target, first, firstLen * sizeof(T));
+  if (tLen > firstLen) {
+    memcpy(target + firstLen, second, (tLen - firstLen) * sizeof(T));
+  }
+  if (move) pop(tLen);
+  return tLen;
+}
+
+// spans: get the used area as (up to) two contiguous segments
+template <typename T>
+size_t RingBuf<T, RB_SPSC>::spans(const T *&first, size_t& firstLen, const T *&second, size_t& secondLen) {
+  size_t head = RB_head.load(std::memory_order_relaxed);
+  size_t tail = RB_tail.load(std::memory_order_acquire);
+  first = RB_buffer + head;
+  second = RB_buffer;
+  if (!RB_buffer) {
+    firstLen = secondLen = 0;
+  } else if (tail >= head) {
+    firstLen = tail - head;
+    secondLen = 0;
+  } else {
+    firstLen = RB_len - head;
+    secondLen = tail;
+  }
+  return firstLen + secondLen;
+}
 #endif
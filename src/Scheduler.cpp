@@ -0,0 +1,84 @@
+// Modbus bridge device V3
+// Copyright 2020 by miq1@gmx.de
+
+#include "Scheduler.h"
+
+// Constructor: empty task table
+Scheduler::Scheduler() :
+  S_count(0) { }
+
+// add: register a task
+int8_t Scheduler::add(const char *name, SchedTask task, uint32_t period, uint32_t delay) {
+  // Room left?
+  if (S_count >= SCHED_MAXTASKS || !task) return -1;
+
+  TaskInfo& t = S_tasks[S_count];
+  t.name = name;
+  t.task = task;
+  t.period = period;
+  t.due = millis() + delay;
+  t.active = true;
+  t.runs = 0;
+  t.lastTime = 0;
+  t.maxTime = 0;
+  t.totalTime = 0;
+  return S_count++;
+}
+
+// runAt: have a task run at time when
+void Scheduler::runAt(int8_t id, uint32_t when) {
+  if (id < 0 || id >= S_count) return;
+  S_tasks[id].due = when;
+  S_tasks[id].active = true;
+}
+
+// setPeriod: change the period of a task
+void Scheduler::setPeriod(int8_t id, uint32_t period) {
+  if (id < 0 || id >= S_count) return;
+  S_tasks[id].period = period;
+}
+
+// stop: cancel the pending run of a task
+void Scheduler::stop(int8_t id) {
+  if (id < 0 || id >= S_count) return;
+  S_tasks[id].active = false;
+}
+
+// run: call all tasks due
+uint32_t Scheduler::run() {
+  uint32_t now = millis();
+
+  for (uint8_t i = 0; i < S_count; ++i) {
+    TaskInfo& t = S_tasks[i];
+    // Is the task due?
+    if (t.active && (int32_t)(now - t.due) >= 0) {
+      // Yes. Set the next deadline first - the task may change it with runAt()
+      if (t.period) {
+        t.due += t.period;
+        // Were we late for more than a period? Do not try to catch up, start over from now
+        if ((int32_t)(now - t.due) >= 0) t.due = now + t.period;
+      } else {
+        t.active = false;
+      }
+      // Call the task and measure its run time
+      uint32_t t0 = micros();
+      t.task(now);
+      t.lastTime = micros() - t0;
+      if (t.lastTime > t.maxTime) t.maxTime = t.lastTime;
+      t.totalTime += t.lastTime;
+      t.runs++;
+      now = millis();
+    }
+  }
+
+  // Find the next deadline
+  uint32_t wait = SCHED_IDLE;
+  for (uint8_t i = 0; i < S_count; ++i) {
+    if (S_tasks[i].active) {
+      int32_t d = (int32_t)(S_tasks[i].due - now);
+      if (d <= 0) return 0;
+      if ((uint32_t)d < wait) wait = d;
+    }
+  }
+  return wait;
+}
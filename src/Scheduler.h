@@ -0,0 +1,68 @@
+// Scheduler
+// Copyright 2020 by miq1@gmx.de
+//
+// Scheduler runs the tasks of the main loop only when they are due.
+// Tasks are held in a static table. A task either has a period, or it is run only at
+// deadlines, that it sets itself (or another task does) with runAt().
+// run() calls all tasks due and returns the time until the next deadline, so the
+// caller may sleep until then instead of spinning.
+// The execution time of each task is recorded.
+// NOTE: all times are millis() based, as are the tasks' arguments.
+//
+#ifndef _SCHEDULER_H
+#define _SCHEDULER_H
+#include <Arduino.h>
+
+// Maximum number of tasks
+#define SCHED_MAXTASKS 16
+// Time returned by run() if no task has a deadline
+#define SCHED_IDLE 100
+
+// Task function. now is the millis() time the task was called at
+typedef void (*SchedTask)(uint32_t now);
+
+// Task table entry
+struct TaskInfo {
+  const char *name;          // Task name for statistics
+  SchedTask task;            // Function to be called
+  uint32_t period;           // Time between runs. 0: run only at deadlines set by runAt()
+  uint32_t due;              // Time of the next run
+  bool active;               // true if a run is pending
+  uint32_t runs;             // Number of runs so far
+  uint32_t lastTime;         // Execution time of the latest run in us
+  uint32_t maxTime;          // Longest execution time in us
+  uint64_t totalTime;        // Sum of all execution times in us
+};
+
+class Scheduler {
+public:
+  // Constructor: empty task table
+  Scheduler();
+
+  // add: register a task. First run will be delay ms from now.
+  // Returns the task number or -1, if the table is full
+  int8_t add(const char *name, SchedTask task, uint32_t period, uint32_t delay = 0);
+
+  // runAt: have a task run at time when. For periodic tasks the period will count from there
+  void runAt(int8_t id, uint32_t when);
+
+  // setPeriod: change the period of a task. 0 will stop periodic runs
+  void setPeriod(int8_t id, uint32_t period);
+
+  // stop: cancel the pending run of a task. It will run again only after runAt()
+  void stop(int8_t id);
+
+  // run: call all tasks due. Returns the time in ms until the next task is due
+  uint32_t run();
+
+  // getTaskCount: get number of tasks registered
+  inline uint8_t getTaskCount() { return S_count; }
+
+  // getTask: get a task's table entry for statistics. nullptr if id is invalid
+  inline const TaskInfo *getTask(uint8_t id) { return (id < S_count) ? &S_tasks[id] : nullptr; }
+
+protected:
+  TaskInfo S_tasks[SCHED_MAXTASKS];  // Task table
+  uint8_t S_count;                   // Number of tasks used
+};
+#endif
@@ -0,0 +1,27 @@
+// Modbus bridge device V3
+// Copyright 2020 by miq1@gmx.de
+
+#include "Stats.h"
+
+// add: count in a time in us
+void LatencyStat::add(uint32_t us) {
+  count++;
+  if (us > maxUs) maxUs = us;
+
+  // Find the bucket: number of significant bits less one
+  uint8_t b = 0;
+  while (b < STAT_BUCKETS - 1 && (us >> (b + 1))) b++;
+  if (bucket[b] < 0xFFFF) bucket[b]++;
+}
+
+// addCycles: count in a time given in CPU cycles
+void LatencyStat::addCycles(uint32_t cycles) {
+  add(cycles / ESP.getCpuFreqMHz());
+}
+
+// clear: start over
+void LatencyStat::clear() {
+  count = 0;
+  maxUs = 0;
+  memset(bucket, 0, sizeof(bucket));
+}
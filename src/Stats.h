@@ -0,0 +1,43 @@
+// Stats
+// Copyright 2020 by miq1@gmx.de
+//
+// Stats collects execution times measured with the CPU cycle counter.
+// Each LatencyStat holds the number of samples, the longest time seen and a histogram
+// with logarithmic buckets: bucket 0 counts times below 2us, bucket k times from 2^k to 2^(k+1)-1 us,
+// the last bucket all longer times. Bucket counts will stop at 65535.
+// StatScope will measure the time until it goes out of scope.
+//
+#ifndef _STATS_H
+#define _STATS_H
+#include <Arduino.h>
+
+// Number of histogram buckets
+#define STAT_BUCKETS 16
+
+struct LatencyStat {
+  uint32_t count;                    // Number of samples
+  uint32_t maxUs;                    // Longest time seen in us
+  uint16_t bucket[STAT_BUCKETS];     // Histogram
+
+  LatencyStat() { clear(); }
+
+  // add: count in a time in us
+  void add(uint32_t us);
+
+  // addCycles: count in a time given in CPU cycles
+  void addCycles(uint32_t cycles);
+
+  // clear: start over
+  void clear();
+};
+
+// StatScope: measure the time from construction to destruction into a LatencyStat
+class StatScope {
+public:
+  explicit StatScope(LatencyStat& s) : SS_stat(s), SS_start(ESP.getCycleCount()) {}
+  ~StatScope() { SS_stat.addCycles(ESP.getCycleCount() - SS_start); }
+protected:
+  LatencyStat& SS_stat;
+  uint32_t SS_start;
+};
+#endif
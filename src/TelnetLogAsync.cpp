@@ -4,21 +4,29 @@
 // =================================================================================================
 #include "TelnetLogAsync.h"
 
-TelnetLog::TelnetLog(uint16_t p, uint8_t mc, size_t rbSize) {
-  TL_maxClients = mc;
+TelnetLog::TelnetLog(uint16_t p, uint8_t mc, size_t rbSize, bool zeroCopy, size_t recWords) {
+  TL_maxClients = (mc < TL_MAXCLIENTS) ? mc : TL_MAXCLIENTS;
+  TL_active = 0;
+  TL_droppedTotal = 0;
+  TL_zeroCopy = zeroCopy;
   TL_Server = new AsyncServer(p);
   myRBsize = rbSize;
-  TL_Client.clear();
+  TL_log = new uint8_t[rbSize];
+  TL_head = 0;
+  TL_headIdx = 0;
+  TL_records = recWords ? new RingBuf<uintptr_t, RB_SPSC>(recWords) : nullptr;
+  TL_recLost = 0;
+  TL_recNoted = 0;
   TL_Server->onClient(&handleNewClient, (void *)this);
 }
 
 TelnetLog::~TelnetLog() {
   delete TL_Server;
-  for (auto it : TL_Client) {
-    delete it;
+  for (auto& cl : TL_slots) {
+    cl.release();
   }
-  TL_Client.clear();
-  std::vector<ClientList *>().swap(TL_Client);
+  delete[] TL_log;
+  if (TL_records) delete TL_records;
 }
 
 void TelnetLog::begin(const char * label) {
@@ -28,42 +36,222 @@ void TelnetLog::begin(const char * label) {
 }
 
 void TelnetLog::end() {
+  TL_LOCK(this);
   TL_Server->end();
-  for (auto it : TL_Client) {
-    delete it;
+  for (auto& cl : TL_slots) {
+    cl.release();
   }
-  TL_Client.clear();
+  TL_active = 0;
+}
+
+// findClient: get the slot of a client, nullptr if unknown
+TelnetLog::ClientList *TelnetLog::findClient(AsyncClient *c) {
+  for (auto& cl : TL_slots) {
+    if (cl.client && cl.client == c) return &cl;
+  }
+  return nullptr;
 }
 
 size_t TelnetLog::write(uint8_t c) {
-  // Loop over clients
-  for (auto cl : TL_Client) {
-    if (cl->client->connected()) { // } && client->canSend()) {
-      cl->buffer->push_back(c);
+  return write(&c, 1);
+}
+
+// write: put data into the shared log buffer once for all clients.
+// Writing never waits for a client. Unread data of lagging clients is overwritten, they will
+// skip it and get a loss notice in sendBytes().
+size_t TelnetLog::write(const uint8_t *buffer, size_t len) {
+  // Nobody listening?
+  if (!TL_active) return len;
+
+  TL_LOCK(this);
+  // Keep the order - deferred records written before go first
+  drainRecords();
+  return writeLog(buffer, len);
+}
+
+// writeLog: append data to the shared log buffer
+size_t TelnetLog::writeLog(const uint8_t *buffer, size_t len) {
+  size_t total = len;
+  // More than the buffer can hold? Only the tail will survive, skip the rest right away
+  if (len > myRBsize) {
+    size_t skip = len - myRBsize;
+    buffer += skip;
+    len = myRBsize;
+    TL_head += skip;
+    TL_headIdx = (TL_headIdx + skip) % myRBsize;
+  }
+
+  // Will zero-copy data still in flight to a lagging client be overwritten?
+  uint32_t newHead = TL_head + len;
+  for (auto& cl : TL_slots) {
+    if (cl.client && (int32_t)(cl.zcEnd - cl.ackPos) > 0 && newHead - cl.ackPos > myRBsize) {
+      // Yes. lwIP may send these bytes again, so they must not change. Abort the connection,
+      // lwIP will drop the references with it. The slot is freed by handleDisconnect().
+      TL_droppedTotal += TL_head - cl.ackPos;
+      cl.zcEnd = cl.ackPos;
+      AsyncClient *c = cl.client;
+      cl.aborting = true;
+      c->abort();
+      // Was the disconnect reported right away (ESPAsyncTCP)? Then the client is ours to delete,
+      // else handleDisconnect() will do it later in the AsyncTCP task
+      if (!cl.client) {
+        delete c;
+      }
+      cl.aborting = false;
     }
   }
-  return 1;
+
+  // Copy in, wrapping around the buffer end if necessary
+  size_t numWrite = len;
+  while (numWrite) {
+    size_t chunk = myRBsize - TL_headIdx;
+    if (chunk > numWrite) chunk = numWrite;
+    memcpy(TL_log + TL_headIdx, buffer, chunk);
+    buffer += chunk;
+    numWrite -= chunk;
+    TL_headIdx = (TL_headIdx + chunk) % myRBsize;
+  }
+  TL_head += len;
+  return total;
 }
 
-size_t TelnetLog::write(const uint8_t *buffer, size_t len) {
-  // Loop over clients
-  for (auto cl : TL_Client) {
-    if (cl->client->connected()) { // } && client->canSend()) {
-      cl->buffer->push_back(buffer, len);
+// logRecord: queue a deferred record, or format it right away without a record buffer.
+// The producer never consumes: a record not fitting is counted and dropped.
+void TelnetLog::logRecord(const uintptr_t *rec, size_t words) {
+  if (TL_records) {
+    if (!TL_records->push_back(rec, words)) TL_recLost++;
+    return;
+  }
+  TL_LOCK(this);
+  render(rec);
+}
+
+// drainRecords: format all deferred records into the log buffer. Must be called under TL_LOCK,
+// so write() and sendBytes() will never consume at the same time.
+void TelnetLog::drainRecords() {
+  if (!TL_records) return;
+  uintptr_t rec[DL_MAXARGS + 2];
+  // Records dropped since the last notice? Tell before the ones behind
+  uint32_t lost = TL_recLost;
+  if (lost != TL_recNoted) {
+    char buffer[48];
+    snprintf(buffer, 48, "\n--- %u log records lost ---\n", (unsigned int)(lost - TL_recNoted));
+    writeLog((const uint8_t *)buffer, strlen(buffer));
+    TL_recNoted = lost;
+  }
+  while (TL_records->size() >= 2) {
+    size_t words = ((*TL_records)[1] & 0x1F) + 2;
+    if (TL_records->safeCopy(rec, words, true) != words) break;
+    render(rec);
+  }
+}
+
+// render: format a deferred record into the log buffer.
+// Each conversion is done separately by snprintf() with the argument reconstructed from its type tag.
+void TelnetLog::render(const uintptr_t *rec) {
+  const char *fmt = (const char *)rec[0];
+  uint8_t argc = rec[1] & 0x1F;
+  uint8_t argn = 0;
+  char out[128];
+  size_t outLen = 0;
+  char spec[16];
+  char c;
+
+  while ((c = pgm_read_byte(fmt++))) {
+    // Make sure there is room for a literal character or a converted argument
+    if (outLen > sizeof(out) - 2) {
+      writeLog((const uint8_t *)out, outLen);
+      outLen = 0;
+    }
+    if (c != '%') {
+      out[outLen++] = c;
+      continue;
+    }
+    // Collect the conversion spec, less any length modifier
+    size_t specLen = 0;
+    spec[specLen++] = '%';
+    while ((c = pgm_read_byte(fmt))) {
+      fmt++;
+      if (strchr("hlLqjzt", c)) continue;
+      if (strchr("diouxXcsfFeEgGaAp%", c)) {
+        spec[specLen++] = c;
+        break;
+      }
+      if (specLen < sizeof(spec) - 3) spec[specLen++] = c;
+    }
+    if (!c) break;
+    if (c == '%') {
+      out[outLen++] = '%';
+      continue;
     }
+    // Argument missing?
+    if (argn >= argc) break;
+    uint8_t tag = (rec[1] >> (5 + 2 * argn)) & 0x03;
+    uintptr_t v = rec[2 + argn++];
+    // Flush before converting, so a conversion can use the complete buffer
+    writeLog((const uint8_t *)out, outLen);
+    outLen = 0;
+    int len = 0;
+    switch (tag) {
+    case DL_INT:
+    case DL_UINT:
+      if (c == 's' || c == 'p') break;
+      if (c == 'c') {
+        spec[specLen] = 0;
+        len = snprintf(out, sizeof(out), spec, (int)v);
+        break;
+      }
+      // Integers are passed as long, the conversion char gets an 'l' prefix
+      spec[specLen] = spec[specLen - 1];
+      spec[specLen - 1] = 'l';
+      spec[specLen + 1] = 0;
+      if (tag == DL_INT) {
+        len = snprintf(out, sizeof(out), spec, (long)(intptr_t)v);
+      } else {
+        len = snprintf(out, sizeof(out), spec, (unsigned long)v);
+      }
+      break;
+    case DL_FLOAT:
+      {
+        float f;
+        uint32_t w = v;
+        memcpy(&f, &w, sizeof(f));
+        spec[specLen] = 0;
+        len = snprintf(out, sizeof(out), spec, (double)f);
+      }
+      break;
+    case DL_STRING:
+      spec[specLen] = 0;
+      len = snprintf(out, sizeof(out), spec, (const char *)v);
+      break;
+    }
+    if (len > 0) outLen = ((size_t)len < sizeof(out)) ? len : sizeof(out) - 1;
   }
-  return len;
+  if (outLen) writeLog((const uint8_t *)out, outLen);
 }
 
 void TelnetLog::handleNewClient(void *srv, AsyncClient* newClient) {
   char buffer[80];
   TelnetLog *s = reinterpret_cast<TelnetLog *>(srv);
+  TL_LOCK(s);
+
+  // Find a free slot
+  ClientList *c = nullptr;
+  if (s->TL_active < s->TL_maxClients) {
+    for (auto& cl : s->TL_slots) {
+      if (!cl.client) {
+        c = &cl;
+        break;
+      }
+    }
+  }
 
   // Space left?
-  if (s->TL_Client.size() < s->TL_maxClients) {
-    // add to list
-    ClientList *c = new ClientList(s->myRBsize, newClient);
-    s->TL_Client.push_back(c);
+  if (c) {
+    // Take the slot
+    // New clients will get log data from now on
+    c->take(newClient, s->TL_head);
+    s->TL_active++;
 	
     // register events
     newClient->onData(&handleData, srv);
@@ -71,22 +259,23 @@ void TelnetLog::handleNewClient(void *srv, AsyncClient* newClient) {
     newClient->onAck(&handleAck, srv);
     newClient->onDisconnect(&handleDisconnect, srv);
 
+    // The welcome lines are copied - their acks must not be taken for log data
     snprintf(buffer, 80, "Welcome to '%s'!\n", s->myLabel);
-    newClient->add(buffer, strlen(buffer));
+    c->skipAck += newClient->add(buffer, strlen(buffer));
         
     snprintf(buffer, 80, "Millis since start: %ul\n", (uint32_t)millis());
-    newClient->add(buffer, strlen(buffer));
+    c->skipAck += newClient->add(buffer, strlen(buffer));
         
     snprintf(buffer, 80, "Free heap RAM: %d\n", ESP.getFreeHeap());
-    newClient->add(buffer, strlen(buffer));
+    c->skipAck += newClient->add(buffer, strlen(buffer));
 
     snprintf(buffer, 80, "Server IP: %d.%d.%d.%d\n", WiFi.localIP()[0], WiFi.localIP()[1], WiFi.localIP()[2], WiFi.localIP()[3]);
-    newClient->add(buffer, strlen(buffer));
+    c->skipAck += newClient->add(buffer, strlen(buffer));
 
     memset(buffer, '-', 80);
     buffer[78] = '\n';
     buffer[79] = 0;
-    newClient->add(buffer, strlen(buffer));
+    c->skipAck += newClient->add(buffer, strlen(buffer));
 
     newClient->send();
   } else {
@@ -99,14 +288,16 @@ void TelnetLog::handleNewClient(void *srv, AsyncClient* newClient) {
 
 void TelnetLog::handleDisconnect(void *srv, AsyncClient *c) {
   TelnetLog *s = reinterpret_cast<TelnetLog *>(srv);
-  for (auto it = s->TL_Client.begin(); it != s->TL_Client.end();) {
-    if ((*it)->client == c) {
-      delete (*it);
-      s->TL_Client.erase(it);
-      it = s->TL_Client.end();
+  TL_LOCK(s);
+  ClientList *cl = s->findClient(c);
+  if (cl) {
+    // Called from within abort() in writeLog()? Then only free the slot, the client is still in use
+    if (cl->aborting) {
+      cl->client = nullptr;
     } else {
-      it++;
+      cl->release();
     }
+    s->TL_active--;
   }
 }
 
@@ -114,29 +305,76 @@ void TelnetLog::handleData(void *srv, AsyncClient* client, void *data, size_t le
   // Do nothing for now, ignore data
 }
 
+// sendBytes: hand log data to the client.
+// In zero-copy mode lwIP gets references into the log buffer. These bytes are "in flight" until
+// handleAck() reports them as acknowledged. At most a quarter of the buffer is handed over by
+// reference, and a client lagging more than that is switched to copies, so the writer will rarely
+// run into the data - writeLog() aborts a client if it does. It gets references again once it has caught up.
 void TelnetLog::sendBytes(TelnetLog *s, AsyncClient *client) {
+  TL_LOCK(s);
   if (client->connected()) {
-    size_t numBytes = client->space();
-    if (numBytes) {
-      for (auto it : s->TL_Client) {
-        if (it->client == client) {
-          size_t numSend = it->buffer->size();
-          if (numSend && client->canSend()) {
-            if (numSend <= numBytes) {
-              client->write((const char *)it->buffer->data(), numSend, ASYNC_WRITE_FLAG_COPY);
-              it->buffer->pop(numSend);
-            } else {
-              client->write((const char *)it->buffer->data(), numBytes, ASYNC_WRITE_FLAG_COPY);
-              it->buffer->pop(numBytes);
-            }
-            break;
-          }
-          break;
+    StatScope timing(s->TL_sendStat);
+    // Format the deferred records now
+    s->drainRecords();
+    ClientList *it = s->findClient(client);
+    if (it) {
+      // Has the client fallen behind so that part of its data was overwritten?
+      if (s->TL_head - it->readPos > s->myRBsize) {
+        // Yes. Skip the lost bytes and the rest of the line cut, to go on with a complete line
+        uint32_t pos = s->TL_head - s->myRBsize;
+        while (pos != s->TL_head && s->TL_log[s->logIndex(pos++)] != '\n') {}
+        it->dropped += pos - it->readPos;
+        s->TL_droppedTotal += pos - it->readPos;
+        // Only copies can be in flight here, writeLog() took care of the references.
+        // Their acks are skipped.
+        it->skipAck += it->readPos - it->ackPos;
+        it->readPos = pos;
+        it->ackPos = pos;
+        it->zcEnd = pos;
+      }
+      // Zero-copy mode: is the client lagging or has it caught up again?
+      if (s->TL_zeroCopy) {
+        if (s->TL_head - it->ackPos > s->myRBsize / 4) it->copyMode = true;
+        else if (it->readPos == s->TL_head) it->copyMode = false;
+      }
+      // Tell the client about lost data, once everything sent before is acknowledged
+      if (it->dropped && it->ackPos == it->readPos && client->canSend()) {
+        char buffer[64];
+        snprintf(buffer, 64, "\n--- %u bytes lost ---\n", (unsigned int)it->dropped);
+        size_t len = strlen(buffer);
+        if (client->space() >= len) {
+          it->skipAck += client->add(buffer, len);
+          it->dropped = 0;
+        }
+      }
+      size_t numBytes = client->space();
+      size_t numSend = s->TL_head - it->readPos;
+      // Not all fitting in?
+      if (numSend > numBytes) {
+        // Yes. Send complete lines only. Part of a line is sent only if nothing is in flight,
+        // so the space will not get any larger
+        numSend = numBytes;
+        while (numSend && s->TL_log[s->logIndex(it->readPos + numSend - 1)] != '\n') numSend--;
+        if (!numSend && it->ackPos == it->readPos && !it->skipAck) numSend = numBytes;
+      }
+      if (numSend && client->canSend()) {
+        bool byRef = s->TL_zeroCopy && !it->copyMode && it->readPos + numSend - it->ackPos <= s->myRBsize / 4;
+        uint8_t flags = byRef ? 0 : ASYNC_WRITE_FLAG_COPY;
+        // Add the data in up to two contiguous segments and send them in one go
+        size_t idx = s->logIndex(it->readPos);
+        size_t firstLen = s->myRBsize - idx;
+        if (firstLen > numSend) firstLen = numSend;
+        size_t added = client->add((const char *)(s->TL_log + idx), firstLen, flags);
+        if (numSend > firstLen && added == firstLen) {
+          added += client->add((const char *)s->TL_log, numSend - firstLen, flags);
         }
+        it->readPos += added;
+        // References given? Then these have to be watched by writeLog()
+        if (!flags) it->zcEnd = it->readPos;
       }
+      client->send();
     }
   }
-
 }
 
 void TelnetLog::handlePoll(void *srv, AsyncClient *client) {
@@ -146,6 +384,17 @@ void TelnetLog::handlePoll(void *srv, AsyncClient *client) {
 
 void TelnetLog::handleAck(void *srv, AsyncClient *client, size_t len, uint32_t aTime) {
   TelnetLog *s = reinterpret_cast<TelnetLog *>(srv);
+  TL_LOCK(s);
+  ClientList *it = s->findClient(client);
+  if (it) {
+    // Acks for copied data (welcome lines, loss notices) come first
+    size_t skip = (len < it->skipAck) ? len : it->skipAck;
+    it->skipAck -= skip;
+    len -= skip;
+    // The acknowledged log bytes can be released now
+    size_t inFlight = it->readPos - it->ackPos;
+    if (len > inFlight) len = inFlight;
+    it->ackPos += len;
+  }
   sendBytes(s, client);
 }
-
@@ -7,8 +7,8 @@
 #define _TELNETLOGASYNC_H
 // Include Arduino.h to make Print and Serial known
 #include <Arduino.h>
-#include <vector>
 #include "RingBuf.h"
+#include "Stats.h"
 
 #ifdef ESP8266
 #include <ESP8266WiFi.h>
@@ -20,43 +20,138 @@
 #error "TelnetLogAsync requires an ESP8266 or ESP32 to run."
 #endif
 
+// On ESP32 the AsyncTCP callbacks run in a task of their own, concurrent to the writers.
+// TL_LOCK(s) serializes all access to the log and the client slots for the rest of the scope.
+#if USE_MUTEX
+#define TL_LOCK(s) std::lock_guard<std::recursive_mutex> tlGuard((s)->TL_mutex)
+#else
+#define TL_LOCK(s)
+#endif
 
-using std::vector;
 
 class TelnetLog : public Print {
 public:
-  TelnetLog(uint16_t port, uint8_t maxClients, size_t rbSize = 256);
+  // Constructor: TCP port, number of clients served (TL_MAXCLIENTS at most), size of the log buffer shared by all clients
+  // zeroCopy: if true, lwIP will send directly out of the log buffer instead of copying the data
+  // recWords: size of the buffer for deferred logf() records. 0 will have logf() format immediately
+  TelnetLog(uint16_t port, uint8_t maxClients, size_t rbSize = 256, bool zeroCopy = false, size_t recWords = 0);
   ~TelnetLog();
   void begin(const char *label);
   void end();
-  inline bool isActive() { return (TL_Client.size() ? true : false); };
+  inline bool isActive() { return (TL_active ? true : false); };
   size_t write(uint8_t c);
   size_t write(const uint8_t *buffer, size_t size);
-  inline unsigned int getActiveClients() { return TL_Client.size(); }
+  inline unsigned int getActiveClients() { return TL_active; }
+  // getDropped: total of bytes lost by all clients so far
+  inline uint32_t getDropped() { return TL_droppedTotal; }
+  // getSendStat: execution times of the send path
+  inline const LatencyStat& getSendStat() { return TL_sendStat; }
+
+  // logf: deferred printf. Only the format pointer and the raw argument values are recorded,
+  // the text is formatted when it is sent to the clients. Nothing is done without clients.
+  // logf() is the one producer of the record buffer, so calls must not overlap. The firmware
+  // calls it under APP_LOCK only. A record not fitting into the buffer is dropped and counted.
+  // fmt may be in flash (PSTR()). fmt and all string arguments must remain valid (literals, static data)!
+  // Arguments allowed are integers, floating point numbers and char pointers - DL_MAXARGS at most.
+  // Floating point values are recorded as float, '*' width or precision is not supported.
+  template <typename... Args>
+  void logf(const char *fmt, Args... args) {
+    static_assert(sizeof...(Args) <= DL_MAXARGS, "logf: too many arguments");
+    if (!TL_active) return;
+    uint8_t tags[] = { DL_tag(args)..., 0 };
+    uintptr_t rec[] = { (uintptr_t)fmt, sizeof...(Args), DL_encode(args)... };
+    for (uint8_t i = 0; i < sizeof...(Args); ++i) {
+      rec[1] |= tags[i] << (5 + 2 * i);
+    }
+    logRecord(rec, sizeof...(Args) + 2);
+  }
 
 protected:
+    // Deferred log records: format pointer, header word (bits 0-4: number of arguments, then 2 bits type
+    // tag per argument), one word per argument
+    static const uint8_t DL_MAXARGS = 13;
+    enum DL_type : uint8_t { DL_INT = 0, DL_UINT, DL_FLOAT, DL_STRING };
+    static inline uint8_t DL_tag(int) { return DL_INT; }
+    static inline uint8_t DL_tag(long) { return DL_INT; }
+    static inline uint8_t DL_tag(unsigned int) { return DL_UINT; }
+    static inline uint8_t DL_tag(unsigned long) { return DL_UINT; }
+    static inline uint8_t DL_tag(double) { return DL_FLOAT; }
+    static inline uint8_t DL_tag(const char *) { return DL_STRING; }
+    static inline uintptr_t DL_encode(int v) { return (uintptr_t)(intptr_t)v; }
+    static inline uintptr_t DL_encode(long v) { return (uintptr_t)(intptr_t)v; }
+    static inline uintptr_t DL_encode(unsigned int v) { return (uintptr_t)v; }
+    static inline uintptr_t DL_encode(unsigned long v) { return (uintptr_t)v; }
+    static inline uintptr_t DL_encode(double v) {
+      float f = v;
+      uint32_t w;
+      memcpy(&w, &f, sizeof(w));
+      return w;
+    }
+    static inline uintptr_t DL_encode(const char *v) { return (uintptr_t)v; }
+    RingBuf<uintptr_t, RB_SPSC> *TL_records;   // Deferred records, logf() is the producer, drainRecords() under TL_LOCK() the consumer
+    std::atomic<uint32_t> TL_recLost;          // Records dropped by logf(), counted by the producer
+    uint32_t TL_recNoted;                      // Records dropped the consumer has told the clients about
+    void logRecord(const uintptr_t *rec, size_t words);
+    void drainRecords();
+    void render(const uintptr_t *rec);
+    size_t writeLog(const uint8_t *buffer, size_t len);
+    // All clients read from one shared log buffer. Positions are byte counts since begin of logging,
+    // that will wrap around at 2^32. A client lagging more than myRBsize bytes behind has lost data.
+    // In zero-copy mode [ackPos, zcEnd) has been handed to lwIP by reference and must not change
+    // before it is acknowledged - lwIP may have to send it again. A client still holding references
+    // the writer has to overwrite is aborted instead, it will not hold up the writer or the other clients.
+    // Clients are held in a fixed pool of slots, a slot without client is free.
+    static const uint8_t TL_MAXCLIENTS = 4;
     struct ClientList {
       AsyncClient *client;
-      RingBuf<uint8_t> *buffer;
-      ClientList(size_t bufSize, AsyncClient *c) {
-        buffer = new RingBuf<uint8_t>(bufSize);
+      uint32_t readPos;                        // Next log position to be sent
+      uint32_t ackPos;                         // Oldest log position sent, but not yet acknowledged
+      uint32_t zcEnd;                          // Log position behind the last byte sent by reference
+      uint32_t dropped;                        // Bytes lost since the last notice to the client
+      size_t skipAck;                          // Bytes that will be acknowledged first, but are no log data (any more)
+      bool copyMode;                           // Lagging client in zero-copy mode, served by copies
+      bool aborting;                           // writeLog() is aborting the client and will delete it
+      ClientList() : client(nullptr), readPos(0), ackPos(0), zcEnd(0), dropped(0), skipAck(0), copyMode(false), aborting(false) {}
+      // take: occupy the slot for a new client
+      void take(AsyncClient *c, uint32_t pos) {
         client = c;
+        readPos = pos;
+        ackPos = pos;
+        zcEnd = pos;
+        dropped = 0;
+        skipAck = 0;
+        copyMode = false;
+        aborting = false;
       }
-      ~ClientList() {
+      // release: close the client and free the slot
+      void release() {
         if (client) {
           client->close(true);
           client->stop();
           delete client;
+          client = nullptr;
         }
-        if (buffer) delete buffer;
       }
     };
     // Telnet definitions
     uint8_t TL_maxClients;                     // max. number of concurrent clients allowed
+    bool TL_zeroCopy;                          // Send directly from the log buffer
     AsyncServer *TL_Server;                    // Hook for the AsyncServerTCP
-    std::vector<ClientList *> TL_Client;       // List of clients connected
+    ClientList TL_slots[TL_MAXCLIENTS];        // Pool of client slots
+    uint8_t TL_active;                         // Number of slots in use
+    uint32_t TL_droppedTotal;                  // Bytes lost by all clients
+    LatencyStat TL_sendStat;                   // Execution times of sendBytes()
+#if USE_MUTEX
+    std::recursive_mutex TL_mutex;             // Guard for the log buffer and the client slots
+#endif
+    ClientList *findClient(AsyncClient *c);
     char myLabel[64];                          // Welcome label to be shown to new clients
-    size_t myRBsize;                           // Size of client'S circular buffer
+    size_t myRBsize;                           // Size of the shared log buffer
+    uint8_t *TL_log;                           // Shared log buffer
+    uint32_t TL_head;                          // Log position of the next byte written
+    size_t TL_headIdx;                         // Index of TL_head in TL_log
+    // logIndex: buffer index for a log position within the last myRBsize bytes
+    inline size_t logIndex(uint32_t pos) { return (TL_headIdx + myRBsize - (TL_head - pos)) % myRBsize; }
     static void handleNewClient(void *srv, AsyncClient *client);
     static void handleDisconnect(void *srv, AsyncClient *client);
     static void handlePoll(void *srv, AsyncClient *client);
@@ -23,6 +23,7 @@
 #define MAXCIO 2
 #define SONOFF_S26 3
 #define NOUS_A1T 4
+#define ESP32_RELAY 5
 // Set the device to be used
 // Default is a Maxcio device with minimum functionality
 #ifndef DEVICETYPE
@@ -53,8 +54,25 @@
 #ifndef TIMERS
 #define TIMERS 0
 #endif
-// Timers will need the Modbus server to work
-#if TIMERS == 1 || EVENT_TRACKING == 1
+// Fast boot: switch on by default configuration and start WiFi while waiting for a CONFIG request: 1=yes, 0=no
+#ifndef FAST_BOOT
+#define FAST_BOOT 0
+#endif
+
+// Send measurement frames to a UDP multicast group every update: 1=yes, 0=no
+#ifndef MULTICAST_PUSH
+#define MULTICAST_PUSH 0
+#endif
+// Multicast group and port
+#ifndef MULTICAST_IP
+#define MULTICAST_IP 239, 255, 47, 11
+#endif
+#ifndef MULTICAST_PORT
+#define MULTICAST_PORT 4711
+#endif
+
+// Timers and multicast frames will need the Modbus server (register image) to work
+#if TIMERS == 1 || EVENT_TRACKING == 1 || MULTICAST_PUSH == 1
 #undef MODBUS_SERVER
 #define MODBUS_SERVER 1
 #endif
@@ -62,10 +80,21 @@
 // Library includes
 #include <Arduino.h>
 #include <ArduinoOTA.h>
+#if defined(ESP32)
+#include <WiFi.h>
+#include <AsyncTCP.h>
+#include <WebServer.h>
+#include <ESPmDNS.h>
+#include <esp_partition.h>
+#include <esp_sntp.h>
+#include <mutex>
+#else
 #include <ESP8266WiFi.h>
 #include <ESPAsyncTCP.h>
 #include <ESP8266WebServer.h>
 #include <ESP8266mDNS.h>
+#include <coredecls.h>
+#endif
 #if FAUXMO_ACTIVE == 1
 #include "fauxmoESP.h"
 #endif
@@ -73,6 +102,12 @@
 #include <time.h>
 #include "Blinker.h"
 #include "Buttoner.h"
+#include "Persister.h"
+#include "Journal.h"
+#include "Scheduler.h"
+#include "Stats.h"
+#include "RegisterMap.h"
+#include "RegisterImage.h"
 #if TELNET_LOG == 1
 #include "TelnetLogAsync.h"
 #include "Logging.h"
@@ -80,8 +115,9 @@
 #if MODBUS_SERVER == 1
 #include "ModbusServerTCPasync.h"
 #endif
-#if EVENT_TRACKING == 1
 #include "RingBuf.h"
+#if MULTICAST_PUSH == 1
+#include <WiFiUdp.h>
 #endif
 
 // GPIO definitions
@@ -129,17 +165,88 @@
 #define HASPOWERMETER 1
 #define HIGH_PULSE 38
 #endif
+#if DEVICETYPE == ESP32_RELAY
+// Generic ESP32 (S3, C3) relay board with BL0937 power meter. Pins may be set by build flags
+#if !defined(ESP32)
+#error "DEVICETYPE ESP32_RELAY needs an ESP32 build"
+#endif
+#ifndef LED
+#define LED 2
+#endif
+#ifndef RELAY
+#define RELAY 4
+#endif
+#ifndef BUTTON
+#define BUTTON 0
+#endif
+#define SIGNAL_LED LED
+#define POWER_LED LED
+// Energy monitor GPIOs
+#ifndef SEL_PIN
+#define SEL_PIN 5
+#endif
+#ifndef CF_PIN
+#define CF_PIN 6
+#endif
+#ifndef CF1_PIN
+#define CF1_PIN 7
+#endif
+// Energy monitor settings
+#define HASPOWERMETER 1
+#define HIGH_PULSE 38
+#endif
 
 // Disable power meter functions if not explicitly set before
 #ifndef HASPOWERMETER
 #define HASPOWERMETER 0
 #endif
 
+// Number of switched channels, 1..MAX_CHANNELS. More than one need RELAY_PINS, the list of all relay GPIOs
+#ifndef NUM_CHANNELS
+#define NUM_CHANNELS 1
+#endif
+#ifndef RELAY_PINS
+#if NUM_CHANNELS > 1
+#error "NUM_CHANNELS > 1 needs RELAY_PINS"
+#endif
+#define RELAY_PINS RELAY
+#endif
+
+// Power meter sampling: 1=measure the time between pulses, 0=count pulses in 1s windows
+#ifndef METER_PERIOD
+#define METER_PERIOD 0
+#endif
+
 // Time between (energy) monitor updates in ms
 #define UPDATE_TIME 5000
 
-// Time between timer checks - must be below 1 minute to not let pass a timer unnoticed!
-#define TIMER_UPDATE_INTERVAL 40000
+// ESP32 only: run the power meter in a task of its own, pinned to METER_CORE.
+// loop() and AsyncTCP (Modbus, telnet) are serving the network on the other core.
+#if defined(ESP32) && HASPOWERMETER == 1
+#define METER_TASK 1
+#else
+#define METER_TASK 0
+#endif
+#if METER_TASK == 1
+#ifndef METER_CORE
+#if CONFIG_FREERTOS_UNICORE
+#define METER_CORE 0
+#else
+#define METER_CORE (1 - ARDUINO_RUNNING_CORE)
+#endif
+#endif
+// Priority and stack size of the meter task
+#define METER_PRIO 3
+#define METER_STACK 3072
+#endif
+
+// Minutes between journal writes of energy and ON time. 0 will disable the journal
+#ifndef JOURNAL_TIME
+#define JOURNAL_TIME 15
+#endif
+
+// Earliest time accepted as set by NTP (2021-01-01), timers will not run before
+#define VALID_TIME 1609459200
 
 // NTP definitions
 #ifndef MY_NTP_SERVER
@@ -185,13 +292,12 @@ constexpr uint16_t O_TIMERS = 16 + 4 * PARMLEN;
 #define DAYMASK    0x7F
 #define ONMASK     0x01
 #endif
-// Number of timers is needed in any case (memory layout)
-#define NUM_TIMERS 16
+// Number of timers (NUM_TIMERS) is needed in any case (memory layout), see RegisterMap.h
 
 // Struct for timers
 struct Timer_t {
   uint8_t activeDays;         // Bit 0..6: days of week, bit 7: active/inactive flag
-  uint8_t onOff;              // Bit 0: 1=timer switches on, 0=switches off
+  uint8_t onOff;              // Bit 0: 1=timer switches on, 0=switches off. Bits 4..5: channel
   uint8_t hour;               // HH24 hour of switching time
   uint8_t minute;             // MM minutes of switching time
   Timer_t() :
@@ -211,64 +317,164 @@ uint16_t aoCount = 0;            // Variable to track the number of matching mea
 #endif
 
 // WiFi reconnect definitions
+#if !defined(ESP32)
 WiFiEventHandler wifiDisconnectHandler;
-bool WiFiNeedsReconnect = false;
+#endif
+volatile bool WiFiNeedsReconnect = false;    // Set by the disconnect handler
+enum WIFI_STATE : uint8_t { WS_IDLE = 0, WS_CONNECTING, WS_CONNECTED, WS_BACKOFF };
+WIFI_STATE wifiState = WS_IDLE;
+uint32_t wifiSince = 0;                      // Time the current state was entered
+uint32_t wifiBackoff = 0;                    // Current wait time between attempts
+// Time allowed for a connection attempt
+#define WIFI_CONNECT_TIME 30000
+// Wait times after a failed attempt
+#define WIFI_BACKOFF_MIN 1000
+#define WIFI_BACKOFF_MAX 120000
 
 // Some forward declarations
 void SetState(uint8_t device_id, const char * device_name, bool state, uint8_t value);
 void SetState_F(uint8_t device_id, const char * device_name, bool state, uint8_t value);
 void wifiSetup(const char *hostname);
+void wifiUpdate(const char *hostname, uint32_t now);
 void handleRoot();
 void handleSave();
 void handleRestart();
 void handleNotFound();
 
 #if HASPOWERMETER == 1
-unsigned long int getFrequency();
+void setScale(uint8_t type);
+uint64_t getEnergy();
+uint64_t energyNow();
+void countEnergy();
+void resetEnergy();
+void meterCommand(uint8_t cmd);
+void meterApply(uint8_t cmd);
+bool checkAutoOff(uint32_t mA);
+#if METER_PERIOD == 1
+void updatePeriods();
+#else
+void startSample();
+bool checkSample();
 void updateEnergy();
+#endif
 unsigned long int highPulse = HIGH_PULSE;
 #endif
 
-// Number of event slots
-const uint8_t MAXEVENT(40);
+// Runtime statistics: execution times of ...
+enum STAT_ID : uint8_t { 
+  ST_LOOP = 0,                // a loop() pass
+  ST_FC03, ST_FC06, ST_FC10, ST_FC43, // the Modbus workers
+  ST_METER,                   // the energy meter update
+  ST_TELNET,                  // the telnet send path (kept by TelnetLog)
+  ST_COUNT
+};
+static_assert(ST_COUNT == REG_STAT_BLOCKS && STAT_BUCKETS == REG_STAT_BUCKETS, "Statistics do not fit the register map");
+LatencyStat stats[ST_COUNT];
+
+// Platform differences
+#if defined(ESP32)
+#define MAX_FREE_BLOCK() ESP.getMaxAllocHeap()
+#define EEPROM_DATA() ((const char *)EEPROM.getDataPtr())
+// Critical sections shared with the meter interrupt functions
+portMUX_TYPE meterMux = portMUX_INITIALIZER_UNLOCKED;
+#define METER_LOCK() portENTER_CRITICAL(&meterMux)
+#define METER_UNLOCK() portEXIT_CRITICAL(&meterMux)
+// The application data is used by loop() and the AsyncTCP task (Modbus workers) concurrently.
+// APP_LOCK() will serialize both for the rest of the scope.
+std::recursive_mutex appMutex;
+#define APP_LOCK() std::lock_guard<std::recursive_mutex> appGuard(appMutex)
+#else
+#define MAX_FREE_BLOCK() ESP.getMaxFreeBlockSize()
+#define EEPROM_DATA() ((const char *)EEPROM.getConstDataPtr())
+#define METER_LOCK() cli()
+#define METER_UNLOCK() sei()
+// Everything is running in the one loop() context
+#define APP_LOCK()
+#endif
+
+// chipId: 24 bit device ID for SSID and multicast frames
+uint32_t chipId() {
+#if defined(ESP32)
+  // Lower 3 bytes of the MAC address - these are the ones differing between chips
+  uint64_t mac = ESP.getEfuseMac();
+  return ((mac >> 40) & 0xFF) | ((mac >> 24) & 0xFF00) | ((mac >> 8) & 0xFF0000);
+#else
+  return ESP.getChipId();
+#endif
+}
+
+// Random number drawn at every start. Event sequence numbers start over with each boot,
+// so clients keeping a sequence number need this to tell a new boot from old events.
+uint32_t bootId = 0;
+
+uint32_t minFreeHeap = 0xFFFFFFFF;   // Least free heap seen
+uint32_t minMaxBlock = 0xFFFFFFFF;   // Least maximum free heap block seen
+uint32_t mbErrors = 0;               // Number of Modbus error responses
+// checkHeap: keep the heap watermarks
+void checkHeap() {
+  uint32_t h = ESP.getFreeHeap();
+  if (h < minFreeHeap) minFreeHeap = h;
+  h = MAX_FREE_BLOCK();
+  if (h < minMaxBlock) minMaxBlock = h;
+}
 
 #if MODBUS_SERVER == 1
-// Highest addressable Modbus register
-// 8 basic data
-// 14 power measure data
-// NUM_TIMERS * 2 timer data
-// MAXEVENT event slots + 1 slot count
-// 2 auto power off control values
-constexpr uint16_t MAXWORD(22 + NUM_TIMERS * 2 + MAXEVENT + 1 + 2);
+// Register addresses and MAXWORD are defined in RegisterMap.h
+
+// Register image for FC03. It is refreshed every update_interval and on every change
+RegisterImage regImage;
+void updateRegisters();
+#define REFRESH_REGS() updateRegisters()
+// Note the time the first request was served
+#define NOTE_REQUEST() if (!bootModbusTime) bootModbusTime = millis()
+// noteResponse: count error responses and keep the heap watermarks
+void noteResponse(const ModbusMessage& response) {
+  if (response.getError() != SUCCESS) mbErrors++;
+  checkHeap();
+}
 
 ModbusMessage FC03(ModbusMessage request);
 ModbusMessage FC06(ModbusMessage request);
 #if HASPOWERMETER == 1
 ModbusMessage FC43(ModbusMessage request);
+ModbusMessage FC44(ModbusMessage request);
+#endif
+#if EVENT_TRACKING == 1
+ModbusMessage FC45(ModbusMessage request);
 #endif
+ModbusMessage FC46(ModbusMessage request);
 #if TIMERS == 1
 ModbusMessage FC10(ModbusMessage request);
 #endif
 #endif
 
+#if MODBUS_SERVER != 1
+#define REFRESH_REGS()
+#endif
+
 #if FAUXMO_ACTIVE == 1
 fauxmoESP fauxmo;             // create Philips Hue lookalike
 #endif
-bool Testschalter;            // Relay state
-uint8_t dimValue;             // Hue dimmer value
+#if defined(ESP32)
+WebServer server(80);         // Web server on port 80
+#else
 ESP8266WebServer server(80);    // Web server on port 80
+#endif
 uint8_t mode;                 // Operations mode, RUN or CONFIG
 IPAddress myIP;               // local IP address
 char APssid[64];              // Access point ID
 uint16_t configFlags;         // 16 configuration flags
                               // 0x0001 : switch ON on boot
 uint16_t showFlags = 0;       // Modbus flags register
+uint32_t bootRelayTime = 0;   // millis() when the relay was switched on by default, 0: not yet
+uint32_t bootModbusTime = 0;  // millis() when the first Modbus request was answered, 0: not yet
 
 // The following are used only for GOSUND SP1, but will be initialized always for EEPROM
 struct Measure {
-  double measured;            // Observed value
+  uint32_t measured;          // Observed value in mV, mA or mW
   float factor;               // correction factor
-  Measure() : measured(0.0), factor(1.0) {}
+  uint32_t scale;             // Fixed point factor to get the measured value from a frequency in mHz
+  Measure() : measured(0), factor(1.0), scale(0) {}
 };
 
 #define VOLTAGE 0
@@ -277,17 +483,133 @@ struct Measure {
 Measure measures[3];
 
 #if HASPOWERMETER == 1
-// Spent Watt hours (Wh) since system boot
-double accumulatedWatts = 0.0;
-// Counters and interrupt functions to sample meter frequency
+// BL 0937 conversion constants according to the specs: measured unit per Hz of pulse frequency.
+// The same numbers will give milli-units per mHz.
+constexpr double BL_VOLTS = 1.218 / 15397.0 * 2001.0;
+constexpr double BL_AMPS = 1.218 / 94638.0 * 1000.0;
+constexpr double BL_WATTS = 1.218 * 1.218 * 2.0 / 1.721506;
+// Fixed point shift of all scale factors
+#define SCALE_SHIFT 24
+// Range of correction factors accepted. Keeps the fixed point scale factors well inside 32 bits
+constexpr float FACTOR_MIN = 0.1;
+constexpr float FACTOR_MAX = 10.0;
+
+// Spent energy since system boot: mWh collected before the latest power factor change
+uint64_t energyBase = 0;
+// ... plus the CF pulses counted since then
+uint64_t energyPulses = 0;
+// Fixed point mWh per CF pulse (a pulse is BL_WATTS Ws)
+uint32_t energyScale = 0;
+// CF_tick value at the latest energy update
+unsigned long int energyTick = 0;
+
+#if METER_TASK == 1
+// The meter task owns sampling, energy count and auto off check. It hands a MeterSample to
+// loop() every update, loop() and the Modbus workers (serialized by APP_LOCK) send commands back.
+// Both directions are single producer, single consumer queues.
+struct MeterSample {
+  uint32_t measured[3];       // mV, mA, mW
+  uint64_t energy;            // Spent energy in mWh
+  uint8_t resets;             // Number of energy resets done by the meter task so far
+  bool autoOff;               // Auto off condition was met
+};
+RingBuf<MeterSample, RB_SPSC> meterSamples(4);
+RingBuf<uint8_t, RB_SPSC> meterCommands(8);
+uint32_t meterValues[3];      // Measured values, private to the meter task
+uint64_t sampleEnergy = 0;    // Energy of the latest sample taken over by loop()
+uint8_t resetsSent = 0;       // Number of MC_RESET commands sent by loop()
+#define METER_VALUE(t) meterValues[t]
+TaskHandle_t meterTask = nullptr;
+#else
+#define METER_VALUE(t) measures[t].measured
+#endif
+// Commands to the meter: MC_RESET or MC_SCALE plus measure type
+#define MC_RESET 0x10
+#define MC_SCALE 0x20
+
+// Length of a meter sampling window in ms. In METER_PERIOD mode this is the longest time
+// to wait for pulses until a frequency is taken as zero.
+#define SAMPLE_TIME 1000
+
+#if METER_PERIOD == 1
+// Number of pulse periods to build the average frequency from
+#define NUM_PERIODS 8
+// Time in ms between updates of the measured values
+#define PERIOD_UPDATE 50
+
+// Size of the queues handing pulse periods from the interrupt functions to loop()
+#define PULSE_QUEUE 16
+
+// PulseTrack: latest periods between two pulses.
+// The interrupt functions are pushing the periods into a lock-free queue, loop() is moving
+// them into the averaging ring.
+struct PulseTrack {
+  RingBuf<uint32_t, RB_SPSC> queue;       // Periods in us, filled by interrupt functions
+  volatile uint32_t lastPulse;            // micros() of the latest pulse, written by interrupt functions
+  uint32_t periods[NUM_PERIODS];          // Latest pulse periods in us
+  uint32_t sum;                           // Sum of all valid periods
+  uint32_t resetTime;                     // micros() of the last resetTrack()
+  uint8_t head;                           // Slot for the next period
+  uint8_t count;                          // Number of valid periods
+  bool skip;                              // Next period is spanning a reset and is to be ignored
+  PulseTrack() : queue(PULSE_QUEUE), lastPulse(0), sum(0), resetTime(0), head(0), count(0), skip(true) {}
+};
+PulseTrack CF_track;
+PulseTrack CF1track;
+
+// trackPulse: register another pulse (called from interrupt functions only)
+void IRAM_ATTR trackPulse(PulseTrack& t) {
+  uint32_t now = micros();
+  // If the queue is full, the period is lost - no harm, as we will need the latest few only
+  t.queue.push_back(now - t.lastPulse);
+  t.lastPulse = now;
+}
+#endif
+
+// Counters and interrupt functions to sample meter frequency.
+// The counters are never reset, but run freely - sampling windows are taking differences
 volatile unsigned long int CF1tick = 0;
-void IRAM_ATTR CF1Tick() { CF1tick++; }
 volatile unsigned long int CF_tick = 0;
+#if METER_PERIOD == 1
+void IRAM_ATTR CF1Tick() { CF1tick++; trackPulse(CF1track); }
+void IRAM_ATTR CF_Tick() { CF_tick++; trackPulse(CF_track); }
+#else
+void IRAM_ATTR CF1Tick() { CF1tick++; }
 void IRAM_ATTR CF_Tick() { CF_tick++; }
+
+// Sampling window states
+enum SampleState : uint8_t { SW_IDLE = 0, SW_RUNNING, SW_DONE };
+
+// SampleWindow: snapshots of the free running counters at start and end of a sampling window
+struct SampleWindow {
+  SampleState state;          // IDLE, RUNNING or DONE
+  uint32_t startMillis;       // millis() at window start
+  uint32_t startMicros;       // micros() at window start
+  unsigned long int cfStart;  // CF_tick at window start
+  unsigned long int cf1Start; // CF1tick at window start
+  uint32_t cf;                // CF frequency in mHz of the last finished window
+  uint32_t cf1;               // CF1 frequency in mHz of the last finished window
+  SampleWindow() : state(SW_IDLE), startMillis(0), startMicros(0), cfStart(0), cf1Start(0), cf(0), cf1(0) {}
+};
+SampleWindow meterWindow;
+#endif
 #endif
 
 Timer_t timers[NUM_TIMERS];
 
+#if TIMERS == 1 || EVENT_TRACKING == 1
+// Timer schedule: next fire time of all active timers, earliest first
+struct TimerFire {
+  time_t when;                // Next time the timer is due
+  uint8_t timer;              // Timer slot
+};
+TimerFire schedule[NUM_TIMERS];
+uint8_t schedCount = 0;       // Number of schedule entries used
+time_t nextMidnight = 0;      // Next day change
+time_t nextDeadline = 0;      // Earliest of schedule[0] and nextMidnight. 0: no valid time yet
+volatile bool scheduleDirty = true; // Set to have the schedule rebuilt (timers changed, NTP sync)
+void buildSchedule(time_t from);
+#endif
 
 // TimeCount: class to hold time passed
 class TimeCount {
@@ -313,6 +635,12 @@ public:
   void reset() {
     counter_ = 0;
   }
+  uint32_t getSeconds() {
+    return (uint32_t)(((uint64_t)counter_ * interval_) / 1000);
+  }
+  void setSeconds(uint32_t s) {
+    if (interval_) counter_ = (uint32_t)(((uint64_t)s * 1000) / interval_);
+  }
 protected:
   uint32_t interval_;
   uint32_t counter_;
@@ -327,8 +655,18 @@ constexpr unsigned int update_interval = (UPDATE_TIME >= 2000) ? UPDATE_TIME : 2
 unsigned long tickCount = 0;
 // Time counters
 TimeCount upTime;
-TimeCount stateTime;
-TimeCount onTime;
+
+// Channel: one switched output. Channel 0 is the one the button, the power LED and auto power off are tied to
+struct Channel {
+  bool state;                 // Relay state
+  uint8_t dim;                // Hue dimmer value
+  TimeCount stateTime;        // Time in current state
+  TimeCount onTime;           // Time in ON state, for the power meter devices only with current flowing
+  Channel() : state(false), dim(0) { }
+};
+static_assert(NUM_CHANNELS >= 1 && NUM_CHANNELS <= MAX_CHANNELS, "NUM_CHANNELS is out of range");
+const uint8_t relayPins[NUM_CHANNELS] = { RELAY_PINS };
+Channel channels[NUM_CHANNELS];
 
 #if MODBUS_SERVER == 1
 ModbusServerTCPasync MBserver;
@@ -342,8 +680,9 @@ char DEVNAME[PARMLEN];
 char O_PWD[PARMLEN];
 
 #if TELNET_LOG == 1
-// Init Telnet logging: port 23, max. 2 concurrent clients, max. 3kB buffer
-TelnetLog tl(23, 2, 3000);
+// Init Telnet logging: port 23, max. 2 concurrent clients, max. 3kB buffer, zero-copy sending,
+// 256 words for deferred log records
+TelnetLog tl(23, 2, 3000, true, 256);
 #endif
 
 // SIGNAL_LED is the blinking one
@@ -352,6 +691,98 @@ Blinker SignalLed(SIGNAL_LED, LOW);
 // Button to watch
 Buttoner button(BUTTON, LOW);
 
+// Deferred EEPROM commits
+Persister persister;
+
+// Scheduler for the tasks of loop()
+Scheduler sched;
+int8_t tUpdate = -1;          // Update task, triggered by the meter task in window mode
+int8_t tMeter = -1;           // Meter task, sets its own deadlines in window mode
+// Task periods in ms
+#define OTA_PERIOD 50
+#define LED_PERIOD 10
+#define BUTTON_PERIOD 5
+#define NETWORK_PERIOD 100
+#define FAUXMO_PERIOD 20
+#define PERSIST_PERIOD 500
+#define METER_POLL 5
+#define SAMPLE_POLL 50
+#define TIMER_PERIOD 1000
+#define WEB_PERIOD 5
+// Longest time loop() will sleep
+#define MAX_IDLE 20
+void setupTasks();
+
+#if JOURNAL_TIME > 0
+// Energy and ON time journal in the (otherwise unused) file system flash area
+#if defined(ESP32)
+// That is the SPIFFS data partition on the ESP32. Without one the journal stays inactive
+const esp_partition_t *journalArea = esp_partition_find_first(ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_DATA_SPIFFS, nullptr);
+Journal journal(journalArea ? journalArea->address : 0, journalArea ? journalArea->size / FLASH_SECTOR_SIZE : 0);
+#else
+Journal journal(FS_PHYS_ADDR, FS_PHYS_SIZE / FLASH_SECTOR_SIZE);
+#endif
+void saveJournal();
+#define SAVE_JOURNAL() saveJournal()
+#else
+#define SAVE_JOURNAL()
+#endif
+
+#if HASPOWERMETER == 1
+// Measurement history: the latest samples and min/avg/max/energy rollups per minute and hour
+// Sample values are quantised to 16 bit
+struct Sample {
+  uint16_t volts;             // 0.1V
+  uint16_t amps;              // mA
+  uint16_t watts;             // 0.1W
+};
+
+// Power rollup for a period
+struct Rollup {
+  uint16_t minW;              // 0.1W
+  uint16_t avgW;              // 0.1W
+  uint16_t maxW;              // 0.1W
+  uint32_t energy;            // mWh spent in the period
+};
+
+// Rollup under construction
+struct RollupAcc {
+  uint16_t count;             // Number of values added
+  uint32_t sumW;              // Sum of the average values
+  uint16_t minW;
+  uint16_t maxW;
+  uint64_t energyStart;       // getEnergy() at period start
+  void start(uint64_t e) { count = 0; sumW = 0; minW = 0xFFFF; maxW = 0; energyStart = e; }
+  void add(uint16_t mi, uint16_t avg, uint16_t ma) {
+    count++;
+    sumW += avg;
+    if (mi < minW) minW = mi;
+    if (ma > maxW) maxW = ma;
+  }
+  Rollup close(uint64_t e) {
+    Rollup r;
+    r.minW = count ? minW : 0;
+    r.avgW = count ? sumW / count : 0;
+    r.maxW = maxW;
+    // A reset of the energy counter in the period will count from 0
+    r.energy = (uint32_t)((e >= energyStart) ? e - energyStart : e);
+    return r;
+  }
+};
+
+constexpr uint16_t HIST_SAMPLES(120);                     // 10 minutes of samples
+constexpr uint16_t HIST_MINUTES(60);                      // 1 hour of minute rollups
+constexpr uint16_t HIST_HOURS(24);                        // 1 day of hour rollups
+constexpr uint16_t SAMPLES_PER_MINUTE(60000 / update_interval);
+RingBuf<Sample> histSamples(HIST_SAMPLES);
+RingBuf<Rollup> histMinutes(HIST_MINUTES);
+RingBuf<Rollup> histHours(HIST_HOURS);
+RollupAcc minuteAcc;
+RollupAcc hourAcc;
+time_t histTime[3] = { 0, 0, 0 };                        // Time of the latest sample, minute and hour
+void updateHistory();
+#endif
+
 #if EVENT_TRACKING == 1
 // Define the event types
 enum S_EVENT : uint8_t  { 
@@ -378,37 +809,44 @@ const char *eventname[] = {
 // Allocate event buffer
 RingBuf<uint16_t> events(MAXEVENT);
 
+// Event log with full timestamps. Sequence numbers count up from 1 since boot
+struct EventRecord {
+  uint32_t seq;               // Sequence number
+  uint32_t epoch;             // Time of the event
+  uint8_t type;               // S_EVENT
+};
+RingBuf<EventRecord> eventLog(MAXEVENT);
+uint32_t eventSeq = 0;        // Sequence number of the latest event
+uint32_t eventsDelivered = 0; // Sequence number of the latest event a FC46 snapshot marked delivered
+
 // registerEvent: append another event to the buffer
 void registerEvent(S_EVENT ev) {
   // We will need date and/or time
   time_t now = time(NULL);
   tm tm;
   localtime_r(&now, &tm);           // update the structure tm with the current time
-  uint16_t eventWord = NO_EVENT << 11;
-  uint8_t hi = 0;
-  uint8_t lo = 0;
-  
- // Set the event word
-  if (ev == BOOT_DATE || ev == DATE_CHANGE) {
-    // Need the date
-    hi = tm.tm_mday & 0x1F;
-    lo = (tm.tm_mon + 1) & 0x3F;
-  } else {
-    // Need the time
-    hi = tm.tm_hour & 0x1F;
-    lo = tm.tm_min & 0x3F;
-  }
-  eventWord = ((ev & 0x1F) << 11) | (hi << 6) | lo;
+
+  // Set the event word. Date events need the date, all others the time
+  uint16_t eventWord = RM_eventAt(ev, ev == BOOT_DATE || ev == DATE_CHANGE, tm);
+  uint8_t hi = RM_eventHi(eventWord);
+  uint8_t lo = RM_eventLo(eventWord);
 
   // Prevent duplicates - last event must differ
   if (events[events.size() - 1] != eventWord) {
     // Push the word
     events.push_back(eventWord);
+    // ...and the full record
+    EventRecord er;
+    er.seq = ++eventSeq;
+    er.epoch = (uint32_t)now;
+    er.type = ev;
+    eventLog.push_back(er);
+    REFRESH_REGS();
   }
 
 #if TELNET_LOG == 1
   // Log event
-  tl.printf("Event: %-20s %02d%c%02d\n", eventname[ev], hi, (ev == BOOT_DATE || ev == DATE_CHANGE) ? '.' : ':', lo);
+  tl.logf(PSTR("Event: %-20s %02d%c%02d\n"), eventname[ev], hi, (ev == BOOT_DATE || ev == DATE_CHANGE) ? '.' : ':', lo);
 #endif
 }
 
@@ -420,14 +858,18 @@ void registerEvent(S_EVENT ev) {
 // -----------------------------------------------------------------------------
 // WiFi handlers
 // -----------------------------------------------------------------------------
+#if defined(ESP32)
+void onWifiDisconnect(WiFiEvent_t event, WiFiEventInfo_t info) {
+#else
 void onWifiDisconnect(const WiFiEventStationModeDisconnected& event) {
-  registerEvent(WIFI_DISCONN);
-  WiFi.disconnect();
+#endif
+  // Only note it here - the WiFi state machine will take care in loop()
   WiFiNeedsReconnect = true;
 }
 
 // -----------------------------------------------------------------------------
 // Setup WiFi in RUN mode
+// This will only start the connection. wifiUpdate() will follow it up without blocking.
 // -----------------------------------------------------------------------------
 void wifiSetup(const char *hostname) {
   // Start WiFi connection blinking pattern
@@ -436,49 +878,106 @@ void wifiSetup(const char *hostname) {
   WiFi.mode(WIFI_STA);
 
   // If we already have a device name, use it as hostname as well
+#if defined(ESP32)
+  if (*hostname) {
+    WiFi.setHostname(hostname);
+  }
+
+  // Register the handler once only
+  static bool handlerSet = false;
+  if (!handlerSet) {
+    WiFi.onEvent(onWifiDisconnect, ARDUINO_EVENT_WIFI_STA_DISCONNECTED);
+    handlerSet = true;
+  }
+#else
   if (*hostname) {
     WiFi.hostname(hostname);
   }
 
   wifiDisconnectHandler = WiFi.onStationModeDisconnected(onWifiDisconnect);
+#endif
 
   // Connect
   WiFi.begin(C_SSID, C_PWD);
+  wifiState = WS_CONNECTING;
+  wifiSince = millis();
+  wifiBackoff = WIFI_BACKOFF_MIN;
+  WiFiNeedsReconnect = false;
+}
 
-  // Wait for connection. ==> We will hang here in RUN mode forever without a WiFi!
-  uint32_t ReDo = 0;
-  while (WiFi.status() != WL_CONNECTED) {
-    SignalLed.update();
-    // Count attempts
-    ReDo++;
-    // Had we more than 480 (2 minutes)?
-    if (ReDo >= 480) {
-      // Yes, start over
-      registerEvent(WIFI_LOST);
+// -----------------------------------------------------------------------------
+// wifiUpdate: WiFi (re)connect state machine, called periodically in RUN mode.
+// Failed attempts are retried after a wait doubling up to WIFI_BACKOFF_MAX.
+// -----------------------------------------------------------------------------
+void wifiUpdate(const char *hostname, uint32_t now) {
+  // Did the disconnect handler fire?
+  if (WiFiNeedsReconnect) {
+    WiFiNeedsReconnect = false;
+    // Were we connected before?
+    if (wifiState == WS_CONNECTED) {
+      // Yes. Register it and try again soon
+      registerEvent(WIFI_DISCONN);
+      SignalLed.start(WIFIBLINK, 100);
+      wifiBackoff = WIFI_BACKOFF_MIN;
+    }
+    // No, else the attempt failed. Wait before the next one in any case
+    if (wifiState != WS_BACKOFF) {
       WiFi.disconnect();
-      delay(50);
-      WiFi.begin(C_SSID, C_PWD);
-      ReDo = 0;
+      wifiState = WS_BACKOFF;
+      wifiSince = now;
     }
-    delay(250);
   }
 
-  myIP = WiFi.localIP();
+  switch (wifiState) {
+  case WS_CONNECTING:
+    // Are we connected?
+    if (WiFi.status() == WL_CONNECTED) {
+      // Yes.
+      myIP = WiFi.localIP();
   
-  // Start mDNS service
-  if (*hostname) {
-    MDNS.begin(hostname);
-  }
+      // Start mDNS service
+      if (*hostname) {
+        MDNS.begin(hostname);
+      }
 
-  // Fix connection for automatic recovery
-  // WiFi.setAutoReconnect(true);
-  WiFi.persistent(true);  
+      // Fix connection for automatic recovery
+      // WiFi.setAutoReconnect(true);
+      WiFi.persistent(true);  
 
-  registerEvent(WIFI_CONN);
-  WiFiNeedsReconnect = false;
+      registerEvent(WIFI_CONN);
+      wifiState = WS_CONNECTED;
+      wifiBackoff = WIFI_BACKOFF_MIN;
 
-  // Connected! Stop blinking
-  SignalLed.stop();
+      // Connected! Stop blinking
+      SignalLed.stop();
+    // No. Taking too long?
+    } else if (now - wifiSince >= WIFI_CONNECT_TIME) {
+      // Yes, give up this attempt
+      WiFi.disconnect();
+      wifiState = WS_BACKOFF;
+      wifiSince = now;
+    }
+    break;
+  case WS_BACKOFF:
+    // Waited long enough?
+    if (now - wifiSince >= wifiBackoff) {
+      // Yes. Next attempt, and next time wait longer
+      WiFi.begin(C_SSID, C_PWD);
+      wifiState = WS_CONNECTING;
+      wifiSince = now;
+      if (wifiBackoff < WIFI_BACKOFF_MAX) {
+        wifiBackoff *= 2;
+        // Reached the longest wait? We have been trying for about two minutes now
+        if (wifiBackoff >= WIFI_BACKOFF_MAX) {
+          wifiBackoff = WIFI_BACKOFF_MAX;
+          registerEvent(WIFI_LOST);
+        }
+      }
+    }
+    break;
+  default:
+    break;
+  }
 }
 
 // -----------------------------------------------------------------------------
@@ -486,157 +985,127 @@ void wifiSetup(const char *hostname) {
 // -----------------------------------------------------------------------------
 // Wrapper for Fauxmo to be able to register Event
 void SetState_F(uint8_t device_id, const char * device_name, bool state, uint8_t value) {
+  APP_LOCK();
   SetState(device_id, device_name, state, value);
   EVENT(state ? FAUXMO_ON : FAUXMO_OFF);
 }
 
+// device_id is the channel to switch. The Fauxmo device IDs are the channel numbers as well
 void SetState(uint8_t device_id, const char * device_name, bool state, uint8_t value) {
+#if NUM_CHANNELS > 1
+  // Unknown channel?
+  if (device_id >= NUM_CHANNELS) return;
+#else
+  // There is only the one
+  device_id = 0;
+#endif
+  Channel& ch = channels[device_id];
   if (state) { // ON
 #if TELNET_LOG == 1
     LOG_I("Switch ON\n");
 #endif
-    Testschalter = true;
+    ch.state = true;
 #if defined(POWER_LED)
-    digitalWrite(POWER_LED, LOW);
+    if (device_id == 0) digitalWrite(POWER_LED, LOW);
 #endif
-    digitalWrite(RELAY, HIGH);
+    digitalWrite(relayPins[device_id], HIGH);
   } else { // OFF
 #if TELNET_LOG == 1
     LOG_I("Switch OFF\n");
 #endif
-    Testschalter = false;
+    ch.state = false;
 #if defined(POWER_LED)
-    digitalWrite(POWER_LED, HIGH);
+    if (device_id == 0) digitalWrite(POWER_LED, HIGH);
 #endif
-    digitalWrite(RELAY, LOW);
+    digitalWrite(relayPins[device_id], LOW);
   }
-  stateTime.reset();
-  dimValue = value;
+  ch.stateTime.reset();
+  ch.dim = value;
+  REFRESH_REGS();
 }
 
-#if MODBUS_SERVER == 1
-// -----------------------------------------------------------------------------
-// FC03. React on Modbus read request
-// -----------------------------------------------------------------------------
-ModbusMessage FC03(ModbusMessage request) {
-  ModbusMessage response;          // returned response message
-
-  uint16_t address = 0;
-  uint16_t words = 0;
-
-  // Get start address and length for read
-  request.get(2, address);
-  request.get(4, words);
-
-  // Valid?
-  if (address && words && ((address + words - 1) <= MAXWORD) && (words < 126)) {
-    // Yes, both okay.
-    // set up response
-    response.add(request.getServerID(), request.getFunctionCode(), (uint8_t)(words * 2));
+// setRelays: set all relay GPIOs at once, the channel states are not touched
+void setRelays(uint8_t level) {
+  for (uint8_t i = 0; i < NUM_CHANNELS; ++i) {
+    digitalWrite(relayPins[i], level);
+  }
+}
 
+#if MODBUS_SERVER == 1
+// updateRegisters: rebuild the complete register image.
+// Registers not supported by the device type remain 0.
+void updateRegisters() {
+  regImage.set(REG_STATE.addr, (uint16_t)(channels[0].state ? channels[0].dim : 0));
+  regImage.set(REG_FLAGS.addr, showFlags);
+  regImage.set(REG_LAYOUT.addr, REG_LAYOUT_ID);
+  regImage.set(REG_PENDING.addr, persister.pending());
+  regImage.set(REG_BOOT_RELAY.addr, (uint16_t)((bootRelayTime > 0xFFFF) ? 0xFFFF : bootRelayTime));
+  regImage.set(REG_BOOT_MODBUS.addr, (uint16_t)((bootModbusTime > 0xFFFF) ? 0xFFFF : bootModbusTime));
+  regImage.set32(REG_STATS.at(0), minFreeHeap);
+  regImage.set32(REG_STATS.at(1), minMaxBlock);
+#if TELNET_LOG == 1
+  regImage.set32(REG_STATS.at(2), tl.getDropped());
+  stats[ST_TELNET] = tl.getSendStat();
+#endif
+  regImage.set32(REG_STATS.at(3), mbErrors);
+  for (uint8_t i = 0; i < ST_COUNT; ++i) {
+    uint16_t addr = REG_TIMINGS.at(i * STAT_WORDS);
+    regImage.set32(addr, stats[i].count);
+    regImage.set32(addr + 2, stats[i].maxUs);
+    for (uint8_t j = 0; j < STAT_BUCKETS; ++j) {
+      regImage.set(addr + 4 + j, stats[i].bucket[j]);
+    }
+  }
+  regImage.set(REG_UPTIME.addr, (uint16_t)upTime.getHour());
+  regImage.set(REG_UPTIME.addr + 1, upTime.getMinute(), upTime.getSecond());
+  regImage.set(REG_STATETIME.addr, (uint16_t)channels[0].stateTime.getHour());
+  regImage.set(REG_STATETIME.addr + 1, channels[0].stateTime.getMinute(), channels[0].stateTime.getSecond());
+  regImage.set(REG_ONTIME.addr, (uint16_t)channels[0].onTime.getHour());
+  regImage.set(REG_ONTIME.addr + 1, channels[0].onTime.getMinute(), channels[0].onTime.getSecond());
+  // Blocks of the other channels, if any
+  regImage.set(REG_CHANNELCOUNT.addr, (uint16_t)NUM_CHANNELS);
+  for (uint8_t i = 1; i < NUM_CHANNELS; ++i) {
+    Channel& ch = channels[i];
+    uint16_t addr = RM_channel(i);
+    regImage.set(addr, (uint16_t)(ch.state ? ch.dim : 0));
+    regImage.set(addr + 1, (uint16_t)ch.stateTime.getHour());
+    regImage.set(addr + 2, ch.stateTime.getMinute(), ch.stateTime.getSecond());
+    regImage.set(addr + 3, (uint16_t)ch.onTime.getHour());
+    regImage.set(addr + 4, ch.onTime.getMinute(), ch.onTime.getSecond());
+  }
 #if HASPOWERMETER == 1
-    // On devices w/ power meter we need to set up the float array
-    ModbusMessage memory;
-    memory.add((float)accumulatedWatts);
-    memory.add(measures[VOLTAGE].factor);
-    memory.add(measures[CURRENT].factor);
-    memory.add(measures[POWER].factor);
-    memory.add((float)measures[VOLTAGE].measured);
-    memory.add((float)measures[CURRENT].measured);
-    memory.add((float)measures[POWER].measured);
-#endif
-
-    // Loop over requested registers
-    for (uint16_t addr = address; addr < address + words; addr++) {
-      switch (addr) {
-      case 1: // socket state
-        response.add((uint16_t)(Testschalter ? dimValue : 0));
-        break;
-      case 2: // flag word
-        response.add(showFlags);
-        break;
-      case 3: // uptime hours
-        response.add(upTime.getHour());
-        break;
-      case 4: // uptime minutes and seconds
-        response.add(upTime.getMinute());
-        response.add(upTime.getSecond());
-        break;
-      case 5: // state time hours
-        response.add(stateTime.getHour());
-        break;
-      case 6: // state time minutes and seconds
-        response.add(stateTime.getMinute());
-        response.add(stateTime.getSecond());
-        break;
-      case 7: // ON time hours
-        response.add(onTime.getHour());
-        break;
-      case 8: // ON time minutes and seconds
-        response.add(onTime.getMinute());
-        response.add(onTime.getSecond());
-        break;
-      case 9 ... 22: // power meter data not present on other devices
-#if HASPOWERMETER == 1
-        response.add(memory.data() + (addr - 9) * 2, 2);
-#else
-        response.add((uint16_t)0);
+  regImage.set(REG_ENERGY.addr, getEnergy() / 1000.0f);
+  for (uint8_t i = 0; i < 3; ++i) {
+    regImage.set(REG_FACTORS.at(i), measures[i].factor);
+    regImage.set(REG_MEASURES.at(i), measures[i].measured / 1000.0f);
+  }
+  regImage.set(REG_AO_AMPS.addr, aoAmps);
+  regImage.set(REG_AO_CYCLES.addr, aoCycles);
 #endif
-        break;
-      case 23 ... 23 + NUM_TIMERS * 2 - 1: // timer data may be not present as well
 #if TIMERS == 1
-        {
-          // Calculate timer slot
-          uint8_t tim = (addr - 23) / 2;
-          if (addr & 1) { // odd address
-            response.add(timers[tim].activeDays);
-            response.add(timers[tim].onOff);
-          } else { // even address
-            response.add(timers[tim].hour);
-            response.add(timers[tim].minute);
-          }
-        }
-#else
-        response.add((uint16_t)0);
-#endif
-        break;
-      case 23 + NUM_TIMERS * 2: // Event slot count
-#if EVENT_TRACKING
-        response.add((uint16_t)MAXEVENT);
-#else
-        response.add((uint16_t)0);
-#endif
-        break;
-      case 23 + NUM_TIMERS * 2 + 1 ... MAXWORD - 2: // Event slots
-#if EVENT_TRACKING
-        response.add(events[addr - (23 + NUM_TIMERS * 2 + 1)]);
-#else
-        response.add((uint16_t)0);
-#endif
-        break;
-      case MAXWORD - 1: // Auto off mA value
-#if HASPOWERMETER == 1
-        response.add(aoAmps);
-#else
-        response.add((uint16_t)0);
-#endif
-        break;
-      case MAXWORD: // Auto off cycles
-#if HASPOWERMETER == 1
-        response.add(aoCycles);
-#else
-        response.add((uint16_t)0);
+  for (uint8_t i = 0; i < NUM_TIMERS; ++i) {
+    regImage.set(REG_TIMERS.at(2 * i), timers[i].activeDays, timers[i].onOff);
+    regImage.set(REG_TIMERS.at(2 * i + 1), timers[i].hour, timers[i].minute);
+  }
 #endif
-        break;
-      default:
-        // Shouldn't get here...
-        break;
-      }
-    }
-  } else {
-    // No, memory violation. Return error
-    response.setError(request.getServerID(), request.getFunctionCode(), ILLEGAL_DATA_ADDRESS);
+#if EVENT_TRACKING == 1
+  regImage.set(REG_EVENTCOUNT.addr, (uint16_t)MAXEVENT);
+  for (uint8_t i = 0; i < MAXEVENT; ++i) {
+    regImage.set(REG_EVENTS.at(i), events[i]);
   }
+#endif
+}
+
+// -----------------------------------------------------------------------------
+// FC03. React on Modbus read request
+// -----------------------------------------------------------------------------
+ModbusMessage FC03(ModbusMessage request) {
+  APP_LOCK();
+  NOTE_REQUEST();
+  StatScope timing(stats[ST_FC03]);
+  // Check the range and copy it out of the register image
+  ModbusMessage response = regImage.read(request);
+  noteResponse(response);
   return response;
 }
 
@@ -644,6 +1113,9 @@ ModbusMessage FC03(ModbusMessage request) {
 // FC06. Switch socket on or off or change config values
 // -----------------------------------------------------------------------------
 ModbusMessage FC06(ModbusMessage request) {
+  APP_LOCK();
+  NOTE_REQUEST();
+  StatScope timing(stats[ST_FC06]);
   ModbusMessage response;
   uint16_t address = 0;
   uint16_t value = 0;
@@ -656,7 +1128,7 @@ ModbusMessage FC06(ModbusMessage request) {
 #endif
 
   // Address valid? Switch trigger on 1
-  if (address == 1) {
+  if (address == REG_STATE.addr) {
     // Yes. Data in valid range?
     if (value < 256) {
       // Yes. switch socket
@@ -669,41 +1141,57 @@ ModbusMessage FC06(ModbusMessage request) {
       response.setError(request.getServerID(), request.getFunctionCode(), ILLEGAL_DATA_VALUE);
     }
   // Also okay: 2 - flag word
-  } else if (address == 2) {
+  } else if (address == REG_FLAGS.addr) {
     // Write to EEPROM
     configFlags = value & CONF_MASK;
-    EEPROM.put(2, value & CONF_MASK);
-    EEPROM.commit();
+    persister.put(2, (uint16_t)(value & CONF_MASK));
+    REFRESH_REGS();
     response = ECHO_RESPONSE;
 #if HASPOWERMETER == 1
   // On the devices with power meter we may reset the accumulated power consumption on word 9
-  } else if (address == 9) {
+  } else if (address == REG_ENERGY.addr) {
     // Value is zero?
     if (value == 0) {
-      // Yes. Reset the counter
-      accumulatedWatts = 0.0;
+      // Yes. Reset the counter and make it persistent
+      resetEnergy();
+      SAVE_JOURNAL();
       response = ECHO_RESPONSE;
     } else {
       // No, illegal data value
       response.setError(request.getServerID(), request.getFunctionCode(), ILLEGAL_DATA_VALUE);
     }
   // Auto power off LOW current value in mA
-  } else if (address == MAXWORD - 1) {
+  } else if (address == REG_AO_AMPS.addr) {
     aoAmps = value;
-    EEPROM.put(O_AUTO_PO, aoAmps);
-    EEPROM.commit();
+    persister.put(O_AUTO_PO, aoAmps);
+    REFRESH_REGS();
     response = ECHO_RESPONSE;
   // Auto power off LOW cycles
-  } else if (address == MAXWORD) {
+  } else if (address == REG_AO_CYCLES.addr) {
     aoCycles = value;
-    EEPROM.put(O_AUTO_PO + 2, aoCycles);
-    EEPROM.commit();
+    persister.put(O_AUTO_PO + 2, aoCycles);
+    REFRESH_REGS();
     response = ECHO_RESPONSE;
+#endif
+#if NUM_CHANNELS > 1
+  // State word of one of the other channels?
+  } else if (address >= RM_channel(1) && address < RM_channel(NUM_CHANNELS) && (address - RM_channel(1)) % CHANNEL_WORDS == 0) {
+    // Yes. Data in valid range?
+    if (value < 256) {
+      // Yes. switch it
+      SetState((address - RM_channel(1)) / CHANNEL_WORDS + 1, DEVNAME, (value ? true : false), (uint8_t)value);
+      EVENT(value ? MODBUS_ON : MODBUS_OFF);
+      response = ECHO_RESPONSE;
+    } else {
+      // No, illegal data value
+      response.setError(request.getServerID(), request.getFunctionCode(), ILLEGAL_DATA_VALUE);
+    }
 #endif
   } else {
     // No, memory violation. Return error
     response.setError(request.getServerID(), request.getFunctionCode(), ILLEGAL_DATA_ADDRESS);
   }
+  noteResponse(response);
   return response;
 }
 
@@ -712,6 +1200,9 @@ ModbusMessage FC06(ModbusMessage request) {
 // FC10. Write timer settings
 // -----------------------------------------------------------------------------
 ModbusMessage FC10(ModbusMessage request) {
+  APP_LOCK();
+  NOTE_REQUEST();
+  StatScope timing(stats[ST_FC10]);
   ModbusMessage response;
   uint16_t addr;      // Starting address to be written
   uint16_t words;     // Number of registers
@@ -721,36 +1212,39 @@ ModbusMessage FC10(ModbusMessage request) {
   offs = request.get(offs, words); // read register count
 
   // Address and range valid?
-  if (addr >= 23 && (addr + words) <= 54 && words) {
+  if (addr >= REG_TIMERS.addr && (addr + words) <= REG_TIMERS.next() && words) {
     // Seems to be okay
     offs++;               // Skip length byte
     Timer_t tim_temp;     // Temporary storage to check data
     // Loop over delivered value words
     for (uint16_t a = addr; a < addr + words; a++) {
-      uint8_t tim = (a - 23) / 2;  // Timer slot
-      if (a & 1) {  // odd address
+      uint8_t tim = (a - REG_TIMERS.addr) / 2;  // Timer slot
+      if (((a - REG_TIMERS.addr) & 1) == 0) {  // First word of a timer
         offs = request.get(offs, tim_temp.activeDays);
         offs = request.get(offs, tim_temp.onOff);
         timers[tim].activeDays = tim_temp.activeDays; // Accept all values
-        timers[tim].onOff = tim_temp.onOff & ONMASK;    // Restrict to on/off flag
-        EEPROM[O_TIMERS + tim * sizeof(Timer_t)] = tim_temp.activeDays;
-        EEPROM[O_TIMERS + tim * sizeof(Timer_t) + 1] = tim_temp.onOff;
-      } else {      // even address
+        timers[tim].onOff = tim_temp.onOff & (ONMASK | TIMER_CHANNELMASK);    // Restrict to on/off flag and channel
+        persister.write(O_TIMERS + tim * sizeof(Timer_t), tim_temp.activeDays);
+        persister.write(O_TIMERS + tim * sizeof(Timer_t) + 1, tim_temp.onOff);
+      } else {      // Second word
         offs = request.get(offs, tim_temp.hour);
         offs = request.get(offs, tim_temp.minute);
         timers[tim].hour = tim_temp.hour % 24;        // Just 0..23
         timers[tim].minute = tim_temp.minute % 60;    // Just 0..59
-        EEPROM[O_TIMERS + tim * sizeof(Timer_t) + 2] = tim_temp.hour;
-        EEPROM[O_TIMERS + tim * sizeof(Timer_t) + 3] = tim_temp.minute;
+        persister.write(O_TIMERS + tim * sizeof(Timer_t) + 2, tim_temp.hour);
+        persister.write(O_TIMERS + tim * sizeof(Timer_t) + 3, tim_temp.minute);
       }
     }
-    EEPROM.commit();
+    // Timers have changed, find the next due
+    scheduleDirty = true;
+    REFRESH_REGS();
     // Prepare echo response
     response.add(request.getServerID(), request.getFunctionCode(), addr, words);
   } else {
     // Wrong address or number of registers
     response.setError(request.getServerID(), request.getFunctionCode(), ILLEGAL_DATA_ADDRESS);
   }
+  noteResponse(response);
   return response;
 }
 #endif
@@ -760,6 +1254,9 @@ ModbusMessage FC10(ModbusMessage request) {
 // FC43. Power meter adjustment
 // -----------------------------------------------------------------------------
 ModbusMessage FC43(ModbusMessage request) {
+  APP_LOCK();
+  NOTE_REQUEST();
+  StatScope timing(stats[ST_FC43]);
   ModbusMessage response;
   uint8_t type = 0;           // 0:volts, 1:amps, 2:watts
   float value = 0.0;          // Real value sent in message
@@ -775,63 +1272,400 @@ ModbusMessage FC43(ModbusMessage request) {
   // Set default response
   response.setError(request.getServerID(), request.getFunctionCode(), SUCCESS);
 
-  // Is it a valid type?
-  if (type >=0 && type <=2) {
+  // Is it a valid type and a sane factor? (The comparison is false for NaN as well)
+  if (type <= 2 && value >= FACTOR_MIN && value <= FACTOR_MAX) {
       // Yes. Write it.
       measures[type].factor = value;
-      EEPROM.put(4 + 4 * type, value);
-      EEPROM.commit();
+      meterCommand(MC_SCALE | type);
+      persister.put(4 + 4 * type, value);
+      REFRESH_REGS();
   } else {
     response.setError(request.getServerID(), request.getFunctionCode(), ILLEGAL_DATA_VALUE);
   }
+  noteResponse(response);
+  return response;
+}
+
+// -----------------------------------------------------------------------------
+// FC44. Read measurement history
+// Request: type byte (0: samples, 1: minute rollups, 2: hour rollups), uint16_t number of
+//   latest records to skip, count byte.
+// Response: type byte, uint16_t records available, uint32_t time of the latest record,
+//   uint16_t seconds per record, count byte, records with the latest first.
+//   Sample: uint16_t 0.1V, mA, 0.1W. Rollup: uint16_t min, avg, max 0.1W, uint32_t mWh.
+// The count is limited by the size of a Modbus message.
+// -----------------------------------------------------------------------------
+ModbusMessage FC44(ModbusMessage request) {
+  APP_LOCK();
+  NOTE_REQUEST();
+  ModbusMessage response;
+  uint8_t type = 0;
+  uint16_t skip = 0;
+  uint8_t count = 0;
+  uint16_t offs = 2;
+
+  offs = request.get(offs, type);
+  offs = request.get(offs, skip);
+  offs = request.get(offs, count);
+
+  // Valid type and count?
+  if (type > 2 || count == 0) {
+    response.setError(request.getServerID(), request.getFunctionCode(), ILLEGAL_DATA_VALUE);
+    noteResponse(response);
+    return response;
+  }
+
+  const uint16_t period[3] = { update_interval / 1000, 60, 3600 };
+  // Max. records fitting behind the 12 bytes header
+  const uint8_t maxCount[3] = { 240 / sizeof(uint16_t) / 3, 240 / 10, 240 / 10 };
+  uint16_t avail = (type == 0) ? histSamples.size() : (type == 1) ? histMinutes.size() : histHours.size();
+
+  // Anything to send from there on?
+  if (skip >= avail) {
+    response.setError(request.getServerID(), request.getFunctionCode(), ILLEGAL_DATA_ADDRESS);
+    noteResponse(response);
+    return response;
+  }
+
+  if (count > maxCount[type]) count = maxCount[type];
+  if (count > avail - skip) count = avail - skip;
+
+  response.add(request.getServerID(), request.getFunctionCode(), type, avail);
+  response.add((uint32_t)histTime[type], period[type], count);
+  for (uint16_t i = avail - 1 - skip; count; --i, --count) {
+    if (type == 0) {
+      Sample sm = histSamples[i];
+      response.add(sm.volts, sm.amps, sm.watts);
+    } else {
+      Rollup r = (type == 1) ? histMinutes[i] : histHours[i];
+      response.add(r.minW, r.avgW, r.maxW, r.energy);
+    }
+  }
+  noteResponse(response);
   return response;
 }
 #endif
 
 #endif
 
+#if TIMERS == 1 || EVENT_TRACKING == 1
 // -----------------------------------------------------------------------------
-// Setup. Find out which mode to run and initialize objects
+// nextFire: get the first time at or after from a timer is due. 0 if never
 // -----------------------------------------------------------------------------
-void setup() {
-  uint8_t confcnt = 0;     // count necessary config variables
+time_t nextFire(Timer_t& t, time_t from) {
+  tm base;
+  localtime_r(&from, &base);
+  // Check today and the next 7 days - same weekday next week may be the only one
+  for (uint8_t d = 0; d <= 7; ++d) {
+    tm x = base;
+    x.tm_mday += d;
+    x.tm_hour = t.hour;
+    x.tm_min = t.minute;
+    x.tm_sec = 0;
+    x.tm_isdst = -1;
+    // mktime() will normalize the date and set the day of week
+    time_t when = mktime(&x);
+    if (when >= from && (t.activeDays & (1 << x.tm_wday))) {
+      return when;
+    }
+  }
+  return 0;
+}
 
-  // Define GPIO input/output direction
-  pinMode(SIGNAL_LED, OUTPUT);
-#if defined(POWER_LED)
-  pinMode(POWER_LED, OUTPUT);
-#endif
-  pinMode(RELAY, OUTPUT);
+// -----------------------------------------------------------------------------
+// buildSchedule: sort the next fire times of all active timers and set the next deadline
+// -----------------------------------------------------------------------------
+void buildSchedule(time_t from) {
+  scheduleDirty = false;
+  schedCount = 0;
+  // Do we have a valid time already?
+  if (from < VALID_TIME) {
+    // No. Try again after the NTP sync
+    nextDeadline = 0;
+    return;
+  }
 
-  // initially switch to OFF
-  digitalWrite(RELAY, LOW);        // Relay OFF
-  digitalWrite(SIGNAL_LED, HIGH);  // LED OFF
-#if defined(POWER_LED)
-  digitalWrite(POWER_LED, HIGH);   // LED OFF
+  // Get the next midnight
+  tm x;
+  localtime_r(&from, &x);
+  x.tm_mday++;
+  x.tm_hour = x.tm_min = x.tm_sec = 0;
+  x.tm_isdst = -1;
+  nextMidnight = mktime(&x);
+  nextDeadline = nextMidnight;
+
+#if TIMERS == 1
+  for (uint8_t i = 0; i < NUM_TIMERS; ++i) {
+    // Only active timers are scheduled
+    if (timers[i].activeDays & ACTIVEMASK) {
+      time_t when = nextFire(timers[i], from);
+      if (when) {
+        // Insert by time. Timers due at the same time keep their order
+        uint8_t k = schedCount++;
+        while (k && schedule[k - 1].when > when) {
+          schedule[k] = schedule[k - 1];
+          k--;
+        }
+        schedule[k].when = when;
+        schedule[k].timer = i;
+      }
+    }
+  }
+  if (schedCount && schedule[0].when < nextDeadline) {
+    nextDeadline = schedule[0].when;
+  }
+#endif
+}
 #endif
 
-  // Determine operation mode - normally RUN
-  mode = RUN;
+#if MODBUS_SERVER == 1 && EVENT_TRACKING == 1
+// -----------------------------------------------------------------------------
+// FC45. Read the event log incrementally
+// Request: uint32_t sequence number of the last event known (0: none), count byte.
+// Response: uint32_t boot ID, uint32_t latest sequence number, count byte, records oldest first.
+//   Record: uint32_t sequence number, uint32_t epoch time, event type byte.
+// A gap in the sequence numbers means events were lost in between, a different boot ID
+// that the device was restarted and the sequence numbers started over.
+// -----------------------------------------------------------------------------
+ModbusMessage FC45(ModbusMessage request) {
+  APP_LOCK();
+  NOTE_REQUEST();
+  ModbusMessage response;
+  uint32_t since = 0;
+  uint8_t count = 0;
+  uint16_t offs = 2;
 
-  // Configure EEPROM
-  // EEPROM layout:
-  //   0 : uint16_t magic value
-  //   2 : uint16_t flag word
-  //   4 : float32 Volts adjustment factor (HASPOWERMETER==1)
-  //   8 : float32 Amperes adjustment factor (HASPOWERMETER==1)
-  //  12 : float32 Watts adjustment factor (HASPOWERMETER==1)
-  //  16 : char[PARMLEN] SSID
-  //  16 + PARMLEN : char[PARMLEN] PASS
-  //  16 + 2 * PARMLEN : char[PARMLEN] DEVICENAME
-  //  16 + 3 * PARMLEN : char[PARMLEN] OTA_PWD
-  //  16 + 4 * PARMLEN : Timer_t[NUM_TIMERS] (==O_TIMERS)
-  //  16 + 4 * PARMLEN + NUM_TIMERS * sizeof(Timer_t) : uint16_t auto power off value (mA) (== O_AUTO_PO)
-  //  16 + 4 * PARMLEN + NUM_TIMERS * sizeof(Timer_t) + 2 : uint16_t auto power off check cycles
-  EEPROM.begin(512);
+  offs = request.get(offs, since);
+  offs = request.get(offs, count);
 
-  // Read magic value
-  uint16_t magic;
-  EEPROM.get(0, magic);
+  if (count == 0) {
+    response.setError(request.getServerID(), request.getFunctionCode(), ILLEGAL_DATA_VALUE);
+    noteResponse(response);
+    return response;
+  }
+  // Max. records fitting behind the 11 bytes header
+  if (count > 27) count = 27;
+
+  // Find the first record newer than since. The newest are at the end
+  uint16_t avail = eventLog.size();
+  uint16_t first = avail;
+  while (first && eventLog[first - 1].seq > since) first--;
+  if (count > avail - first) count = avail - first;
+
+  response.add(request.getServerID(), request.getFunctionCode(), bootId, eventSeq, count);
+  for (uint16_t i = first; count; ++i, --count) {
+    EventRecord er = eventLog[i];
+    response.add(er.seq, er.epoch, er.type);
+  }
+  noteResponse(response);
+  return response;
+}
+#endif
+
+#if MODBUS_SERVER == 1
+// -----------------------------------------------------------------------------
+// FC46. Snapshot of state, meter data and undelivered events in one response
+// Request: flags byte. SNAP_ACK: followed by uint32_t boot ID and uint32_t sequence number of the
+//   latest event the client has received. Events up to that one are marked as delivered.
+// Response: layout ID, registers 1..22, 96 and 97 as with FC03, uint32_t boot ID,
+//   uint32_t latest sequence number, count byte, records oldest first as with FC45.
+// Undelivered are the events after the latest one marked. An event is marked only after a client
+// got it in a response and acknowledged it with the following request, so a response lost on the
+// way will be sent again. Acknowledgements for an earlier boot are ignored. Marking will not remove
+// events from the event registers or the FC45 log, so other clients are not affected.
+// -----------------------------------------------------------------------------
+ModbusMessage FC46(ModbusMessage request) {
+  APP_LOCK();
+  NOTE_REQUEST();
+  ModbusMessage response;
+  uint8_t flags = 0;
+
+  request.get(2, flags);
+  // Unknown flags or acknowledgement missing?
+  if ((flags & ~SNAP_ACK) || ((flags & SNAP_ACK) && request.size() < 11)) {
+    // Yes. Refuse the request
+    response.setError(request.getServerID(), request.getFunctionCode(), ILLEGAL_DATA_VALUE);
+    noteResponse(response);
+    return response;
+  }
+
+  response.add(request.getServerID(), request.getFunctionCode(), REG_LAYOUT_ID);
+  // The register image is big-endian already. All is taken in one go, so the values are consistent
+  response.add(regImage.data(REG_STATE.addr), SNAP_WORDS * 2);
+  response.add(regImage.data(REG_AO_AMPS.addr), (REG_AO_AMPS.words() + REG_AO_CYCLES.words()) * 2);
+#if EVENT_TRACKING == 1
+  // Acknowledgement for the events of this boot?
+  if (flags & SNAP_ACK) {
+    uint32_t ackBoot = 0;
+    uint32_t ackSeq = 0;
+    request.get(3, ackBoot, ackSeq);
+    if (ackBoot == bootId) {
+      // Yes. Mark all up to the one acknowledged, but none the client cannot have seen
+      if (ackSeq > eventSeq) ackSeq = eventSeq;
+      if (ackSeq > eventsDelivered) eventsDelivered = ackSeq;
+    }
+  }
+  // Find the first record not delivered yet. The newest are at the end
+  uint16_t avail = eventLog.size();
+  uint16_t first = avail;
+  while (first && eventLog[first - 1].seq > eventsDelivered) first--;
+  uint8_t count = (avail - first > SNAP_MAXEVENTS) ? SNAP_MAXEVENTS : avail - first;
+
+  response.add(bootId, eventSeq, count);
+  for (uint16_t i = first; count; ++i, --count) {
+    EventRecord er = eventLog[i];
+    response.add(er.seq, er.epoch, er.type);
+  }
+#else
+  // No events at all
+  response.add(bootId, (uint32_t)0, (uint8_t)0);
+#endif
+  noteResponse(response);
+  return response;
+}
+#endif
+
+#if MULTICAST_PUSH == 1
+// -----------------------------------------------------------------------------
+// sendFrame: send the current data to the multicast group.
+// Frame layout, all values MSB first:
+//   0 : 'S', 'D'
+//   2 : uint8_t frame version (FRAME_VERSION)
+//   3 : uint8_t number of registers n following the header
+//   4 : uint32_t chip ID
+//   8 : uint32_t frame sequence number
+//  12 : uint32_t latest event sequence number
+//  16 : uint32_t boot ID
+//  20 : n registers as in the Modbus register map, starting with register 1
+//  20 + 2n : uint8_t length of the device name, then the name
+// -----------------------------------------------------------------------------
+#define FRAME_VERSION 2
+constexpr uint16_t FRAME_REGS(REG_MEASURES.next() - 1); // Registers 1..22
+WiFiUDP mcast;
+uint32_t frameSeq = 0;
+
+void sendFrame() {
+  uint8_t frame[20 + FRAME_REGS * 2 + 1 + PARMLEN];
+  uint16_t len = 0;
+
+  auto put32 = [&](uint32_t v) {
+    for (int8_t i = 24; i >= 0; i -= 8) frame[len++] = (v >> i) & 0xFF;
+  };
+  frame[len++] = 'S';
+  frame[len++] = 'D';
+  frame[len++] = FRAME_VERSION;
+  frame[len++] = FRAME_REGS;
+  put32(chipId());
+  put32(++frameSeq);
+#if EVENT_TRACKING == 1
+  put32(eventSeq);
+#else
+  put32(0);
+#endif
+  put32(bootId);
+  // The register image is big-endian already
+  memcpy(frame + len, regImage.data(REG_STATE.addr), FRAME_REGS * 2);
+  len += FRAME_REGS * 2;
+  uint8_t nameLen = strnlen(DEVNAME, PARMLEN - 1);
+  frame[len++] = nameLen;
+  memcpy(frame + len, DEVNAME, nameLen);
+  len += nameLen;
+
+#if defined(ESP32)
+  // The ESP32 sends to the multicast group like to any other address
+  if (mcast.beginPacket(IPAddress(MULTICAST_IP), MULTICAST_PORT)) {
+#else
+  if (mcast.beginPacketMulticast(IPAddress(MULTICAST_IP), MULTICAST_PORT, WiFi.localIP())) {
+#endif
+    mcast.write(frame, len);
+    mcast.endPacket();
+  }
+}
+#endif
+
+#if JOURNAL_TIME > 0
+// -----------------------------------------------------------------------------
+// saveJournal: append the current energy and ON time totals to the journal
+// -----------------------------------------------------------------------------
+void saveJournal() {
+  JournalData jd;
+#if HASPOWERMETER == 1
+  jd.energy = getEnergy();
+#endif
+  jd.onTime = channels[0].onTime.getSeconds();
+  journal.append(jd);
+}
+#endif
+
+// -----------------------------------------------------------------------------
+// Setup. Find out which mode to run and initialize objects
+// -----------------------------------------------------------------------------
+// startNTP: start time synchronisation
+void startNTP() {
+#if defined(ESP32)
+  configTzTime(MY_TZ, MY_NTP_SERVER);
+#if TIMERS == 1 || EVENT_TRACKING == 1
+  // Recompute the timer schedule whenever the time is set
+  sntp_set_time_sync_notification_cb([](struct timeval *tv) { scheduleDirty = true; });
+#endif
+#else
+  configTime(MY_TZ, MY_NTP_SERVER); 
+#if TIMERS == 1 || EVENT_TRACKING == 1
+  // Recompute the timer schedule whenever the time is set
+  settimeofday_cb([]() { scheduleDirty = true; });
+#endif
+#endif
+}
+
+void setup() {
+  uint8_t confcnt = 0;     // count necessary config variables
+
+  // Draw the boot ID from the hardware RNG. 0 is left for "unknown"
+#if defined(ESP32)
+  bootId = esp_random();
+#else
+  bootId = ESP.random();
+#endif
+  if (!bootId) bootId = 1;
+
+  // Define GPIO input/output direction
+  pinMode(SIGNAL_LED, OUTPUT);
+#if defined(POWER_LED)
+  pinMode(POWER_LED, OUTPUT);
+#endif
+  for (uint8_t i = 0; i < NUM_CHANNELS; ++i) {
+    pinMode(relayPins[i], OUTPUT);
+  }
+
+  // initially switch to OFF
+  setRelays(LOW);                  // Relays OFF
+  digitalWrite(SIGNAL_LED, HIGH);  // LED OFF
+#if defined(POWER_LED)
+  digitalWrite(POWER_LED, HIGH);   // LED OFF
+#endif
+
+  // Determine operation mode - normally RUN
+  mode = RUN;
+
+  // Configure EEPROM
+  // EEPROM layout:
+  //   0 : uint16_t magic value
+  //   2 : uint16_t flag word
+  //   4 : float32 Volts adjustment factor (HASPOWERMETER==1)
+  //   8 : float32 Amperes adjustment factor (HASPOWERMETER==1)
+  //  12 : float32 Watts adjustment factor (HASPOWERMETER==1)
+  //  16 : char[PARMLEN] SSID
+  //  16 + PARMLEN : char[PARMLEN] PASS
+  //  16 + 2 * PARMLEN : char[PARMLEN] DEVICENAME
+  //  16 + 3 * PARMLEN : char[PARMLEN] OTA_PWD
+  //  16 + 4 * PARMLEN : Timer_t[NUM_TIMERS] (==O_TIMERS)
+  //  16 + 4 * PARMLEN + NUM_TIMERS * sizeof(Timer_t) : uint16_t auto power off value (mA) (== O_AUTO_PO)
+  //  16 + 4 * PARMLEN + NUM_TIMERS * sizeof(Timer_t) + 2 : uint16_t auto power off check cycles
+  EEPROM.begin(512);
+
+  // Read magic value
+  uint16_t magic;
+  EEPROM.get(0, magic);
 
   // Is it valid (EEPROM was initialized before)?
   if (magic != 0x4711) {
@@ -856,22 +1690,22 @@ void setup() {
     EEPROM.get(8, measures[CURRENT].factor);          // Adjustment factor amperes
     EEPROM.get(12, measures[POWER].factor);           // Adjustment factor watts
     uint16_t addr = 16;
-    strncpy(C_SSID, (const char *)EEPROM.getConstDataPtr() + addr, PARMLEN);
+    strncpy(C_SSID, EEPROM_DATA() + addr, PARMLEN);
     if (EEPROM[addr]) confcnt++;
     addr += PARMLEN;
-    strncpy(C_PWD, (const char *)EEPROM.getConstDataPtr() + addr, PARMLEN);
+    strncpy(C_PWD, EEPROM_DATA() + addr, PARMLEN);
     if (EEPROM[addr]) confcnt++;
     addr += PARMLEN;
-    strncpy(DEVNAME, (const char *)EEPROM.getConstDataPtr() + addr, PARMLEN);
+    strncpy(DEVNAME, EEPROM_DATA() + addr, PARMLEN);
     if (EEPROM[addr]) confcnt++;
     addr += PARMLEN;
-    strncpy(O_PWD, (const char *)EEPROM.getConstDataPtr() + addr, PARMLEN);
+    strncpy(O_PWD, EEPROM_DATA() + addr, PARMLEN);
     if (EEPROM[addr]) confcnt++;
 #if TIMERS == 1
     // get timer values
     for (uint8_t i = 0; i< NUM_TIMERS; ++i) {
       timers[i].activeDays = EEPROM[O_TIMERS + i * sizeof(Timer_t)];
-      timers[i].onOff      = EEPROM[O_TIMERS + i * sizeof(Timer_t) + 1];
+      timers[i].onOff      = EEPROM[O_TIMERS + i * sizeof(Timer_t) + 1] & (ONMASK | TIMER_CHANNELMASK);
       timers[i].hour       = EEPROM[O_TIMERS + i * sizeof(Timer_t) + 2];
       timers[i].minute     = EEPROM[O_TIMERS + i * sizeof(Timer_t) + 3];
     }
@@ -883,6 +1717,27 @@ void setup() {
 #endif
   }
 
+  // NTP and WiFi will be started in the config window with fast boot
+  bool netStarted = false;
+#if FAST_BOOT == 1
+  // Complete configuration?
+  if (confcnt >= 4) {
+    // Yes. Apply the default state at once
+    if (configFlags & 0x0001) {
+#if defined(POWER_LED)
+      digitalWrite(POWER_LED, LOW);
+#endif
+      setRelays(HIGH);
+      bootRelayTime = millis();
+    }
+    // Start NTP
+    startNTP();
+    // Let the association run while we are waiting
+    wifiSetup(DEVNAME);
+    netStarted = true;
+  }
+#endif
+
   // we will wait 3s for button presses to deliberately enter CONFIG mode
   SignalLed.start(KNOBBLINK, 100);
   uint32_t t0 = millis();
@@ -896,15 +1751,31 @@ void setup() {
       confcnt = 0;
       break;
     }
+    // The ESP8266 SDK does the WiFi association and SNTP only while we yield
+    delay(1);
   }
   SignalLed.stop();
 
-  // Start NTP
-  configTime(MY_TZ, MY_NTP_SERVER); 
+  // Did we start the network early?
+  if (netStarted) {
+    // Yes. But CONFIG mode was requested - take it all back
+    if (confcnt == 0) {
+      WiFi.disconnect();
+      wifiState = WS_IDLE;
+#if defined(POWER_LED)
+      digitalWrite(POWER_LED, HIGH);
+#endif
+      setRelays(LOW);
+      bootRelayTime = 0;
+    }
+  } else {
+    // No. Start NTP
+    startNTP();
+  }
 
   // Create AP SSID from flash ID,
   strcpy(APssid, "Socket_XXXXXX");
-  long id = ESP.getChipId();
+  long id = chipId();
   for (uint8_t i = 6; i; i--) {
     char c = (id & 0xf);
     if (c > 9) { c -= 10; c += 'A'; }
@@ -937,14 +1808,20 @@ void setup() {
     server.begin();
   } else {
     // NO, RUN mode.
-    // Connect. Will not terminate if not successful!!!
-    wifiSetup(DEVNAME);
+    // Start connecting, if not done yet. The network task will follow up on it.
+    if (!netStarted) {
+      wifiSetup(DEVNAME);
+    } else if (wifiState != WS_CONNECTED) {
+      // The config window blinking ended - show we are still connecting
+      SignalLed.start(WIFIBLINK, 100);
+    }
 
     digitalWrite(SIGNAL_LED, HIGH);   // make sure LED is OFF
 #if defined(POWER_LED)
     digitalWrite(POWER_LED, HIGH);    // make sure LED is OFF
 #endif
-    Testschalter = false;             // Assume relay is OFF
+    // The channel states are OFF initially - as are the relays, unless FAST_BOOT did switch them on.
+    // The default state will be applied (again) below
 
     // Set flags register
     showFlags = configFlags & CONF_MASK;
@@ -970,13 +1847,22 @@ void setup() {
     fauxmo.setPort(80);               // use HTML port 80
     fauxmo.enable(true);              // get visible.
     fauxmo.addDevice(DEVNAME);        // Set Hue name
+    for (uint8_t i = 1; i < NUM_CHANNELS; ++i) {
+      // The other channels are named DEVNAME-2 etc.
+      char chName[PARMLEN + 4];
+      snprintf(chName, sizeof(chName), "%s-%u", DEVNAME, (unsigned int)(i + 1));
+      fauxmo.addDevice(chName);
+    }
     fauxmo.onSetState(SetState_F);    // link to switch callback
-    fauxmo.setState(DEVNAME, false, (uint8_t)255);      // set OFF state
+    for (uint8_t i = 0; i < NUM_CHANNELS; ++i) {
+      fauxmo.setState(i, false, (uint8_t)255);      // set OFF state
+    }
 #endif
 
     // ArduinoOTA setup
     ArduinoOTA.setHostname(DEVNAME);  // Set OTA host name
     ArduinoOTA.setPassword((const char *)O_PWD);  // Set OTA password
+    ArduinoOTA.onStart([]() { persister.flush(); SAVE_JOURNAL(); });  // Save pending changes before updating
     ArduinoOTA.begin();               // start OTA scan
 
 #if HASPOWERMETER == 1
@@ -986,10 +1872,17 @@ void setup() {
     pinMode(SEL_PIN, OUTPUT);
     digitalWrite(SEL_PIN, HIGH);
 
-    accumulatedWatts = 0.0;
+    // Get the fixed point scale factors from the correction factors
+    setScale(VOLTAGE);
+    setScale(CURRENT);
+    setScale(POWER);
+    resetEnergy();
 
+#if METER_TASK == 0
+    // With METER_TASK the meter task will attach the interrupts to its own core
     attachInterrupt(digitalPinToInterrupt(CF1_PIN), CF1Tick, RISING);
     attachInterrupt(digitalPinToInterrupt(CF_PIN), CF_Tick, RISING);
+#endif
 
 #endif
 
@@ -999,7 +1892,12 @@ void setup() {
     MBserver.registerWorker(1, WRITE_HOLD_REGISTER, &FC06);
 #if HASPOWERMETER == 1
     MBserver.registerWorker(1, USER_DEFINED_43, &FC43);
+    MBserver.registerWorker(1, USER_DEFINED_44, &FC44);
 #endif
+#if EVENT_TRACKING == 1
+    MBserver.registerWorker(1, USER_DEFINED_45, &FC45);
+#endif
+    MBserver.registerWorker(1, USER_DEFINED_46, &FC46);
 #if TIMERS == 1
     MBserver.registerWorker(1, WRITE_MULT_REGISTERS, &FC10);
 #endif
@@ -1009,8 +1907,21 @@ void setup() {
 #endif
     
     upTime.start(update_interval);
-    stateTime.start(update_interval);
-    onTime.start(update_interval);
+    for (uint8_t i = 0; i < NUM_CHANNELS; ++i) {
+      channels[i].stateTime.start(update_interval);
+      channels[i].onTime.start(update_interval);
+    }
+
+#if JOURNAL_TIME > 0
+    // Restore the totals from the journal
+    JournalData jd;
+    if (journal.begin(jd)) {
+#if HASPOWERMETER == 1
+      energyBase = jd.energy;
+#endif
+      channels[0].onTime.setSeconds(jd.onTime);
+    }
+#endif
   }
 #if TELNET_LOG == 1
   // Init telnet server
@@ -1031,256 +1942,762 @@ void setup() {
 
   // Default ON?
   if (configFlags & 0x0001) {
-    SetState(0, DEVNAME, true, 255);
+    for (uint8_t i = 0; i < NUM_CHANNELS; ++i) {
+      SetState(i, DEVNAME, true, 255);
+    }
     EVENT(DEFAULT_ON);
+    if (!bootRelayTime) bootRelayTime = millis();
   }
 
+  // Initial Modbus register contents
+  REFRESH_REGS();
+
+  // Register the tasks for the mode we are in
+  setupTasks();
 }
 
 #if HASPOWERMETER == 1
-// getFrequency: blocking function to sample power meter data
-void getFrequency(unsigned long int& cf, unsigned long int& cf1) {
-  // Disable interrupts
-  cli();
-  // Init counters
-  CF_tick = 0;
-  CF1tick = 0;
-  // Enable interrupts
-  sei();
-  // count for 1000 msec
-  delay(1000);
+// setScale: precompute the fixed point scale factor for a measure from its correction factor.
+// This is the only place where floating point math is done for the meter.
+void setScale(uint8_t type) {
+  const double units[3] = { BL_VOLTS, BL_AMPS, BL_WATTS };
+  // Factor out of range? Values from an older EEPROM may be anything
+  if (!(measures[type].factor >= FACTOR_MIN && measures[type].factor <= FACTOR_MAX)) {
+    // Yes. Saturate it, garbage (NaN) falls back to no correction at all
+    if (measures[type].factor > FACTOR_MAX) measures[type].factor = FACTOR_MAX;
+    else if (measures[type].factor > 0.0) measures[type].factor = FACTOR_MIN;
+    else measures[type].factor = 1.0;
+  }
+  measures[type].scale = (uint32_t)(units[type] * measures[type].factor * (1UL << SCALE_SHIFT) + 0.5);
+  if (type == POWER) {
+    // Energy is in mWh, a pulse is BL_WATTS * factor Ws = BL_WATTS * factor / 3.6 mWh
+    // Fold in the pulses counted so far with the previous factor
+    energyBase += (energyPulses * energyScale) >> SCALE_SHIFT;
+    energyPulses = 0;
+    energyScale = (uint32_t)(BL_WATTS * measures[POWER].factor / 3.6 * (1UL << SCALE_SHIFT) + 0.5);
+  }
+}
+
+// setMeasure: calculate a measured value from a pulse frequency in mHz
+inline void setMeasure(uint8_t type, uint32_t mHz) {
+  METER_VALUE(type) = ((uint64_t)mHz * measures[type].scale) >> SCALE_SHIFT;
+}
+
+// energyNow: spent energy in mWh, as counted by the meter
+uint64_t energyNow() {
+  return energyBase + ((energyPulses * energyScale) >> SCALE_SHIFT);
+}
+
+// getEnergy: spent energy in mWh
+uint64_t getEnergy() {
+#if METER_TASK == 1
+  // The counters are the meter task's - take the latest value it did hand over
+  return sampleEnergy;
+#else
+  return energyNow();
+#endif
+}
+
+// countEnergy: take over the CF pulses counted since the last call
+void countEnergy() {
+  unsigned long int tick = CF_tick;
+  energyPulses += tick - energyTick;
+  energyTick = tick;
+}
+
+// quantise: limit a value to 16 bits after scaling it down
+inline uint16_t quantise(uint32_t v, uint32_t div) {
+  v /= div;
+  return (v > 0xFFFF) ? 0xFFFF : v;
+}
+
+// updateHistory: add a sample of the current values and maintain the rollups
+void updateHistory() {
+  static uint16_t samples = 0;      // Samples in the current minute
+  static uint8_t minutes = 0;       // Minutes in the current hour
+  uint64_t e = getEnergy();
+
+  // First call?
+  if (histTime[0] == 0 && histSamples.empty()) {
+    minuteAcc.start(e);
+    hourAcc.start(e);
+  }
+
+  Sample sm;
+  sm.volts = quantise(measures[VOLTAGE].measured, 100);
+  sm.amps = quantise(measures[CURRENT].measured, 1);
+  sm.watts = quantise(measures[POWER].measured, 100);
+  histSamples.push_back(sm);
+  histTime[0] = time(NULL);
+  minuteAcc.add(sm.watts, sm.watts, sm.watts);
+
+  // Minute complete?
+  if (++samples >= SAMPLES_PER_MINUTE) {
+    // Yes. Close it and add it to the hour
+    Rollup r = minuteAcc.close(e);
+    histMinutes.push_back(r);
+    histTime[1] = histTime[0];
+    hourAcc.add(r.minW, r.avgW, r.maxW);
+    minuteAcc.start(e);
+    samples = 0;
+    // Hour complete?
+    if (++minutes >= 60) {
+      // Yes. Close that as well
+      histHours.push_back(hourAcc.close(e));
+      histTime[2] = histTime[0];
+      hourAcc.start(e);
+      minutes = 0;
+    }
+  }
+}
+
+// resetEnergy: start over with the energy count
+void resetEnergy() {
+  meterCommand(MC_RESET);
+  REFRESH_REGS();
+}
+
+// meterCommand: have the meter reset the energy count (MC_RESET) or take a changed factor (MC_SCALE | type)
+void meterCommand(uint8_t cmd) {
+#if METER_TASK == 1
+  // The meter task will do it on its next turn
+  if (meterTask) {
+    if (cmd == MC_RESET) {
+      resetsSent++;
+      sampleEnergy = 0;
+    }
+    meterCommands.push_back(cmd);
+    return;
+  }
+#endif
+  meterApply(cmd);
+}
+
+// meterApply: execute a meter command. This is done in the meter task, if there is one
+void meterApply(uint8_t cmd) {
+  if (cmd == MC_RESET) {
+    countEnergy();
+    energyBase = 0;
+    energyPulses = 0;
+  } else {
+    setScale(cmd & 0x03);
+  }
+}
+
+// checkAutoOff: count the updates with a current below aoAmps. Returns true if it is time to switch off
+bool checkAutoOff(uint32_t mA) {
+  // Is it activated at all?
+  if (channels[0].state && aoAmps && aoCycles) {
+    // Yes. Is the current below the threshold?
+    if (mA < aoAmps) {
+      // Yes. Did we reach the necessary cycle count?
+      if (aoCount >= aoCycles) {
+        // Yes. Switch off
+        aoCount = 0;
+        return true;
+      }
+      // No, count up while we are below aoCycles (else we may overflow)
+      if (aoCount < aoCycles) {
+        aoCount++;
+      }
+#if METER_TASK == 0
+      LOG_V("aoCOunt: %u, aoCycles: %u, aoAmps: %u\n", aoCount, aoCycles, aoAmps);
+#endif
+    } else {
+      // No. We may init the cycle count again.
+      aoCount = 0;
+    }
+  } else {
+    // always init auto power cycle - else it may be continued after manual/Modbus switch ON
+    aoCount = 0;
+  }
+  return false;
+}
+
+#if METER_PERIOD == 1
+// resetTrack: forget all periods of a PulseTrack
+void resetTrack(PulseTrack& t) {
+  t.queue.clear();
+  t.head = t.count = 0;
+  t.sum = 0;
+  t.skip = true;
+  t.resetTime = micros();
+}
+
+// drainTrack: move the periods queued by the interrupt functions into the averaging ring
+void drainTrack(PulseTrack& t) {
+  while (!t.queue.empty()) {
+    uint32_t period = t.queue[0];
+    t.queue.pop(1);
+    // Period started before the last reset?
+    if (t.skip) {
+      // Yes. Ignore it
+      t.skip = false;
+    // Was it too long to be sensible?
+    } else if (period > SAMPLE_TIME * 1000UL) {
+      // Yes. There was no load before, so start over
+      t.head = t.count = 0;
+      t.sum = 0;
+    } else {
+      // No, add it to the ring, replacing the oldest, if the ring is full
+      if (t.count == NUM_PERIODS) {
+        t.sum -= t.periods[t.head];
+      } else {
+        t.count++;
+      }
+      t.periods[t.head] = period;
+      t.sum += period;
+      t.head = (t.head + 1) % NUM_PERIODS;
+    }
+  }
+}
+
+// periodFrequency: get the frequency f in mHz from the periods recorded in a PulseTrack
+// minPeriods: number of periods needed for a valid value
+// Returns true if f was set - either because enough periods were found or because there
+// were no pulses for SAMPLE_TIME, making f zero
+bool periodFrequency(PulseTrack& t, uint8_t minPeriods, uint32_t& f) {
+  uint32_t now = micros();
+  // Time since the latest pulse, but not before the last reset
+  uint32_t since = now - t.lastPulse;
+  if (since > now - t.resetTime) since = now - t.resetTime;
+
+  // Pulses stopped?
+  if (since > SAMPLE_TIME * 1000UL) {
+    // Yes. Nothing measurable
+    f = 0;
+    return true;
+  }
+  // Enough periods?
+  if (t.count < minPeriods || t.count == 0) {
+    // No.
+    return false;
+  }
+  // If the latest pulse is overdue, the frequency has dropped below the average already
+  if (since > 2 * (t.sum / t.count)) {
+    f = 1000000000UL / since;
+  } else {
+    f = (t.count * 1000000000ULL) / t.sum;
+  }
+  return true;
+}
+
+// updatePeriods: refresh measured values from the pulse periods.
+// Power is tracked continuously, voltage and current are alternating as soon as NUM_PERIODS
+// periods have been seen or SAMPLE_TIME has passed since the SEL pin was toggled
+void updatePeriods() {
+  StatScope timing(stats[ST_METER]);
+  static bool select = false;              // Toggle for voltage/current
+  static uint32_t lastUpdate = 0;          // Last time values were calculated
+  static uint32_t halfStart = 0;           // Last time SEL_PIN was toggled
+  uint32_t f;
+
+  // Collect the periods the interrupt functions have seen
+  drainTrack(CF_track);
+  drainTrack(CF1track);
+
+  if (millis() - lastUpdate < PERIOD_UPDATE) return;
+  lastUpdate = millis();
+
+  // Power first - any valid period is fine
+  if (periodFrequency(CF_track, 1, f)) {
+    setMeasure(POWER, f);
+  }
+
+  // Do we have enough periods on CF1?
+  bool valid = periodFrequency(CF1track, NUM_PERIODS, f);
+  // No. Has the time for this half passed?
+  if (!valid && (millis() - halfStart) >= SAMPLE_TIME) {
+    // Yes. Take what we have, if anything
+    if (!periodFrequency(CF1track, 1, f)) f = 0;
+    valid = true;
+  }
+
+  if (valid) {
+    // Did we read current?
+    if (select) {
+      // Yes. Calculate amps and toggle SEL pin to read the other value next
+      setMeasure(CURRENT, f);
+      digitalWrite(SEL_PIN, HIGH);
+      select = false;
+    } else {
+      // No. Calculate volts and toggle SEL pin to read the other value next
+      setMeasure(VOLTAGE, f);
+      digitalWrite(SEL_PIN, LOW);
+      select = true;
+    }
+    // Periods seen before the toggle are invalid now
+    resetTrack(CF1track);
+    halfStart = millis();
+  }
+}
+#else
+// startSample: open a new sampling window by taking a snapshot of the counters
+void startSample() {
   // Disable interrupts
-  cli();
-  // save counters
-  cf = CF_tick;
-  cf1 = CF1tick;
+  METER_LOCK();
+  // Take start values
+  meterWindow.cfStart = CF_tick;
+  meterWindow.cf1Start = CF1tick;
+  meterWindow.startMicros = micros();
   // Enable interrupts
-  sei();
+  METER_UNLOCK();
+  meterWindow.startMillis = millis();
+  meterWindow.state = SW_RUNNING;
+}
+
+// checkSample: close a running window once SAMPLE_TIME has passed.
+// Returns true if a finished window is waiting to be processed
+bool checkSample() {
+  // Is a window running and due to be closed?
+  if (meterWindow.state == SW_RUNNING && (millis() - meterWindow.startMillis) >= SAMPLE_TIME) {
+    // Yes. Disable interrupts
+    METER_LOCK();
+    // Take end values
+    unsigned long int cf = CF_tick - meterWindow.cfStart;
+    unsigned long int cf1 = CF1tick - meterWindow.cf1Start;
+    uint32_t elapsed = micros() - meterWindow.startMicros;
+    // Enable interrupts
+    METER_UNLOCK();
+    // We may have been called late - get the pulse rates for the real window length, rounded
+    if (!elapsed) elapsed = 1;
+    meterWindow.cf = (cf * 1000000000ULL + elapsed / 2) / elapsed;
+    meterWindow.cf1 = (cf1 * 1000000000ULL + elapsed / 2) / elapsed;
+    meterWindow.state = SW_DONE;
+  }
+  return meterWindow.state == SW_DONE;
 }
 
 void updateEnergy() {
+  StatScope timing(stats[ST_METER]);
   static bool select = false;              // Toggle for voltage/current
-  unsigned long int cf;                    // CF read value (power pulse length)
-  unsigned long int cf1;                   // CF1 read value (voltage/current pulse length)
-
-  // Read pulse lengths. Note: reading takes 1s blocking time!
-  getFrequency(cf, cf1);
+  // Take the pulse counts of the finished sampling window
+  uint32_t cf = meterWindow.cf;            // CF frequency (power)
+  uint32_t cf1 = meterWindow.cf1;          // CF1 frequency (voltage/current)
+  meterWindow.state = SW_IDLE;
 
-  // Calculate watts according the BL 0937 specs
-  measures[POWER].measured = cf ? (cf * 1.218 * 1.218 * 2.0) / 1.721506 * measures[POWER].factor : 0.0;
+  // Calculate watts
+  setMeasure(POWER, cf);
 
   // Did we read current?
   if (select) {
-    // Yes. Calculate amps according to specs
-    measures[CURRENT].measured = cf1 ? ((cf1 * 1.218) / 94638.0 * 1000.0) * measures[CURRENT].factor : 0.0;
+    // Yes. Calculate amps
+    setMeasure(CURRENT, cf1);
     // Toggle SEL pin to read the other value next time around
     digitalWrite(SEL_PIN, HIGH);
     select = false;
   } else {
-    // No. Calculate volts according to specs
-    measures[VOLTAGE].measured = cf1 ? ((cf1 * 1.218) / 15397.0 * 2001.0) * measures[VOLTAGE].factor : 0.0;
+    // No. Calculate volts
+    setMeasure(VOLTAGE, cf1);
     // Toggle SEL pin to read the other value next time around
     digitalWrite(SEL_PIN, LOW);
     select = true;
   }
 }
+#endif
 #endif 
 
 // -----------------------------------------------------------------------------
-// Main loop
+// Tasks of the main loop. Each is called by the scheduler only when due.
 // -----------------------------------------------------------------------------
-void loop() {
-#if TELNET_LOG == 1
-  static uint8_t oneTime = 8;
-#endif
+// taskOTA: check for OTA update requests
+void taskOTA(uint32_t now) {
+  ArduinoOTA.handle();
+}
 
-  static uint32_t last = millis();   // Last time updates were made
+// taskLED: update blinking LED, if any
+void taskLED(uint32_t now) {
+  SignalLed.update(now);
+}
+
+// taskButton: update button state and act on button events
+void taskButton(uint32_t now) {
+  button.update(now);
+
+  // Button events are used in RUN mode only
+  if (mode != RUN) return;
+
+  ButtonEvent be = button.getEvent();
+  // Any button action will commit EEPROM changes at once
+  if (be != BE_NONE && persister.flush()) {
+    REFRESH_REGS();
+  }
+  // If button clicked, toggle Relay/LED
+  if (be == BE_CLICK) {
+    SetState(0, DEVNAME, !channels[0].state, 255);
+    EVENT(channels[0].state ? BUTTON_ON : BUTTON_OFF);
 #if TIMERS == 1
-  static uint32_t lastTimerCheck = millis(); // Last time the timers were checked
+  // if held down, disarm all timers
+  } else if (be == BE_PRESS) {
+    for (uint8_t i = 0; i < NUM_TIMERS; ++i) {
+      timers[i].activeDays &= DAYMASK;
+    }
+    scheduleDirty = true;
+    REFRESH_REGS();
 #endif
+  }
+}
 
-  // Check for OTA update requests
-  ArduinoOTA.handle();
+// taskNetwork: keep WiFi connected and mDNS running
+void taskNetwork(uint32_t now) {
+  wifiUpdate(DEVNAME, now);
+#if !defined(ESP32)
+  // The ESP32 mDNS responder runs by itself
+  if (wifiState == WS_CONNECTED) {
+    MDNS.update();
+  }
+#endif
+}
 
-  // Update blinking LED, if any
-  SignalLed.update();
+#if FAUXMO_ACTIVE == 1
+// taskFauxmo: check Hue requests
+void taskFauxmo(uint32_t now) {
+  fauxmo.handle();
+}
+#endif
 
-  // Update button state
-  button.update();
+// taskPersist: commit EEPROM changes after the quiet period
+void taskPersist(uint32_t now) {
+  if (persister.update()) {
+    REFRESH_REGS();
+  }
+}
 
-  // RUN mode?
-  if (mode == RUN) {
-    // Check if WiFi was lost
-    if (WiFiNeedsReconnect) {
-      wifiSetup(DEVNAME);
-    }
+#if HASPOWERMETER == 1
+#if METER_TASK == 1
+// -----------------------------------------------------------------------------
+// The meter task, running on METER_CORE
+// -----------------------------------------------------------------------------
+uint8_t resetsDone = 0;       // Number of MC_RESET commands executed
+
+// publishSample: hand the latest values over to loop()
+void publishSample() {
+  countEnergy();
+  MeterSample ms;
+  for (uint8_t i = 0; i < 3; ++i) {
+    ms.measured[i] = meterValues[i];
+  }
+  ms.energy = energyNow();
+  ms.resets = resetsDone;
+  ms.autoOff = checkAutoOff(meterValues[CURRENT]);
+  // Queue full? Then loop() is stuck and the sample is lost. A pending auto off will be tried again
+  if (!meterSamples.push_back(ms) && ms.autoOff) {
+    aoCount = aoCycles;
+  }
+}
 
-#if FAUXMO_ACTIVE == 1
-    // YES. Check Hue requests.
-    fauxmo.handle();
+// meterLoop: sample the meter and publish the values every update_interval
+void meterLoop(void *) {
+  // Attach the interrupts from here, so they are served on this core
+  attachInterrupt(digitalPinToInterrupt(CF1_PIN), CF1Tick, RISING);
+  attachInterrupt(digitalPinToInterrupt(CF_PIN), CF_Tick, RISING);
+#if METER_PERIOD == 1
+  uint32_t lastUpdate = millis();
+#else
+  TickType_t wake = xTaskGetTickCount();
 #endif
-    
-    // Keep mDNS running
-    MDNS.update();
 
-    ButtonEvent be = button.getEvent();
-    // If button clicked, toggle Relay/LED
-    if (be == BE_CLICK) {
-      SetState(0, DEVNAME, !Testschalter, 255);
-      EVENT(Testschalter ? BUTTON_ON : BUTTON_OFF);
-#if TIMERS == 1
-    // if held down, disarm all timers
-    } else if (be == BE_PRESS) {
-      for (uint8_t i = 0; i < NUM_TIMERS; ++i) {
-        timers[i].activeDays &= DAYMASK;
-      }
+  while (true) {
+    // Execute the commands sent meanwhile
+    uint8_t cmd;
+    while (meterCommands.safeCopy(&cmd, 1, true)) {
+      if (cmd == MC_RESET) resetsDone++;
+      meterApply(cmd);
+    }
+#if METER_PERIOD == 1
+    // Keep the measured values fresh
+    updatePeriods();
+    if (millis() - lastUpdate >= update_interval) {
+      lastUpdate += update_interval;
+      publishSample();
+    }
+    vTaskDelay(pdMS_TO_TICKS(METER_POLL));
+#else
+    // One sampling window per update. The window is closed on time without polling, as nothing
+    // else is running on this core to delay us
+    startSample();
+    vTaskDelay(pdMS_TO_TICKS(SAMPLE_TIME));
+    while (!checkSample()) {
+      vTaskDelay(1);
+    }
+    updateEnergy();
+    publishSample();
+    vTaskDelayUntil(&wake, pdMS_TO_TICKS(update_interval));
+#endif
+  }
+}
 #endif
+
+// taskMeter: keep the measurements going
+void taskMeter(uint32_t now) {
+#if METER_TASK == 1
+  // Take over the samples the meter task has sent
+  MeterSample ms;
+  bool fresh = false;
+  while (meterSamples.safeCopy(&ms, 1, true)) {
+    for (uint8_t i = 0; i < 3; ++i) {
+      measures[i].measured = ms.measured[i];
+    }
+    // An energy count from before the latest reset is outdated
+    if (ms.resets == resetsSent) {
+      sampleEnergy = ms.energy;
+    }
+    // Auto off condition met?
+    if (ms.autoOff && channels[0].state) {
+      // Yes. Switch off
+      SetState(0, DEVNAME, false, 255);
+      registerEvent(AUTOOFF);
     }
+    fresh = true;
+  }
+  // Have the update run with the fresh values
+  if (fresh) {
+    sched.runAt(tUpdate, now);
+  }
+#elif METER_PERIOD == 1
+  // Keep the measured values fresh
+  updatePeriods();
+#else
+  // Sampling window not open yet?
+  if (meterWindow.state == SW_IDLE) {
+    // Open it and come back when it is due to be closed
+    startSample();
+    sched.runAt(tMeter, now + SAMPLE_TIME);
+  // Close the window if its time has come
+  } else if (checkSample()) {
+    // Done. Have the update run with the fresh values, then open the next window early enough
+    // to have it finished when the next update is due
+    sched.runAt(tUpdate, now);
+    sched.runAt(tMeter, now + update_interval - SAMPLE_TIME);
+  } else {
+    // Not yet - try again a bit later
+    sched.runAt(tMeter, now + METER_POLL);
+  }
+#endif
+}
+#endif
 
-    // New read due?
-    if ((millis() - last) > update_interval) {
+// taskUpdate: read the meter, count up times and report
+void taskUpdate(uint32_t now) {
 #if TELNET_LOG == 1
-      if (oneTime) {
-        oneTime--;
-        if (!oneTime) {
-          HEXDUMP_D("EEPROM", EEPROM.getConstDataPtr(), EEPROM.length());
-        }
-      }
+  static uint8_t oneTime = 8;
+
+  if (oneTime) {
+    oneTime--;
+    if (!oneTime) {
+      HEXDUMP_D("EEPROM", (const uint8_t *)EEPROM_DATA(), EEPROM.length());
+    }
+  }
 #endif
 #if HASPOWERMETER == 1
-      unsigned long int calcLast = millis() - last;
+#if METER_TASK == 0
+#if METER_PERIOD == 0
+  // Read energy meter.
+  updateEnergy();
+#endif
+  // Add up the energy pulses
+  countEnergy();
+#endif
+  // Keep the history up to date
+  updateHistory();
+#if METER_TASK == 0
+  // Check for auto power off condition
+  if (checkAutoOff(measures[CURRENT].measured)) {
+    SetState(0, DEVNAME, !channels[0].state, 255);
+    registerEvent(AUTOOFF);
+  }
 #endif
-      last = millis();
-#if HASPOWERMETER == 1
-      // Read energy meter.
-      updateEnergy();
-      accumulatedWatts += measures[POWER].measured * calcLast / 3600000.0;
-      // Check for auto power off condition
-      // Is it activated at all?
-      if (Testschalter && aoAmps && aoCycles) {
-        // Yes. Is the current below the threshold?
-        if (measures[CURRENT].measured < (aoAmps / 1000.0)) {
-          // Yes. Did we reach the necessary cycle count?
-          if (aoCount >= aoCycles) {
-            // Yes. Switch off
-            SetState(0, DEVNAME, !Testschalter, 255);
-            registerEvent(AUTOOFF);
-            aoCount = 0;
-          } else {
-            // No, count up while we are below aoCycles (else we may overflow)
-            if (aoCount < aoCycles) {
-              aoCount++;
-            }
-            LOG_V("aoCOunt: %u, aoCycles: %u, aoAmps: %u\n", aoCount, aoCycles, aoAmps);
-          }
-        } else {
-          // No. We may init the cycle count again.
-          aoCount = 0;
-        }
-      } else {
-        // always init auto power cycle - else it may be continued after manual/Modbus switch ON
-        aoCount = 0;
-      }
 #endif
-      // Count up timers
-      upTime.count();
-      stateTime.count();
-      // onTime only counted for switch state == ON
-      // GOSUND_SP1 devices additionally will watch current to state ON
-      if (Testschalter) { 
+  // Count up timers
+  upTime.count();
+  for (uint8_t i = 0; i < NUM_CHANNELS; ++i) {
+    Channel& ch = channels[i];
+    ch.stateTime.count();
+    // onTime only counted for switch state == ON
+    // GOSUND_SP1 devices additionally will watch current to state ON
+    if (ch.state) { 
 #if HASPOWERMETER == 1
-        if (measures[CURRENT].measured > 0.0)
+      if (measures[CURRENT].measured > 0)
+#endif
+      ch.onTime.count(); 
+    }
+  }
+  // Keep the heap watermarks
+  checkHeap();
+
+  // Fresh data for Modbus
+  REFRESH_REGS();
+
+#if MULTICAST_PUSH == 1
+  // Tell the collectors
+  if (wifiState == WS_CONNECTED) {
+    sendFrame();
+  }
 #endif
-        onTime.count(); 
-      }
 
 #if TELNET_LOG == 1
-      // Output only if a client is connected
-      if (tl.isActive()) {
-        time_t now = time(NULL);
-        tm tm;
-        localtime_r(&now, &tm);           // update the structure tm with the current time
-        // Write data to the telnet client(s), if any
-        tl.printf("%02d:%02d:%02d %3s %d:%02d:%02d | Run %d:%02d:%02d | ON %d:%02d:%02d\n",
-          tm.tm_hour,
-          tm.tm_min,
-          tm.tm_sec,
-          Testschalter ? "ON" : "OFF",
-          stateTime.getHour(),
-          stateTime.getMinute(),
-          stateTime.getSecond(),
-          upTime.getHour(),
-          upTime.getMinute(),
-          upTime.getSecond(),
-          onTime.getHour(),
-          onTime.getMinute(),
-          onTime.getSecond());
+  // Output only if a client is connected
+  if (tl.isActive()) {
+    time_t t = time(NULL);
+    tm tm;
+    localtime_r(&t, &tm);           // update the structure tm with the current time
+    // Write data to the telnet client(s), if any
+    // Deferred logging: the text will be formatted only when sent to the client(s)
+    tl.logf(PSTR("%02d:%02d:%02d %3s %d:%02d:%02d | Run %d:%02d:%02d | ON %d:%02d:%02d\n"),
+      tm.tm_hour,
+      tm.tm_min,
+      tm.tm_sec,
+      channels[0].state ? "ON" : "OFF",
+      channels[0].stateTime.getHour(),
+      channels[0].stateTime.getMinute(),
+      channels[0].stateTime.getSecond(),
+      upTime.getHour(),
+      upTime.getMinute(),
+      upTime.getSecond(),
+      channels[0].onTime.getHour(),
+      channels[0].onTime.getMinute(),
+      channels[0].onTime.getSecond());
 #if HASPOWERMETER == 1
-        tl.printf("   | %6.2f V| %8.2f W| %5.2f A| %8.2f Wh|\n", 
-          measures[VOLTAGE].measured, 
-          measures[POWER].measured, 
-          measures[CURRENT].measured, 
-          accumulatedWatts); 
+    tl.logf(PSTR("   | %6.2f V| %8.2f W| %5.2f A| %8.2f Wh|\n"), 
+      measures[VOLTAGE].measured / 1000.0, 
+      measures[POWER].measured / 1000.0, 
+      measures[CURRENT].measured / 1000.0, 
+      getEnergy() / 1000.0); 
 #endif
-      }
+  }
 #endif
-    }
+}
 
-    // Is it time to check the timers?
-    if ((millis() - lastTimerCheck) > TIMER_UPDATE_INTERVAL) {
-      // Yes. Get day of week, hour and minute for comparisons
-      time_t now = time(NULL);
-      struct tm *tmData = localtime(&now);
-      uint8_t cHour = tmData->tm_hour;          // 0..23
-      uint8_t cMinute = tmData->tm_min;         // 0..59
-      uint8_t cWday = 1 << tmData->tm_wday;     // 0=Sunday
+#if JOURNAL_TIME > 0
+// taskJournal: write the journal
+void taskJournal(uint32_t now) {
+  saveJournal();
+}
+#endif
 
+#if TIMERS == 1 || EVENT_TRACKING == 1
+// taskTimers: check timers and day change
+void taskTimers(uint32_t ms) {
+  // Timers changed or time set anew?
+  if (scheduleDirty) {
+    // Yes. Get the next deadline
+    buildSchedule(time(NULL));
+  }
+
+  // Is a timer or the day change due?
+  time_t now = time(NULL);
+  if (nextDeadline && now >= nextDeadline) {
 #if TIMERS == 1
-      // Get switch state for comparisons
-      uint8_t cOnOff = Testschalter ? ONMASK : 0;
-      
-      // Now loop over timers to find one active and due to fire
-      for (uint8_t i = 0; i < NUM_TIMERS; ++i) {
-        // Is it active?
-        if (timers[i].activeDays & ACTIVEMASK) {
-          // Yes. Is it due?
-          if (timers[i].activeDays & cWday 
-           && timers[i].hour == cHour 
-           && timers[i].minute == cMinute) {
-            // Yes. Is the switch in the right state already?
-            if (timers[i].onOff != cOnOff) {
-              // No, we need to switch it
-              SetState(0, DEVNAME, !Testschalter, 255);
-              EVENT(Testschalter ? TIMER_ON : TIMER_OFF);
+    // Yes. Loop over the timers due to find one per channel that needs to switch
+    uint8_t switched = 0;     // One bit per channel switched already
+    for (uint8_t k = 0; k < schedCount && schedule[k].when <= now; ++k) {
+      uint8_t i = schedule[k].timer;
+      uint8_t c = RM_timerChannel(timers[i].onOff);
+      // Timer for a channel we do not have, or one that was switched already?
+      if (c >= NUM_CHANNELS || (switched & (1 << c))) continue;
+      // No. Is the switch in the right state already?
+      if ((timers[i].onOff & ONMASK) != (channels[c].state ? ONMASK : 0)) {
+        // No, we need to switch it
+        SetState(c, DEVNAME, !channels[c].state, 255);
+        EVENT(channels[c].state ? TIMER_ON : TIMER_OFF);
 #if TELNET_LOG == 1
-              tl.printf("Timer %d fired (%s %02X %02d:%02d)\n", 
-                i + 1,
-                timers[i].onOff ? "ON" : "OFF",
-                timers[i].activeDays,
-                timers[i].hour,
-                timers[i].minute);
-#endif
-              // There may be other timers also due, but the first rules!
-              break;
-            }
-          }
-        }
+        tl.logf(PSTR("Timer %d fired (%s %02X %02d:%02d)\n"), 
+          i + 1,
+          (timers[i].onOff & ONMASK) ? "ON" : "OFF",
+          timers[i].activeDays,
+          timers[i].hour,
+          timers[i].minute);
+#endif
+        // There may be other timers also due for this channel, but the first rules!
+        switched |= 1 << c;
+        if (switched == (1 << NUM_CHANNELS) - 1) break;
       }
+    }
 #endif
 
 #if EVENT_TRACKING == 1
-      // Are we passing midnight?
-      if (cHour == 0 && cMinute == 0) {
-        // Yes. Register event
-        EVENT(DATE_CHANGE);
-      }
-#endif
-      lastTimerCheck = millis();
+    // Are we passing midnight?
+    if (now >= nextMidnight) {
+      // Yes. Register event
+      EVENT(DATE_CHANGE);
     }
+#endif
+    // Find the next deadline after this one
+    buildSchedule(now + 1);
+  }
+}
+#endif
+
+// taskWeb: config mode. Keep the web server active
+void taskWeb(uint32_t now) {
+  server.handleClient();
+}
 
-  // No, config mode. Keep the web server active
+// setupTasks: register the tasks of loop() with the scheduler
+void setupTasks() {
+  sched.add("ota", taskOTA, OTA_PERIOD);
+  sched.add("led", taskLED, LED_PERIOD);
+  sched.add("button", taskButton, BUTTON_PERIOD);
+
+  // RUN mode?
+  if (mode == RUN) {
+    // Yes.
+    sched.add("network", taskNetwork, NETWORK_PERIOD);
+#if FAUXMO_ACTIVE == 1
+    sched.add("fauxmo", taskFauxmo, FAUXMO_PERIOD);
+#endif
+    sched.add("persist", taskPersist, PERSIST_PERIOD);
+#if HASPOWERMETER == 1
+#if METER_TASK == 1
+    // Start the meter task. From now on it owns the energy count
+    sampleEnergy = energyNow();
+    xTaskCreatePinnedToCore(meterLoop, "meter", METER_STACK, nullptr, METER_PRIO, &meterTask, METER_CORE);
+    // loop() only takes over the samples and has the update run with them
+    tMeter = sched.add("meter", taskMeter, SAMPLE_POLL);
+    tUpdate = sched.add("update", taskUpdate, 0);
+    sched.stop(tUpdate);
+#elif METER_PERIOD == 1
+    tMeter = sched.add("meter", taskMeter, METER_POLL);
+    tUpdate = sched.add("update", taskUpdate, update_interval, update_interval);
+#else
+    // The meter task will open the first window to have it done at the first update
+    tMeter = sched.add("meter", taskMeter, 0, update_interval - SAMPLE_TIME);
+    // The update task has no period, the meter task will trigger it
+    tUpdate = sched.add("update", taskUpdate, 0);
+    sched.stop(tUpdate);
+#endif
+#else
+    tUpdate = sched.add("update", taskUpdate, update_interval, update_interval);
+#endif
+#if JOURNAL_TIME > 0
+    sched.add("journal", taskJournal, JOURNAL_TIME * 60000UL, JOURNAL_TIME * 60000UL);
+#endif
+#if TIMERS == 1 || EVENT_TRACKING == 1
+    sched.add("timers", taskTimers, TIMER_PERIOD);
+#endif
   } else {
-    server.handleClient();
+    // No, config mode. Only the web server is needed
+    sched.add("web", taskWeb, WEB_PERIOD);
+  }
+}
+
+// -----------------------------------------------------------------------------
+// Main loop
+// -----------------------------------------------------------------------------
+void loop() {
+  // Run all tasks due
+  uint32_t idle;
+  {
+    // The Modbus workers have to wait until the tasks are done
+    APP_LOCK();
+    StatScope timing(stats[ST_LOOP]);
+    idle = sched.run();
+  }
+
+  // Nothing to do for a while? Leave the time to the system until the next task is due.
+  // delay() will yield and lets the WiFi modem sleep meanwhile.
+  if (idle) {
+    delay((idle > MAX_IDLE) ? MAX_IDLE : idle);
   }
 }
 
@@ -1288,10 +2705,12 @@ void loop() {
 // handleRoot - bring out configuration page
 // -----------------------------------------------------------------------------
 void handleRoot() {
+  char buffer[16];                 // Room for a number to be merged in
 #if CONFIG_TEST_OUTPUT == 1
   Serial.println("root request");
 #endif
   // Setup HTML with embedded values from EEPROM - if any.
+  // The page is streamed in chunks, the fixed parts directly from flash, so no page copy is built in RAM.
   PGM_P HTTP_HEAD  = PSTR("<!DOCTYPE html><html lang=\"en\"><head><meta charset=\"utf-8\">" \
     "<title>Smart socket setup</title>" \
     "<style type=\"text/css\">" \
@@ -1302,37 +2721,58 @@ void handleRoot() {
     "</style></head><body><h1>Socket setup</h1>" \
     "<form><fieldset style=\"background-color:#FFEFD5\"><legend>WiFi network</legend>" \
     "<label for=\"ssid\">SSID</label><input type=\"text\" id=\"ssid\" name=\"ssid\" maxlength=32 size=40 required value=\"");
-  String page = FPSTR(HTTP_HEAD)
-    + String(C_SSID); // merge in home network SSID
   PGM_P M1 = PSTR("\"><br/>" \
     "<label for=\"pwd\">Password</label><input type=\"password\" id=\"pwd\" name=\"pwd\" maxlength=32 size=40 value=\"");
-  page += FPSTR(M1)
-    + String(C_PWD); // merge in home network password
   PGM_P M2 = PSTR("\">" \
     "</fieldset><p/><fieldset style=\"background-color:#DCDCDC\"><legend>Device settings</legend>" \
     "<label for=\"device\">Device name</label><input type=\"text\" id=\"device\" name=\"device\" maxlength=32 size=40 pattern=\"[A-Za-z0-9_-]+\" required value=\"");
-  page += FPSTR(M2) + String(DEVNAME);  // merge in WeMo/OTA device name
   PGM_P M3 = PSTR("\"><br/>" \
     "<label for=\"otapwd\">OTA Password</label><input type=\"text\" id=\"otapwd\" name=\"otapwd\" maxlength=32 size=40 value=\"");
-  page += FPSTR(M3) + String(O_PWD);  // merge in OTA password
   PGM_P M4 = PSTR("\">" \
     "</fieldset><p/>" \
     "<input type=\"submit\" value=\"Save\" name=\"send\" formaction=\"/save\" class=\"button\" style=\"color:black;background-color:#32CD32\">" \
     "</form><p/><table><tr><td>ESP ID</td><td>");
-  page += FPSTR(M4) + String(ESP.getFlashChipId(), HEX);
   PGM_P M5 = PSTR("</td></tr><tr><td>Speed</td><td>" );
-  page += FPSTR(M5) + String(ESP.getFlashChipSpeed());
   PGM_P M6 = PSTR("</td></tr><tr><td>Flash size</td><td>");
-  page += FPSTR(M6) + String(ESP.getFlashChipRealSize());
   PGM_P M7 =PSTR("</td></tr><tr><td>Flash mode</td><td>");
-  page += FPSTR(M7) + String(ESP.getFlashChipMode());
   PGM_P HTTP_TAIL = PSTR("</td></tr></table><p/><form>" \
     "<input type=\"submit\" value=\"Reset\" name=\"send\" formaction=\"/reset\" class=\"button\" style=\"color:white;background-color:#FF4500\">" \
     "</form></body></html>");
-  page += FPSTR(HTTP_TAIL);
 
-  // Send out page
-  server.send(200, "text/html", page);
+  // Send out page. Length is not known in advance, so it goes chunked
+  server.setContentLength(CONTENT_LENGTH_UNKNOWN);
+  server.send(200, "text/html", "");
+  server.sendContent_P(HTTP_HEAD);
+  server.sendContent(C_SSID);      // merge in home network SSID
+  server.sendContent_P(M1);
+  server.sendContent(C_PWD);       // merge in home network password
+  server.sendContent_P(M2);
+  server.sendContent(DEVNAME);     // merge in WeMo/OTA device name
+  server.sendContent_P(M3);
+  server.sendContent(O_PWD);       // merge in OTA password
+  server.sendContent_P(M4);
+#if defined(ESP32)
+  snprintf(buffer, sizeof(buffer), "%x", (unsigned int)chipId());
+#else
+  snprintf(buffer, sizeof(buffer), "%x", (unsigned int)ESP.getFlashChipId());
+#endif
+  server.sendContent(buffer);
+  server.sendContent_P(M5);
+  snprintf(buffer, sizeof(buffer), "%u", (unsigned int)ESP.getFlashChipSpeed());
+  server.sendContent(buffer);
+  server.sendContent_P(M6);
+#if defined(ESP32)
+  snprintf(buffer, sizeof(buffer), "%u", (unsigned int)ESP.getFlashChipSize());
+#else
+  snprintf(buffer, sizeof(buffer), "%u", (unsigned int)ESP.getFlashChipRealSize());
+#endif
+  server.sendContent(buffer);
+  server.sendContent_P(M7);
+  snprintf(buffer, sizeof(buffer), "%u", (unsigned int)ESP.getFlashChipMode());
+  server.sendContent(buffer);
+  server.sendContent_P(HTTP_TAIL);
+  // Empty chunk terminates the page
+  server.sendContent("");
 }
 
 // -----------------------------------------------------------------------------
@@ -1342,6 +2782,8 @@ void handleRestart() {
 #if CONFIG_TEST_OUTPUT == 1
   Serial.println("restart request");
 #endif
+  persister.flush();
+  SAVE_JOURNAL();
   ESP.restart();
 }
 
@@ -1379,18 +2821,28 @@ void handleSave() {
 }
 
 void handleNotFound() {
-  String message = "File Not Found\n\n";
-  message += "URI: ";
-  message += server.uri();
-  message += "\nMethod: ";
-  message += (server.method() == HTTP_GET) ? "GET" : "POST";
-  message += "\nArguments: ";
-  message += server.args();
-  message += "\n";
-  for (uint8_t i = 0; i < server.args(); i++) { message += " " + server.argName(i) + ": " + server.arg(i) + "\n"; }
-  server.send(404, "text/plain", message);
+  char buffer[16];                 // Room for the argument count
+  // Stream the message in chunks instead of building it in RAM
+  server.setContentLength(CONTENT_LENGTH_UNKNOWN);
+  server.send(404, "text/plain", "");
+  server.sendContent_P(PSTR("File Not Found\n\nURI: "));
+  server.sendContent(server.uri());
+  server.sendContent_P(PSTR("\nMethod: "));
+  server.sendContent_P((server.method() == HTTP_GET) ? PSTR("GET") : PSTR("POST"));
+  server.sendContent_P(PSTR("\nArguments: "));
+  snprintf(buffer, sizeof(buffer), "%d\n", server.args());
+  server.sendContent(buffer);
+  for (uint8_t i = 0; i < server.args(); i++) {
+    server.sendContent_P(PSTR(" "));
+    server.sendContent(server.argName(i));
+    server.sendContent_P(PSTR(": "));
+    server.sendContent(server.arg(i));
+    server.sendContent_P(PSTR("\n"));
+  }
+  // Empty chunk terminates the message
+  server.sendContent("");
 #if CONFIG_TEST_OUTPUT == 1
   Serial.println("illegal request");
-  Serial.println(message);
+  Serial.println(server.uri().c_str());
 #endif
 }